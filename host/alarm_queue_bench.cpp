@@ -0,0 +1,209 @@
+/**
+ * Compares AlarmQueue with the container it replaced: a vector of HwAlarms
+ * kept sorted by the next firing, where an insertion scans the vector and
+ * computes each firing with the DateTime calendar math, as the scheduler
+ * did before the heap. A sorted vector with cached fire times is measured
+ * too, it's the best that container gets.
+ *
+ * usage: alarm_queue_bench
+ * prints host ns per operation for 10, 100 and 1000 HwAlarms
+ */
+
+#include <chrono>
+#include <random>
+
+#include "AlarmQueue.hpp"
+
+
+// Monday, 2024/01/01 00:00 UTC
+static const uint32_t benchStart = 1704067200;
+
+using Clock = std::chrono::steady_clock;
+
+
+/*
+ * Each container keeps the time of the last firing as its clock, a firing
+ * moves the earliest HwAlarm to its next firing after that
+ */
+
+/* The old container: sorted by firings recomputed on every comparison */
+class DateTimeVector {
+public:
+    void push(const HwAlarm &alarm)
+    {
+        DateTime now(m_now);
+        DateTime fireTime = alarm.referenceNextFiring(now);
+
+        for (auto it = m_alarms.begin(); it != m_alarms.end(); ++it) {
+            if (fireTime <= it->referenceNextFiring(now)) {
+                m_alarms.insert(it, alarm);
+                return;
+            }
+        }
+        m_alarms.push_back(alarm);
+    }
+
+    void fire()
+    {
+        HwAlarm fired = m_alarms.front();
+
+        m_now = fired.referenceNextFiring(DateTime(m_now)).unixtime();
+        m_alarms.erase(m_alarms.begin());
+        push(fired);
+    }
+
+    void removeParent(uint16_t parentIndex)
+    {
+        m_alarms.erase(
+            std::remove_if(
+                m_alarms.begin(), m_alarms.end(),
+                [&](const HwAlarm &alarm) { return alarm.parentIndex() == parentIndex; }
+            ),
+            m_alarms.end()
+        );
+    }
+
+private:
+    std::vector<HwAlarm> m_alarms;
+    uint32_t             m_now = benchStart;
+};
+
+
+/* The old container with the fire times cached and a binary search */
+class CachedVector {
+public:
+    void push(const HwAlarm &alarm)
+    {
+        Entry entry {alarm.nextFiring(m_now), alarm};
+        auto it = std::upper_bound(
+            m_alarms.begin(), m_alarms.end(), entry,
+            [](const Entry &a, const Entry &b) { return a.fireTime < b.fireTime; }
+        );
+        m_alarms.insert(it, entry);
+    }
+
+    void fire()
+    {
+        Entry fired = m_alarms.front();
+
+        m_now = fired.fireTime;
+        m_alarms.erase(m_alarms.begin());
+        push(fired.alarm);
+    }
+
+    void removeParent(uint16_t parentIndex)
+    {
+        m_alarms.erase(
+            std::remove_if(
+                m_alarms.begin(), m_alarms.end(),
+                [&](const Entry &entry) { return entry.alarm.parentIndex() == parentIndex; }
+            ),
+            m_alarms.end()
+        );
+    }
+
+private:
+    struct Entry {
+        uint32_t fireTime;
+        HwAlarm  alarm;
+    };
+
+    std::vector<Entry> m_alarms;
+    uint32_t           m_now = benchStart;
+};
+
+
+/* AlarmQueue behind the same interface */
+class Heap {
+public:
+    void push(const HwAlarm &alarm)
+    {
+        m_queue.push(alarm, alarm.nextFiring(m_now));
+    }
+
+    void fire()
+    {
+        AlarmQueue::Entry fired = m_queue.top();
+
+        m_now = fired.fireTime;
+        m_queue.reschedule(fired.handle, m_queue[fired.handle].nextFiring(m_now));
+    }
+
+    void removeParent(uint16_t parentIndex) { m_queue.removeParent(parentIndex); }
+
+private:
+    AlarmQueue m_queue;
+    uint32_t   m_now = benchStart;
+};
+
+
+static double nsPerOp(Clock::duration time, size_t ops)
+{
+    return std::chrono::duration<double, std::nano>(time).count() / ops;
+}
+
+/* Alarms on random days, so each one has from 1 to 7 HwAlarms */
+static std::vector<HwAlarm> randomHwAlarms(size_t count, std::mt19937 &random)
+{
+    std::vector<HwAlarm> alarms;
+
+    for (uint16_t parent = 0; alarms.size() < count; ++parent) {
+        Alarm alarm(random() % 24, random() % 60, random() & 0x7f, true);
+
+        if (!alarm.usesDaysOfWeek()) {
+            alarms.emplace_back(alarm, parent);
+            continue;
+        }
+        for (byte day = 0; day < 7 && alarms.size() < count; ++day)
+            if (alarm.daysOfWeek.isSet(day))
+                alarms.emplace_back(alarm, parent, day);
+    }
+    return alarms;
+}
+
+template<class Queue>
+static void bench(const char *name, const std::vector<HwAlarm> &alarms)
+{
+    const size_t firings = 2000;
+    std::vector<std::vector<HwAlarm>> byParent(alarms.back().parentIndex() + 1);
+    Queue queue;
+
+    for (const HwAlarm &alarm : alarms)
+        byParent[alarm.parentIndex()].push_back(alarm);
+
+    Clock::time_point start = Clock::now();
+    for (const HwAlarm &alarm : alarms)
+        queue.push(alarm);
+    double push = nsPerOp(Clock::now() - start, alarms.size());
+
+    start = Clock::now();
+    for (size_t i = 0; i < firings; ++i)
+        queue.fire();
+    double fire = nsPerOp(Clock::now() - start, firings);
+
+    // an alarm is edited: its HwAlarms are removed and pushed again
+    start = Clock::now();
+    for (uint16_t parent = 0; parent < byParent.size(); ++parent) {
+        queue.removeParent(parent);
+        for (const HwAlarm &alarm : byParent[parent])
+            queue.push(alarm);
+    }
+    double edit = nsPerOp(Clock::now() - start, byParent.size());
+
+    printf("%-16s %6zu %12.0f %12.0f %12.0f\n", name, alarms.size(), push, fire, edit);
+}
+
+int main()
+{
+    std::mt19937 random(1);
+
+    printf("%-16s %6s %12s %12s %12s\n", "container", "size", "push, ns", "fire, ns", "edit, ns");
+    for (size_t count : {10, 100, 1000}) {
+        std::vector<HwAlarm> alarms = randomHwAlarms(count, random);
+
+        bench<DateTimeVector>("DateTime vector", alarms);
+        bench<CachedVector>("cached vector", alarms);
+        bench<Heap>("AlarmQueue", alarms);
+    }
+    return 0;
+}
@@ -0,0 +1,486 @@
+/**
+ * Runs AlarmScheduler under simulated time against a model of DS3231 and
+ * of the player, while a random user edits the alarms, and checks every
+ * firing against a brute-force model of when the alarms are due.
+ *
+ * The glue between the scheduler and the hardware mirrors AlarmService:
+ * an interrupt clears the fired flags, fires the due alarms, rearms the
+ * slots and posts one more firing if another one is already due. The
+ * interrupt is dequeued after a random latency, a mutation can run before
+ * it, as when the clock is a bit ahead of the RTC. Clock adjustments are
+ * not simulated.
+ *
+ * usage: alarm_sim [days] [seed]
+ * exits with 1 if any firing is lost, early or duplicated
+ */
+
+#include <chrono>
+#include <cinttypes>
+#include <map>
+#include <random>
+#include <set>
+
+#include "AlarmScheduler.hpp"
+
+
+// Monday, 2024/01/01 00:00 UTC
+static const uint32_t simStart = 1704067200;
+static const uint32_t playerTimeout = 100;  // s, as AlarmService starts the player
+
+using Clock = std::chrono::steady_clock;
+
+
+/* Cost of one kind of work of the scheduler, host ns */
+struct Cost {
+    uint64_t count = 0;
+    uint64_t total = 0;
+    uint64_t max = 0;
+
+    void add(Clock::duration time)
+    {
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+        ++count;
+        total += ns;
+        max = std::max(max, ns);
+    }
+
+    void print(const char *name) const
+    {
+        printf(
+            "%-10s %8llu  avg %6llu ns  max %7llu ns\n", name,
+            (unsigned long long)count,
+            (unsigned long long)(count != 0 ? total / count : 0),
+            (unsigned long long)max
+        );
+    }
+};
+
+
+/*
+ * Both slots of DS3231 in the day-of-week mode. A slot matching the time
+ * sets its flag even if its interrupt is disabled, INT is low while any
+ * enabled slot has its flag set, and only its falling edge interrupts;
+ * so does arming a slot whose flag is still set.
+ */
+class SimDs3231 {
+public:
+    void setAlarm(int slot, uint32_t time)
+    {
+        m_slots[slot].time = time;
+        m_slots[slot].enabled = true;
+        ++programs;
+        updateInt();
+    }
+
+    void disableAlarm(int slot)
+    {
+        m_slots[slot].enabled = false;
+        ++programs;
+        updateInt();
+    }
+
+    bool alarmFired(int slot) const { return m_slots[slot].flag; }
+
+    void clearAlarm(int slot)
+    {
+        m_slots[slot].flag = false;
+        updateInt();
+    }
+
+    void tick(uint32_t minuteStart)
+    {
+        uint16_t minute = HwAlarm::minuteOfPeriodAt(minuteStart, HwAlarm::minutesPerWeek);
+
+        for (Slot &slot : m_slots)
+            if (slot.time != 0
+                && HwAlarm::minuteOfPeriodAt(slot.time, HwAlarm::minutesPerWeek) == minute)
+                slot.flag = true;
+        updateInt();
+    }
+
+    // true once per falling edge of INT
+    bool takeInterrupt()
+    {
+        bool edge = m_edge;
+        m_edge = false;
+        return edge;
+    }
+
+    uint32_t programs = 0;  // I2C transactions to arm or disarm a slot
+
+private:
+    struct Slot {
+        uint32_t time;  // only its minute of the week is matched
+        bool     enabled;
+        bool     flag;
+    };
+
+    void updateInt()
+    {
+        bool low = (m_slots[0].enabled && m_slots[0].flag)
+                   || (m_slots[1].enabled && m_slots[1].flag);
+        m_edge |= low && !m_intLow;
+        m_intLow = low;
+    }
+
+    Slot m_slots[2] = {};
+    bool m_intLow = false;
+    bool m_edge = false;
+};
+
+
+/* When the alarms are due, computed minute by minute from their settings */
+class DueModel {
+public:
+    struct Settings {
+        byte     hour;
+        byte     minute;
+        uint8_t  daysMask;
+        bool     enabled;
+        uint32_t since;  // a firing counts from the minute after this time
+    };
+
+    void set(Alarm::id_t id, const Alarm &alarm, uint32_t now, bool rescheduled)
+    {
+        Settings &settings = m_alarms[id];
+        uint32_t since = rescheduled ? now : settings.since;
+
+        settings = {
+            alarm.hour, alarm.minute, alarm.daysOfWeek.daysMask, alarm.enabled, since};
+    }
+
+    void erase(Alarm::id_t id) { m_alarms.erase(id); }
+
+    // the alarms due at the start of the minute, one-shot ones are disabled
+    std::vector<Alarm::id_t> dueAt(uint32_t minuteStart)
+    {
+        std::vector<Alarm::id_t> due;
+        uint16_t minuteOfWeek =
+            HwAlarm::minuteOfPeriodAt(minuteStart, HwAlarm::minutesPerWeek);
+        byte dayOfWeek = minuteOfWeek / HwAlarm::minutesPerDay;
+        uint16_t minuteOfDay = minuteOfWeek % HwAlarm::minutesPerDay;
+
+        for (auto &[id, settings] : m_alarms) {
+            if (!settings.enabled || settings.since >= minuteStart
+                || settings.hour * 60 + settings.minute != minuteOfDay)
+                continue;
+            if (settings.daysMask == Alarm::DaysOfWeek::noDays)
+                settings.enabled = false;
+            else if (!(settings.daysMask & 1 << dayOfWeek))
+                continue;
+            due.push_back(id);
+        }
+        return due;
+    }
+
+private:
+    std::map<Alarm::id_t, Settings> m_alarms;
+};
+
+
+class Simulation {
+public:
+    Simulation(unsigned seed) : m_random(seed) {}
+
+    bool run(uint32_t days);
+
+private:
+    using Firing = std::pair<Alarm::id_t, uint32_t>;  // alarm and its fire time
+
+    // the part of AlarmService that runs on an RTC interrupt
+    void onInterrupt(uint32_t now);
+    void updateAlarms();
+    bool isOverdue(uint32_t now) const;
+    void postCommand();
+    void processCommands(uint32_t now);  // the queued interrupts
+
+    // random edits, as the API would execute them on the event loop
+    void mutate(uint32_t now);
+    Alarm randomAlarm(uint32_t now);
+    Alarm::id_t randomId();
+
+    void startPlayer(Alarm::id_t id, uint32_t now);
+    void updatePlayer(uint32_t now);
+
+    std::mt19937   m_random;
+    AlarmScheduler m_scheduler;
+    SimDs3231      m_rtc;
+    uint32_t       m_armedTimes[2] = {};
+    DueModel       m_model;
+
+    std::vector<Alarm::id_t> m_ids;
+    std::set<Firing>         m_expected;   // due by the model, not fired yet
+    std::set<Firing>         m_delivered;  // fired, to catch duplicates
+
+    unsigned    m_commands = 0;  // FireAlarm commands in the ISR queue
+    Alarm::id_t m_playing = 0;
+    uint32_t    m_playerStop = 0;     // when the user stops it
+    uint32_t    m_playerTimeout = 0;
+
+    uint32_t m_fired = 0, m_skipped = 0, m_missed = 0;
+    uint32_t m_interrupts = 0, m_spurious = 0, m_overdue = 0, m_mutations = 0;
+    uint32_t m_early = 0, m_duplicate = 0, m_lost = 0;
+    Cost     m_fireCost, m_mutationCost;
+};
+
+bool Simulation::run(uint32_t days)
+{
+    for (int i = 0; i < 40; ++i) {
+        Alarm *alarm = m_scheduler.insert(randomAlarm(simStart), simStart);
+        m_ids.push_back(alarm->id());
+        m_model.set(alarm->id(), *alarm, simStart, true);
+    }
+    updateAlarms();
+
+    for (uint32_t minute = simStart + 60; minute < simStart + days * 86400; minute += 60) {
+        for (Alarm::id_t id : m_model.dueAt(minute))
+            m_expected.insert({id, minute});
+
+        // the event loop takes a while to dequeue the interrupt, a busy one
+        // takes longer; the user acts at any second of the minute
+        uint32_t latency = m_random() % 10 == 0 ? 5 + m_random() % 25 : m_random() % 3;
+        uint32_t mutationAt = m_random() % 60;
+        bool mutates = m_random() % 30 == 0;
+
+        m_rtc.tick(minute);
+        if (m_rtc.takeInterrupt())
+            postCommand();
+        if (mutates && mutationAt < latency) {
+            mutate(minute + mutationAt);
+            if (m_rtc.takeInterrupt())
+                postCommand();
+        }
+        processCommands(minute + latency);
+        if (mutates && mutationAt >= latency) {
+            mutate(minute + mutationAt);
+            if (m_rtc.takeInterrupt())
+                postCommand();
+            processCommands(minute + mutationAt);
+        }
+        updatePlayer(minute + 59);
+
+        // whatever the model expected a minute ago had to fire by now
+        for (auto it = m_expected.begin(); it != m_expected.end();) {
+            if (it->second + 60 > minute) {
+                ++it;
+                continue;
+            }
+            log_e("Alarm %" PRIx64 " due at %u never fired", it->first, it->second);
+            ++m_lost;
+            it = m_expected.erase(it);
+        }
+    }
+
+    printf(
+        "%u days, %u alarms, %u HwAlarms scheduled at the end\n", days,
+        (unsigned)m_scheduler.alarms().size(), (unsigned)m_scheduler.queue().size()
+    );
+    printf(
+        "fired %u, skipped %u, missed %u; %u mutations\n", m_fired, m_skipped,
+        m_missed, m_mutations
+    );
+    printf(
+        "interrupts %u, spurious %u, overdue %u, slot programs %u\n", m_interrupts,
+        m_spurious, m_overdue, m_rtc.programs
+    );
+    m_fireCost.print("firing");
+    m_mutationCost.print("mutation");
+    printf(
+        "early %u, duplicate %u, lost %u\n", m_early, m_duplicate,
+        m_lost + (uint32_t)m_expected.size()
+    );
+    return m_early == 0 && m_duplicate == 0 && m_lost == 0 && m_expected.empty();
+}
+
+void Simulation::onInterrupt(uint32_t now)
+{
+    Clock::time_point start = Clock::now();
+
+    for (int slot = 0; slot < 2; ++slot) {
+        if (m_rtc.alarmFired(slot)) {
+            m_rtc.clearAlarm(slot);
+            m_armedTimes[slot] = 0;
+        }
+    }
+
+    std::vector<AlarmScheduler::Firing> firings = m_scheduler.fire(now);
+    updateAlarms();
+    m_fireCost.add(Clock::now() - start);
+
+    if (firings.empty())
+        ++m_spurious;
+    for (size_t i = 0; i < firings.size(); ++i) {
+        Firing firing(firings[i].id, firings[i].fireTime);
+
+        if (firing.second > now) {
+            log_e("Alarm %" PRIx64 " due at %u fired early at %u", firing.first, firing.second, now);
+            ++m_early;
+        } else if (!m_delivered.insert(firing).second) {
+            log_e("Alarm %" PRIx64 " due at %u fired twice", firing.first, firing.second);
+            ++m_duplicate;
+        }
+        m_expected.erase(firing);
+
+        if (i == 0)
+            startPlayer(firing.first, now);
+        else
+            ++m_skipped;
+    }
+
+    // AlarmService posts itself one more FireAlarm command
+    if (isOverdue(now)) {
+        ++m_overdue;
+        postCommand();
+    }
+}
+
+void Simulation::postCommand()
+{
+    // the ISR queue holds 3 commands, the rest are dropped
+    m_commands = std::min(m_commands + 1, 3u);
+}
+
+void Simulation::processCommands(uint32_t now)
+{
+    while (m_commands != 0) {
+        --m_commands;
+        ++m_interrupts;
+        onInterrupt(now);
+        // rearming a slot with a stale flag interrupts at once
+        if (m_rtc.takeInterrupt())
+            postCommand();
+    }
+}
+
+void Simulation::updateAlarms()
+{
+    AlarmScheduler::SlotPlan plan = m_scheduler.planSlots(m_armedTimes);
+
+    for (int slot = 0; slot < 2; ++slot) {
+        if (!plan.program[slot])
+            continue;
+        if (plan.times[slot] != 0)
+            m_rtc.setAlarm(slot, plan.times[slot]);
+        else
+            m_rtc.disableAlarm(slot);
+        m_armedTimes[slot] = plan.times[slot];
+    }
+}
+
+bool Simulation::isOverdue(uint32_t now) const
+{
+    const AlarmQueue &queue = m_scheduler.queue();
+
+    return (!queue.empty() && queue.top().fireTime <= now) || m_rtc.alarmFired(0)
+           || m_rtc.alarmFired(1);
+}
+
+void Simulation::mutate(uint32_t now)
+{
+    Clock::time_point start = Clock::now();
+    Alarm::id_t id = m_ids.empty() ? 0 : randomId();
+    Alarm *alarm = m_scheduler.find(id);
+    bool rescheduled = true;
+
+    // a firing of the changed alarm that hasn't rung yet never will
+    for (auto it = m_expected.begin(); it != m_expected.end();)
+        it = it->first == id ? m_expected.erase(it) : std::next(it);
+
+    ++m_mutations;
+    switch (m_ids.empty() ? 0 : m_random() % 6) {
+    case 0: {
+        alarm = m_scheduler.insert(randomAlarm(now), now);
+        id = alarm->id();
+        m_ids.push_back(id);
+        break;
+    }
+    case 1:
+        m_scheduler.erase(id);
+        m_ids.erase(std::find(m_ids.begin(), m_ids.end(), id));
+        m_model.erase(id);
+        alarm = nullptr;
+        break;
+
+    case 2:
+        alarm->enabled = !alarm->enabled;
+        if (alarm->enabled)
+            m_scheduler.schedule(*alarm, now);
+        else
+            m_scheduler.unschedule(*alarm);
+        break;
+
+    case 3:
+    case 4: {
+        Alarm time = randomAlarm(now);
+        alarm->hour = time.hour;
+        alarm->minute = time.minute;
+        m_scheduler.retime(*alarm, now);
+        break;
+    }
+    case 5:
+        alarm->daysOfWeek = randomAlarm(now).daysOfWeek;
+        rescheduled = alarm->enabled;
+        if (rescheduled) {
+            m_scheduler.unschedule(*alarm);
+            m_scheduler.schedule(*alarm, now);
+        }
+        break;
+    }
+    updateAlarms();
+    m_mutationCost.add(Clock::now() - start);
+
+    if (alarm != nullptr)
+        m_model.set(id, *alarm, now, rescheduled);
+}
+
+Alarm Simulation::randomAlarm(uint32_t now)
+{
+    static const uint8_t masks[] = {
+        Alarm::DaysOfWeek::noDays, Alarm::DaysOfWeek::everyDay, 0b0011111,
+        0b1100000};
+    uint8_t mask = m_random() % 2 ? masks[m_random() % 4] : m_random() & 0x7f;
+    DateTime time(now);
+
+    // a user often sets the alarm for the current minute, to try it out
+    if (m_random() % 4 == 0)
+        return Alarm(time.hour(), time.minute(), mask, true);
+    return Alarm(m_random() % 24, m_random() % 60, mask, m_random() % 8 != 0);
+}
+
+Alarm::id_t Simulation::randomId()
+{
+    return m_ids[m_random() % m_ids.size()];
+}
+
+void Simulation::startPlayer(Alarm::id_t id, uint32_t now)
+{
+    // a firing while the ringtone plays is only a chime over it
+    if (m_playing != 0) {
+        ++m_skipped;
+        return;
+    }
+    m_playing = id;
+    m_playerTimeout = now + playerTimeout;
+    m_playerStop = now + 5 + m_random() % 150;
+    ++m_fired;
+}
+
+void Simulation::updatePlayer(uint32_t now)
+{
+    if (m_playing == 0)
+        return;
+    if (m_playerTimeout <= std::min(m_playerStop, now)) {
+        ++m_missed;
+        m_playing = 0;
+    } else if (m_playerStop <= now) {
+        m_playing = 0;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t days = argc > 1 ? atoi(argv[1]) : 365;
+    unsigned seed = argc > 2 ? atoi(argv[2]) : 1;
+
+    return Simulation(seed).run(days) ? 0 : 1;
+}
@@ -0,0 +1,119 @@
+/**
+ * Streams GET /alarms through AlarmsWriter for snapshots of 10, 1k and 10k
+ * alarms, as mgCallback does: a chunk at a time into the send buffer of a
+ * connection, which is emptied after each one as if it went to the socket.
+ * Every third alarm has a ringtone, so the names are there too.
+ *
+ * Heap allocations are counted while the body is written; the buffer of
+ * the connection is mongoose's and isn't counted.
+ *
+ * It's built with ArduinoJson and mongoose, see the Makefile.
+ *
+ * usage: alarms_bench [responses]
+ * prints the chunks, the body size and the host time per response
+ */
+
+#include <chrono>
+#include <new>
+
+#include "AlarmTable.hpp"
+#include "BodyWriters.hpp"
+
+
+using Clock = std::chrono::steady_clock;
+
+static size_t allocations = 0;
+
+void *operator new(size_t size)
+{
+    ++allocations;
+    if (void *ptr = malloc(size))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+// RingtonesWriter's, RingtoneLibrary.cpp needs the SD card
+const char *RingtoneLibrary::codecName(Codec)
+{
+    return "mp3";
+}
+
+
+static AlarmService::SnapshotPtr makeSnapshot(size_t alarms, size_t ringtones)
+{
+    auto       snapshot = std::make_shared<AlarmService::Snapshot>();
+    AlarmTable table;  // assigns the ids
+
+    for (size_t i = 0; i < alarms; ++i) {
+        Alarm alarm(i % 24, i % 60, i & 0x7f, i % 2 == 0);
+        alarm.ringtone = i % 3 == 0 ? i / 3 % ringtones + 1 : RingtoneLibrary::defaultRingtone;
+        table.insert(alarm);
+    }
+    snapshot->version = 1;
+    snapshot->alarms.reserve(table.size());
+    table.forEach([&](const Alarm &alarm) { snapshot->alarms.push_back(alarm); });
+    return snapshot;
+}
+
+static RingtoneLibrary::CatalogPtr makeCatalog(size_t ringtones)
+{
+    auto catalog = std::make_shared<RingtoneLibrary::Catalog>();
+
+    for (size_t i = 0; i < ringtones; ++i) {
+        RingtoneLibrary::Entry entry = {};
+        entry.name = "ringtone_" + std::to_string(i) + ".mp3";
+        entry.available = true;
+        catalog->entries.push_back(entry);
+    }
+    return catalog;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t responses = argc > 1 ? strtoul(argv[1], nullptr, 10) : 20;
+    RingtoneLibrary::CatalogPtr catalog = makeCatalog(8);
+
+    printf(
+        "%-8s %8s %12s %12s %12s\n", "alarms", "chunks", "bytes", "time, us",
+        "allocations"
+    );
+    for (size_t alarms : {10, 1000, 10000}) {
+        AlarmService::SnapshotPtr snapshot = makeSnapshot(alarms, catalog->entries.size());
+        mg_connection conn = {};
+        size_t chunks = 0, bytes = 0, allocated = 0;
+
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < responses; ++i) {
+            size_t before = allocations;
+            // as api::getAlarms() hands it to mgCallback
+            std::unique_ptr<UrlParser::BodyWriter> body =
+                std::make_unique<AlarmsWriter>(snapshot, catalog);
+
+            chunks = bytes = 0;
+            while (body->write(&conn)) {
+                ++chunks;
+                bytes += conn.send.len;
+                conn.send.len = 0;
+            }
+            allocated = allocations - before;
+        }
+        double us = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+
+        printf(
+            "%-8zu %8zu %12zu %12.1f %12zu\n", alarms, chunks, bytes,
+            us / responses, allocated
+        );
+        mg_iobuf_free(&conn.send);
+    }
+    return 0;
+}
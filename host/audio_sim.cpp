@@ -0,0 +1,338 @@
+/**
+ * Runs AudioLooper under simulated time against a model of the decoder and
+ * of I2S (shims/Audio.h), with the ringtone on a slow SD card, while alarms
+ * prime, start, chime and stop the player as AlarmService does. What the
+ * player accounts for itself is printed next to what reached the DAC: the
+ * underruns, the latency from a command to the sound and the gaps where the
+ * ringtone loops.
+ *
+ * The card takes openTime to open the file and frameTime to read and decode
+ * a frame, seeking back to the first frame takes seekTime more; a read
+ * stalls for 50 to 300 ms now and then, as cards do while erasing blocks.
+ *
+ * usage: audio_sim [seconds] [seed] [wav file]
+ * the WAV file gets what the DAC played, with each idle pause cut to a second;
+ * exits with 1 if the player's counters disagree with the DAC
+ */
+
+#include <cinttypes>
+#include <math.h>
+#include <random>
+
+#include "AudioLooper.hpp"
+#include "sim_rtos.hpp"
+
+
+static const uint32_t sampleRate = 44100;
+static const uint32_t dmaSamples = 8 * 512;      // the I2S DMA buffers of the library
+static const uint32_t ringtoneFrames = 96;       // 2.5 s, so it loops a lot
+static const int64_t  openTime = 30000;          // us
+static const int64_t  frameTime = 5000;          // us, the read and the decoding
+static const int64_t  seekTime = 8000;           // us
+static const uint32_t stallPermille = 5;         // of the reads
+static const int64_t  minStallTime = 50000;      // us
+static const int64_t  maxStallTime = 300000;     // us
+static const uint32_t autoStopSeconds = 10;      // for the alarms with a timeout
+
+
+static int64_t randomTime(std::mt19937 &random, int64_t min, int64_t max)
+{
+    return std::uniform_int_distribution<int64_t>(min, max)(random);
+}
+
+static double ms(int64_t us)
+{
+    return us / 1000.0;
+}
+
+
+/* The ringtone, a 440 Hz tone, on the card */
+class SlowSd : public Audio::Source {
+public:
+    SlowSd(std::mt19937 &random) : m_random(random) {}
+
+    bool open(const char *) override
+    {
+        simRtos::delay(openTime);
+        m_next = 0;
+        return true;
+    }
+
+    uint32_t frames() const override { return ringtoneFrames; }
+    uint32_t sampleRate() const override { return ::sampleRate; }
+
+    void read(uint32_t frame, int16_t *samples) override
+    {
+        int64_t time = frameTime;
+
+        if (frame != m_next)
+            time += seekTime;
+        if (m_random() % 1000 < stallPermille) {
+            time += randomTime(m_random, minStallTime, maxStallTime);
+            ++stalls;
+        }
+        simRtos::delay(time);
+        m_next = frame + 1;
+        rewound = frame == 0;
+
+        for (uint32_t i = 0; i < Audio::frameSamples; ++i) {
+            uint32_t n = frame * Audio::frameSamples + i;
+            samples[2 * i] = samples[2 * i + 1] = 8000 * sinf(2 * (float)M_PI * 440 * n / ::sampleRate);
+        }
+    }
+
+    bool     rewound = false;  // the last read was the first frame
+    uint32_t stalls = 0;
+
+private:
+    std::mt19937 &m_random;
+    uint32_t      m_next = 0;  // frame, reading any other one seeks
+};
+
+
+/* Latencies or gaps, in whatever unit they're added */
+struct Measure {
+    uint32_t count = 0;
+    int64_t  total = 0;
+    int64_t  max = 0;
+
+    void add(int64_t value)
+    {
+        ++count;
+        total += value;
+        max = std::max(max, value);
+    }
+
+    int64_t average() const { return count != 0 ? total / count : 0; }
+};
+
+
+/*
+ * What the speaker gets. The player is told to start and stop by the
+ * harness, the DAC sees when the sound actually starts, breaks and ends
+ */
+class Dac : public Audio::Sink {
+public:
+    Dac(SlowSd &sd, const char *wavPath) : m_sd(sd)
+    {
+        if (wavPath == nullptr)
+            return;
+        m_wav = fopen(wavPath, "wb");
+        if (m_wav == nullptr)
+            log_e("Could not open %s", wavPath);
+        else
+            writeWavHeader();
+    }
+
+    ~Dac()
+    {
+        if (m_wav != nullptr) {
+            writeWavHeader();  // with the sizes now
+            fclose(m_wav);
+        }
+    }
+
+    void start()
+    {
+        finishStop();
+        m_state = Starting;
+        m_commandTime = simRtos::now();
+    }
+
+    void stop()
+    {
+        if (m_state != Starting && m_state != Playing)
+            return;
+        m_state = Stopping;
+        m_commandTime = simRtos::now();
+    }
+
+    // the sound of the last stop has ended for sure
+    void finishStop()
+    {
+        if (m_state != Stopping)
+            return;
+        stopLatency.add(std::max<int64_t>(timeAt(m_end) - m_commandTime, 0));
+        m_state = Idle;
+    }
+
+    void write(uint64_t position, const int16_t *samples, uint16_t frames) override
+    {
+        uint64_t gap = position - std::min(position, m_end);
+        // the pauses between the alarms are cut in the WAV, the breaks aren't
+        uint64_t silence = m_state == Starting ? std::min<uint64_t>(gap, sampleRate) : gap;
+
+        switch (m_state) {
+        case Starting:
+            startLatency.add(timeAt(position) - m_commandTime);
+            m_state = Playing;
+            break;
+        case Playing:
+        case Stopping:  // the fade out plays until the decoder stops
+            if (gap != 0) {
+                ++underruns;
+                underrunSamples += gap;
+            }
+            if (m_sd.rewound)
+                loopGaps.add(gap);
+            break;
+        default:
+            break;
+        }
+        m_sd.rewound = false;
+
+        if (m_wav != nullptr) {
+            writeSilence(silence);
+            fwrite(samples, 2 * sizeof(int16_t), frames, m_wav);
+            m_wavFrames += frames;
+        }
+        m_end = position + frames;
+    }
+
+    Measure  startLatency;  // us, from start() to the first sample played
+    Measure  stopLatency;   // us, from stop() to the last one
+    Measure  loopGaps;      // samples
+    // the output ran dry between two frames, the fade out included
+    uint32_t underruns = 0;
+    uint64_t underrunSamples = 0;
+
+private:
+    enum State { Idle, Starting, Playing, Stopping };
+
+    static int64_t timeAt(uint64_t position)
+    {
+        return position * 1000000 / sampleRate;
+    }
+
+    void writeSilence(uint64_t frames)
+    {
+        static const int16_t zeros[2 * 256] = {};
+
+        for (uint64_t left = frames; left != 0;) {
+            size_t chunk = std::min<uint64_t>(left, 256);
+            fwrite(zeros, 2 * sizeof(int16_t), chunk, m_wav);
+            left -= chunk;
+        }
+        m_wavFrames += frames;
+    }
+
+    void writeWavHeader()
+    {
+        uint32_t dataSize = m_wavFrames * 4;
+        uint32_t header[11] = {
+            0x46464952, 36 + dataSize, 0x45564157,  // "RIFF", size, "WAVE"
+            0x20746d66, 16, 0x00020001,             // "fmt ", PCM, stereo
+            sampleRate, sampleRate * 4, 0x00100004, // 4 bytes per frame, 16 bits
+            0x61746164, dataSize                    // "data"
+        };
+
+        fseek(m_wav, 0, SEEK_SET);
+        fwrite(header, sizeof(header), 1, m_wav);
+        fseek(m_wav, 0, SEEK_END);
+    }
+
+    SlowSd   &m_sd;
+    State     m_state = Idle;
+    int64_t   m_commandTime = 0;
+    uint64_t  m_end = 0;  // output sample the last frame ended at
+    FILE     *m_wav = nullptr;
+    uint64_t  m_wavFrames = 0;
+};
+
+
+int main(int argc, char *argv[])
+{
+    int64_t      end = (argc > 1 ? strtoul(argv[1], nullptr, 10) : 600) * 1000000LL;
+    std::mt19937 random(argc > 2 ? strtoul(argv[2], nullptr, 10) : 1);
+    SlowSd       sd(random);
+    Dac          dac(sd, argc > 3 ? argv[3] : nullptr);
+    Audio        audio(sd, dac, sampleRate, dmaSamples);
+    AudioLooper  looper(&audio);
+    AudioLooper::Track track;
+    uint32_t     alarms = 0, primed = 0, autoStops = 0, chimes = 0;
+
+    AudioLooper::makeTrack("/ringtones/morning.mp3", track);
+    looper.begin([&] {
+        dac.stop();
+        ++autoStops;
+    });
+
+    while (simRtos::now() < end) {
+        // AlarmService primes the player for the next alarm, unless the
+        // alarm is added right before it fires
+        if (random() % 4 != 0) {
+            looper.prime(track);
+            ++primed;
+        }
+        simRtos::runUntil(simRtos::now() + randomTime(random, 1000000, 4000000));
+
+        bool    timeout = random() % 3 == 0;
+        int64_t started = simRtos::now();
+        int64_t playTime = randomTime(random, 3000000, 20000000);
+
+        dac.start();
+        looper.start(track, timeout ? autoStopSeconds : 0);
+        ++alarms;
+        if (random() % 3 == 0) {
+            simRtos::runUntil(started + playTime / 2);
+            looper.chime();
+            ++chimes;
+        }
+        simRtos::runUntil(started + playTime);
+        if (!timeout || playTime < autoStopSeconds * 1000000) {
+            dac.stop();
+            looper.stop();
+        }
+    }
+    simRtos::runUntil(simRtos::now() + 1000000);  // the last fade out
+    dac.finishStop();
+
+    AudioLooper::Stats stats = looper.stats();
+    printf(
+        "%" PRId64 " s, %u alarms, %u primed, %u stopped by the timeout, %u chimes, %u SD stalls\n",
+        end / 1000000, alarms, primed, autoStops, chimes, sd.stalls
+    );
+    printf("%-22s %-32s %s\n", "", "at the DAC", "AudioLooper::stats()");
+    printf(
+        "%-22s %-32u %u\n", "starts", dac.startLatency.count, stats.starts
+    );
+    printf(
+        "%-22s avg %6.1f  max %6.1f ms        last %6.1f  max %6.1f ms\n",
+        "start latency", ms(dac.startLatency.average()), ms(dac.startLatency.max),
+        ms(stats.lastStartLatency), ms(stats.maxStartLatency)
+    );
+    printf("%-22s %-32u %u\n", "stops", dac.stopLatency.count, stats.stops);
+    printf(
+        "%-22s avg %6.1f  max %6.1f ms        last %6.1f  max %6.1f ms\n",
+        "stop latency", ms(dac.stopLatency.average()), ms(dac.stopLatency.max),
+        ms(stats.lastStopLatency), ms(stats.maxStopLatency)
+    );
+    printf(
+        "%-22s %-5u (%8.1f ms of silence)   %u\n", "underruns", dac.underruns,
+        ms(dac.underrunSamples * 1000000 / sampleRate), stats.underruns
+    );
+    printf(
+        "%-22s %-32u %u (%u reconnects)\n", "loops", dac.loopGaps.count,
+        stats.loops, stats.reconnects
+    );
+    printf(
+        "%-22s avg %6" PRId64 "  max %6" PRId64 "            last %6u  max %6u\n",
+        "loop gap, samples", dac.loopGaps.average(), dac.loopGaps.max,
+        stats.lastGapSamples, stats.maxGapSamples
+    );
+    printf(
+        "%-22s %u idle, %u playing; busy %.1f%% of the playing time\n",
+        "pump wakeups", stats.wakeups[0], stats.wakeups[1],
+        stats.totalTime[1] != 0 ? 100.0 * stats.busyTime[1] / stats.totalTime[1] : 0
+    );
+
+    // the player measures a gap from its own clock, it may round the other way
+    bool agrees = stats.starts == dac.startLatency.count
+                  && stats.stops == dac.stopLatency.count
+                  && stats.underruns == dac.underruns
+                  && stats.loops == dac.loopGaps.count
+                  && std::abs((int64_t)stats.maxGapSamples - dac.loopGaps.max) <= 1;
+    if (!agrees)
+        printf("AudioLooper::stats() disagree with the DAC\n");
+    return agrees ? 0 : 1;
+}
@@ -0,0 +1,91 @@
+/**
+ * Compares adding alarms one request at a time with adding them in one
+ * POST /alarms/batch, on the scheduling side: each request to AlarmService
+ * ends with a flush, which plans the DS3231 slots, publishes a snapshot and
+ * commits the store, so N requests flush N times and a batch flushes once.
+ *
+ * The host can't time the I2C writes and the SD commits, they're counted
+ * instead; the time of whole requests on the device is logged by the web
+ * server task.
+ *
+ * usage: batch_bench [alarms]
+ * prints host us per way and the RTC slot programs and flushes it took
+ */
+
+#include <chrono>
+#include <random>
+
+#include "AlarmScheduler.hpp"
+
+
+// Monday, 2024/01/01 00:00 UTC
+static const uint32_t benchStart = 1704067200;
+
+using Clock = std::chrono::steady_clock;
+
+
+struct Flushes {
+    uint32_t armed[2] = {};
+    size_t   flushes = 0;
+    size_t   programs = 0;  // DS3231 slots written
+    size_t   copied = 0;    // alarms copied to snapshots
+
+    void flush(AlarmScheduler &scheduler)
+    {
+        AlarmScheduler::SlotPlan plan = scheduler.planSlots(armed);
+        std::vector<Alarm> snapshot;
+
+        for (int slot = 0; slot < 2; ++slot) {
+            if (plan.program[slot]) {
+                armed[slot] = plan.times[slot];
+                ++programs;
+            }
+        }
+        snapshot.reserve(scheduler.alarms().size());
+        scheduler.alarms().forEach([&](const Alarm &alarm) { snapshot.push_back(alarm); });
+        copied += snapshot.size();
+        ++flushes;
+    }
+};
+
+static void report(const char *name, Clock::duration time, const Flushes &flushes)
+{
+    printf(
+        "%-10s %10.1f us %8zu flushes %8zu slot programs %8zu alarms copied\n",
+        name, std::chrono::duration<double, std::micro>(time).count(),
+        flushes.flushes, flushes.programs, flushes.copied
+    );
+}
+
+int main(int argc, char *argv[])
+{
+    size_t count = argc > 1 ? strtoul(argv[1], nullptr, 10) : 100;
+    std::mt19937 random(1);
+    std::vector<Alarm> alarms;
+
+    for (size_t i = 0; i < count; ++i)
+        alarms.emplace_back(random() % 24, random() % 60, random() & 0x7f, true);
+
+    {
+        AlarmScheduler scheduler;
+        Flushes flushes;
+        Clock::time_point start = Clock::now();
+
+        for (const Alarm &alarm : alarms) {
+            scheduler.insert(alarm, benchStart);
+            flushes.flush(scheduler);
+        }
+        report("one by one", Clock::now() - start, flushes);
+    }
+    {
+        AlarmScheduler scheduler;
+        Flushes flushes;
+        Clock::time_point start = Clock::now();
+
+        for (const Alarm &alarm : alarms)
+            scheduler.insert(alarm, benchStart);
+        flushes.flush(scheduler);
+        report("batch", Clock::now() - start, flushes);
+    }
+    return 0;
+}
@@ -0,0 +1,181 @@
+/**
+ * Checks the integer HwAlarm::nextFiring() and hasFired() against their
+ * DateTime-based reference versions, the code they replaced: a table of
+ * the edge cases (the minute of the firing itself, the ends of the day and
+ * of the week, the year and the leap day) with the expected times, then
+ * random alarms at random times. The batch nextFirings() is checked
+ * against nextFiring() on the same random alarms.
+ *
+ * usage: nextfiring_test [cases] [seed]
+ * exits with 1 on any mismatch
+ */
+
+#include <random>
+
+#include "Alarm.hpp"
+
+
+static const byte daily = 0xff;  // not bound to a day of week
+
+/* An alarm at `hour:minute` on `day` (0 is Monday), or every day */
+static HwAlarm makeHwAlarm(byte hour, byte minute, byte day)
+{
+    if (day == daily)
+        return HwAlarm(Alarm(hour, minute, Alarm::DaysOfWeek::everyDay), 0);
+    return HwAlarm(Alarm(hour, minute, uint8_t(1 << day)), 0, day);
+}
+
+struct NextFiringCase {
+    const char *name;
+    byte        hour, minute, day;
+    DateTime    now;
+    DateTime    expected;
+};
+
+struct HasFiredCase {
+    const char *name;
+    byte        hour, minute, day;
+    DateTime    when;
+    bool        expected;
+};
+
+// 2024/01/01 is Monday, 2024/01/07 is Sunday
+static const NextFiringCase nextFiringCases[] = {
+    {"daily, a second before", 7, 30, daily,
+     DateTime(2024, 1, 1, 7, 29, 59), DateTime(2024, 1, 1, 7, 30)},
+    {"daily, now == firing", 7, 30, daily,
+     DateTime(2024, 1, 1, 7, 30, 0), DateTime(2024, 1, 2, 7, 30)},
+    {"daily, end of the firing minute", 7, 30, daily,
+     DateTime(2024, 1, 1, 7, 30, 59), DateTime(2024, 1, 2, 7, 30)},
+    {"daily, a minute after", 7, 30, daily,
+     DateTime(2024, 1, 1, 7, 31, 0), DateTime(2024, 1, 2, 7, 30)},
+    {"daily midnight, end of the day", 0, 0, daily,
+     DateTime(2024, 1, 1, 23, 59, 59), DateTime(2024, 1, 2, 0, 0)},
+    {"daily midnight, now == firing", 0, 0, daily,
+     DateTime(2024, 1, 2, 0, 0, 0), DateTime(2024, 1, 3, 0, 0)},
+    {"daily last minute, now == firing", 23, 59, daily,
+     DateTime(2024, 1, 2, 23, 59, 0), DateTime(2024, 1, 3, 23, 59)},
+    {"daily, Sunday to Monday", 6, 0, daily,
+     DateTime(2024, 1, 7, 22, 0, 0), DateTime(2024, 1, 8, 6, 0)},
+    {"daily, end of the year", 0, 0, daily,
+     DateTime(2024, 12, 31, 23, 59, 59), DateTime(2025, 1, 1, 0, 0)},
+    {"daily, leap day", 6, 0, daily,
+     DateTime(2024, 2, 28, 12, 0, 0), DateTime(2024, 2, 29, 6, 0)},
+    {"Monday midnight, week wrap", 0, 0, 0,
+     DateTime(2024, 1, 7, 23, 59, 59), DateTime(2024, 1, 8, 0, 0)},
+    {"Monday midnight, now == firing", 0, 0, 0,
+     DateTime(2024, 1, 8, 0, 0, 0), DateTime(2024, 1, 15, 0, 0)},
+    {"Sunday last minute, from Monday", 23, 59, 6,
+     DateTime(2024, 1, 1, 0, 0, 0), DateTime(2024, 1, 7, 23, 59)},
+    {"Sunday last minute, now == firing", 23, 59, 6,
+     DateTime(2024, 1, 7, 23, 59, 30), DateTime(2024, 1, 14, 23, 59)},
+    {"Wednesday, the same day", 12, 0, 2,
+     DateTime(2024, 1, 3, 11, 59, 0), DateTime(2024, 1, 3, 12, 0)},
+    {"Wednesday, a day later", 12, 0, 2,
+     DateTime(2024, 1, 4, 11, 59, 0), DateTime(2024, 1, 10, 12, 0)},
+    {"Friday, across the year", 8, 0, 4,
+     DateTime(2024, 12, 28, 8, 0, 0), DateTime(2025, 1, 3, 8, 0)},
+};
+
+static const HasFiredCase hasFiredCases[] = {
+    {"daily, a second before", 7, 30, daily, DateTime(2024, 1, 1, 7, 29, 59), false},
+    {"daily, when == firing", 7, 30, daily, DateTime(2024, 1, 1, 7, 30, 0), true},
+    {"daily midnight, at midnight", 0, 0, daily, DateTime(2024, 1, 1, 0, 0, 0), true},
+    {"daily last minute, a minute before", 23, 59, daily,
+     DateTime(2024, 1, 1, 23, 58, 59), false},
+    {"Monday midnight, on Sunday", 0, 0, 0, DateTime(2024, 1, 7, 23, 59, 0), true},
+    {"Sunday last minute, on Monday", 23, 59, 6, DateTime(2024, 1, 8, 0, 0, 0), false},
+    {"Sunday last minute, when == firing", 23, 59, 6,
+     DateTime(2024, 1, 7, 23, 59, 0), true},
+    {"Wednesday, on Tuesday", 12, 0, 2, DateTime(2024, 1, 2, 12, 0, 0), false},
+};
+
+static int failures = 0;
+
+static void fail(const char *what, const HwAlarm &alarm, const DateTime &now)
+{
+    if (++failures <= 20) {
+        printf(
+            "FAIL %s: %02u:%02u day %u, now %s\n", what, alarm.hour(),
+            alarm.minute(), alarm.usesDaysOfWeek() ? alarm.dayOfWeek() : daily,
+            now.timestamp().c_str()
+        );
+    }
+}
+
+static void checkTable()
+{
+    for (const NextFiringCase &c : nextFiringCases) {
+        HwAlarm alarm = makeHwAlarm(c.hour, c.minute, c.day);
+
+        if (alarm.nextFiring(c.now.unixtime()) != c.expected.unixtime())
+            fail(c.name, alarm, c.now);
+        if (alarm.referenceNextFiring(c.now) != c.expected)
+            fail(c.name, alarm, c.now);
+    }
+    for (const HasFiredCase &c : hasFiredCases) {
+        HwAlarm alarm = makeHwAlarm(c.hour, c.minute, c.day);
+
+        if (alarm.hasFired(c.when.unixtime()) != c.expected)
+            fail(c.name, alarm, c.when);
+        if (alarm.referenceHasFired(c.when) != c.expected)
+            fail(c.name, alarm, c.when);
+    }
+}
+
+static void checkRandom(size_t cases, std::mt19937 &random)
+{
+    const size_t batch = 64;
+    // 2000/01/01 to 2099/12/31, the range DS3231 keeps
+    std::uniform_int_distribution<uint32_t> times(946684800, 4102444799);
+    std::vector<HwAlarm> alarms;
+    std::vector<uint32_t> fireTimes(batch);
+
+    for (size_t i = 0; i < cases; i += batch) {
+        uint32_t now = times(random);
+        // every 4th time is right at some minute, as RTC interrupts are
+        if (random() % 4 == 0)
+            now -= now % 60;
+
+        alarms.clear();
+        for (size_t j = 0; j < batch; ++j) {
+            byte day = random() % 8;
+            alarms.push_back(
+                makeHwAlarm(random() % 24, random() % 60, day == 7 ? daily : day)
+            );
+        }
+
+        HwAlarm::nextFirings(alarms.data(), batch, now, fireTimes.data());
+        for (size_t j = 0; j < batch; ++j) {
+            const HwAlarm &alarm = alarms[j];
+            uint32_t next = alarm.nextFiring(now);
+
+            if (next != alarm.referenceNextFiring(DateTime(now)).unixtime())
+                fail("random nextFiring", alarm, DateTime(now));
+            if (fireTimes[j] != next)
+                fail("random nextFirings", alarm, DateTime(now));
+            if (alarm.hasFired(now) != alarm.referenceHasFired(DateTime(now)))
+                fail("random hasFired", alarm, DateTime(now));
+            // the firing itself is `now == firing` for the next lookup
+            if (alarm.nextFiring(next) <= next)
+                fail("random firing twice", alarm, DateTime(next));
+            if (!alarm.hasFired(next) || !alarm.referenceHasFired(DateTime(next)))
+                fail("random hasFired at the firing", alarm, DateTime(next));
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    size_t cases = argc > 1 ? strtoul(argv[1], nullptr, 10) : 100000;
+    std::mt19937 random(argc > 2 ? strtoul(argv[2], nullptr, 10) : 1);
+
+    checkTable();
+    checkRandom(cases, random);
+
+    printf(
+        "%zu table cases, %zu random cases, %d failures\n",
+        std::size(nextFiringCases) + std::size(hasFiredCases), cases, failures
+    );
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,45 @@
+#ifndef Arduino_h
+#define Arduino_h
+/*
+ * The part of the Arduino core the host builds need. Logging goes to
+ * stderr, only errors by default; pass -DHOST_LOG_LEVEL=5 to see them all
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "esp_timer.h"
+
+typedef uint8_t byte;
+
+#define IRAM_ATTR
+
+#define ARDUHAL_LOG_LEVEL_NONE    0
+#define ARDUHAL_LOG_LEVEL_ERROR   1
+#define ARDUHAL_LOG_LEVEL_WARN    2
+#define ARDUHAL_LOG_LEVEL_INFO    3
+#define ARDUHAL_LOG_LEVEL_DEBUG   4
+#define ARDUHAL_LOG_LEVEL_VERBOSE 5
+
+#ifndef HOST_LOG_LEVEL
+#define HOST_LOG_LEVEL ARDUHAL_LOG_LEVEL_ERROR
+#endif
+#define ARDUHAL_LOG_LEVEL HOST_LOG_LEVEL
+
+#define host_log(level, letter, format, ...)                                   \
+    do {                                                                       \
+        if (HOST_LOG_LEVEL >= (level))                                         \
+            fprintf(stderr, "[" letter "] " format "\n", ##__VA_ARGS__);       \
+    } while (0)
+
+#define log_e(format, ...) host_log(ARDUHAL_LOG_LEVEL_ERROR, "E", format, ##__VA_ARGS__)
+#define log_w(format, ...) host_log(ARDUHAL_LOG_LEVEL_WARN, "W", format, ##__VA_ARGS__)
+#define log_i(format, ...) host_log(ARDUHAL_LOG_LEVEL_INFO, "I", format, ##__VA_ARGS__)
+#define log_d(format, ...) host_log(ARDUHAL_LOG_LEVEL_DEBUG, "D", format, ##__VA_ARGS__)
+#define log_v(format, ...) host_log(ARDUHAL_LOG_LEVEL_VERBOSE, "V", format, ##__VA_ARGS__)
+
+#endif  // #ifdef Arduino_h
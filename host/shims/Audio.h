@@ -0,0 +1,140 @@
+#ifndef Audio_h
+#define Audio_h
+/*
+ * A model of ESP32-audioI2S with the calls AudioLooper makes. The decoder
+ * reads whole frames of a Source, which stands for the file on the SD card
+ * and its decoding, and hands them to I2S once there's room in the DMA
+ * buffers. I2S plays them into a Sink at the output rate of the simulated
+ * clock, with silence wherever the decoder didn't keep up.
+ */
+
+#include <vector>
+
+#include "Arduino.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+
+
+// the hook of the library, called with each decoded frame before I2S
+void audio_process_extern(int16_t *buff, uint16_t len, bool *continueI2S);
+
+class Audio {
+public:
+    static const uint16_t frameSamples = 1152;  // an MP3 frame
+    static const uint32_t frameBytes = 418;     // at 128 kbit/s and 44.1 kHz
+
+    /* A decoded file; open() and read() take the simulated time they model */
+    class Source {
+    public:
+        virtual ~Source() = default;
+        virtual bool     open(const char *path) = 0;  // false if there's no such file
+        virtual uint32_t frames() const = 0;
+        virtual uint32_t sampleRate() const = 0;
+        // fills frameSamples interleaved stereo samples of `frame`
+        virtual void     read(uint32_t frame, int16_t *samples) = 0;
+    };
+
+    /* The DAC, gets the frames at the sample of the output they're played at */
+    class Sink {
+    public:
+        virtual ~Sink() = default;
+        virtual void write(uint64_t position, const int16_t *samples, uint16_t frames) = 0;
+    };
+
+    // the DMA buffers hold `dmaSamples`, the output runs at `outputRate`
+    Audio(Source &source, Sink &sink, uint32_t outputRate, uint32_t dmaSamples)
+        : m_source(source), m_sink(sink), m_outputRate(outputRate),
+          m_dmaSamples(dmaSamples), m_buffer(2 * frameSamples)
+    {}
+
+    bool connecttoSD(const char *path, uint32_t resumeFilePos = 0)
+    {
+        stopSong();
+        if (!m_source.open(path))
+            return false;
+        m_open = m_running = true;
+        m_frame = 0;
+        m_firstByte = resumeFilePos;
+        m_sampleRate = 0;  // known once the first frame is decoded
+        return true;
+    }
+
+    bool setFileLoop(bool loop)
+    {
+        m_fileLoop = loop;
+        return true;
+    }
+
+    // pausing stops the decoder, the file stays open
+    bool pauseResume()
+    {
+        if (!m_open)
+            return false;
+        m_running = !m_running;
+        return true;
+    }
+
+    uint32_t stopSong()
+    {
+        uint32_t filePos = getFilePos();
+
+        m_open = m_running = false;
+        return filePos;
+    }
+
+    bool     isRunning() const { return m_running; }
+    uint32_t getSampleRate() const { return m_sampleRate; }
+    uint32_t getFilePos() const { return m_open ? m_firstByte + m_frame * frameBytes : 0; }
+
+    // decodes a frame if the DMA buffers have room for it
+    void loop()
+    {
+        if (!m_running)
+            return;
+        uint64_t played = outputPosition();
+        if (m_queuedUntil > played && m_queuedUntil - played + frameSamples > m_dmaSamples)
+            return;
+
+        if (m_frame == m_source.frames()) {
+            if (!m_fileLoop) {
+                stopSong();
+                return;
+            }
+            m_frame = 0;  // seeks back to the first frame
+        }
+        m_source.read(m_frame++, m_buffer.data());
+        m_sampleRate = m_source.sampleRate();
+
+        bool continueI2S = true;
+        audio_process_extern(m_buffer.data(), frameSamples, &continueI2S);
+        if (!continueI2S)
+            return;
+
+        // the read took time, the output may have run dry meanwhile
+        uint64_t position = std::max(outputPosition(), m_queuedUntil);
+        m_sink.write(position, m_buffer.data(), frameSamples);
+        m_queuedUntil = position + frameSamples;
+    }
+
+private:
+    uint64_t outputPosition() const
+    {
+        return (uint64_t)esp_timer_get_time() * m_outputRate / 1000000;
+    }
+
+    Source               &m_source;
+    Sink                 &m_sink;
+    uint32_t              m_outputRate;
+    uint32_t              m_dmaSamples;
+    std::vector<int16_t>  m_buffer;
+    bool                  m_open = false;
+    bool                  m_running = false;
+    bool                  m_fileLoop = false;
+    uint32_t              m_frame = 0;       // the next one to decode
+    uint32_t              m_firstByte = 0;
+    uint32_t              m_sampleRate = 0;
+    uint64_t              m_queuedUntil = 0; // output sample the DMA buffers end at
+};
+
+#endif  // #ifdef Audio_h
@@ -0,0 +1,120 @@
+#ifndef RTClib_h
+#define RTClib_h
+/*
+ * DateTime and TimeSpan of RTClib for the host builds, with the same
+ * calendar math over unixtime (UTC, no time zones); there's no RTC here,
+ * the simulators model DS3231 themselves
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+
+class RTC_DS3231;
+
+
+class TimeSpan {
+public:
+    TimeSpan(int32_t seconds = 0) : m_seconds(seconds) {}
+    TimeSpan(int16_t days, int8_t hours, int8_t minutes, int8_t seconds) :
+    m_seconds(days * 86400L + hours * 3600L + minutes * 60L + seconds)
+    {}
+
+    int32_t totalseconds() const { return m_seconds; }
+
+private:
+    int32_t m_seconds;
+};
+
+
+class DateTime {
+public:
+    DateTime(uint32_t unixtime = 946684800) : m_unixtime(unixtime) {}
+    DateTime(
+        uint16_t year, uint8_t month, uint8_t day, uint8_t hour = 0,
+        uint8_t minute = 0, uint8_t second = 0
+    ) :
+    m_unixtime(
+        daysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60
+        + second
+    )
+    {}
+
+    uint16_t year()         const { return civil().year; }
+    uint8_t  month()        const { return civil().month; }
+    uint8_t  day()          const { return civil().day; }
+    uint8_t  hour()         const { return m_unixtime / 3600 % 24; }
+    uint8_t  minute()       const { return m_unixtime / 60 % 60; }
+    uint8_t  second()       const { return m_unixtime % 60; }
+    // 0 is Sunday, 1970/01/01 was Thursday
+    uint8_t  dayOfTheWeek() const { return (m_unixtime / 86400 + 4) % 7; }
+    uint32_t unixtime()     const { return m_unixtime; }
+
+    std::string timestamp() const
+    {
+        char buf[26];  // the widest values the types allow
+        snprintf(
+            buf, sizeof(buf), "%04u-%02u-%02uT%02u:%02u:%02u", year(), month(),
+            day(), hour(), minute(), second()
+        );
+        return buf;
+    }
+
+    DateTime operator+(const TimeSpan &span) const
+    {
+        return DateTime(m_unixtime + span.totalseconds());
+    }
+    DateTime operator-(const TimeSpan &span) const
+    {
+        return DateTime(m_unixtime - span.totalseconds());
+    }
+    TimeSpan operator-(const DateTime &right) const
+    {
+        return TimeSpan(m_unixtime - right.m_unixtime);
+    }
+
+    bool operator<(const DateTime &right) const  { return m_unixtime < right.m_unixtime; }
+    bool operator>(const DateTime &right) const  { return right < *this; }
+    bool operator<=(const DateTime &right) const { return !(right < *this); }
+    bool operator>=(const DateTime &right) const { return !(*this < right); }
+    bool operator==(const DateTime &right) const { return m_unixtime == right.m_unixtime; }
+    bool operator!=(const DateTime &right) const { return !(*this == right); }
+
+private:
+    struct Civil {
+        uint16_t year;
+        uint8_t  month;
+        uint8_t  day;
+    };
+
+    // days since 1970/01/01 of a date of the proleptic Gregorian calendar
+    static uint32_t daysFromCivil(int year, unsigned month, unsigned day)
+    {
+        year -= month <= 2;
+        int era = year / 400;
+        unsigned yearOfEra = year - era * 400;
+        unsigned dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+        unsigned dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+        return era * 146097 + dayOfEra - 719468;
+    }
+
+    Civil civil() const
+    {
+        uint32_t days = m_unixtime / 86400 + 719468;
+        uint32_t era = days / 146097;
+        uint32_t dayOfEra = days - era * 146097;
+        uint32_t yearOfEra =
+            (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+        uint32_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+        uint32_t mp = (5 * dayOfYear + 2) / 153;
+        uint8_t  day = dayOfYear - (153 * mp + 2) / 5 + 1;
+        uint8_t  month = mp < 10 ? mp + 3 : mp - 9;
+
+        return {uint16_t(yearOfEra + era * 400 + (month <= 2)), month, day};
+    }
+
+    uint32_t m_unixtime;
+};
+
+#endif  // #ifdef RTClib_h
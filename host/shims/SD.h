@@ -0,0 +1,136 @@
+#ifndef SD_h
+#define SD_h
+/*
+ * The SD card, kept in memory, with the calls AlarmStore makes; the player
+ * reaches the card only through Audio, see Audio.h.
+ *
+ * Each change of the card (a write, a truncation, a remove or a rename) is
+ * a step. A test can cut the power after a step: the changes after it are
+ * lost while the code goes on as if they were made, so the files are left
+ * as they were at that moment.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+
+#define FILE_READ   "r"
+#define FILE_WRITE  "w"
+#define FILE_APPEND "a"
+
+class File {
+public:
+    File() = default;
+
+    explicit operator bool() const { return m_files != nullptr; }
+
+    size_t size() const { return data().size(); }
+
+    size_t read(uint8_t *buf, size_t size)
+    {
+        const std::vector<uint8_t> &bytes = data();
+        size_t count = std::min(size, bytes.size() - std::min(m_position, bytes.size()));
+
+        std::copy_n(bytes.begin() + m_position, count, buf);
+        m_position += count;
+        return count;
+    }
+
+    size_t write(const uint8_t *buf, size_t size);
+
+    void close() { m_files = nullptr; }
+
+private:
+    friend class SDFS;
+    using files_t = std::map<std::string, std::vector<uint8_t>>;
+
+    File(files_t *files, const std::string &path) : m_files(files), m_path(path) {}
+
+    const std::vector<uint8_t> &data() const
+    {
+        static const std::vector<uint8_t> none;
+        auto it = m_files->find(m_path);
+        return it != m_files->end() ? it->second : none;
+    }
+
+    files_t     *m_files = nullptr;
+    std::string  m_path;
+    size_t       m_position = 0;
+};
+
+class SDFS {
+public:
+    using files_t = File::files_t;
+
+    bool exists(const char *path) const
+    {
+        return files.count(path) != 0 || directories.count(path) != 0;
+    }
+
+    bool mkdir(const char *path)
+    {
+        directories.insert(path);
+        return true;
+    }
+
+    File open(const char *path, const char *mode)
+    {
+        bool exists = files.count(path) != 0;
+
+        if (mode[0] == 'r' && !exists)
+            return File();
+        if (mode[0] == 'w' || !exists) {
+            if (step())
+                files[path].clear();
+        }
+        File file(&files, path);
+        if (mode[0] == 'a')
+            file.m_position = file.size();
+        return file;
+    }
+
+    bool remove(const char *path)
+    {
+        if (!step())
+            return true;
+        return files.erase(path) != 0;
+    }
+
+    bool rename(const char *from, const char *to)
+    {
+        if (!step())
+            return true;
+        if (files.count(from) == 0 || files.count(to) != 0)
+            return false;
+        files[to] = std::move(files[from]);
+        files.erase(from);
+        return true;
+    }
+
+    // true if the change is made, false once the power is cut
+    bool step() { return ++steps <= powerLossStep; }
+
+    files_t               files;
+    std::set<std::string> directories;
+    size_t                steps = 0;                  // changes made so far
+    size_t                powerLossStep = SIZE_MAX;   // the last change made
+};
+
+inline SDFS SD;
+
+inline size_t File::write(const uint8_t *buf, size_t size)
+{
+    if (SD.step()) {
+        std::vector<uint8_t> &bytes = (*m_files)[m_path];
+        bytes.resize(std::max(bytes.size(), m_position + size));
+        std::copy_n(buf, size, bytes.begin() + m_position);
+    }
+    m_position += size;
+    return size;
+}
+
+#endif  // #ifdef SD_h
@@ -0,0 +1,20 @@
+#ifndef crc_h
+#define crc_h
+/* CRC-32 of the ROM, the little endian one of zlib */
+
+#include <cstddef>
+#include <cstdint>
+
+
+inline uint32_t crc32_le(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i) {
+        crc ^= buf[i];
+        for (int bit = 0; bit < 8; ++bit)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+#endif  // #ifdef crc_h
@@ -0,0 +1,9 @@
+#ifndef esp_timer_h
+#define esp_timer_h
+
+#include <cstdint>
+
+// us since boot; audio_sim and store_test link the simulated clock of sim_rtos.cpp
+int64_t esp_timer_get_time();
+
+#endif  // #ifdef esp_timer_h
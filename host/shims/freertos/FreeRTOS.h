@@ -0,0 +1,33 @@
+#ifndef FreeRTOS_h
+#define FreeRTOS_h
+/*
+ * The types the host builds see through Tools.hpp and the player; the
+ * tasks, queues and timers of audio_sim run on the simulated clock of
+ * sim_rtos.cpp
+ */
+
+#include <cassert>
+#include <cstdint>
+
+typedef void (*TaskFunction_t)(void *);
+
+typedef uint32_t     TickType_t;
+typedef int          BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define pdFALSE       0
+#define pdTRUE        1
+#define pdPASS        pdTRUE
+#define pdFAIL        pdFALSE
+#define errQUEUE_FULL 0
+
+#define portMAX_DELAY      ((TickType_t)0xffffffffUL)
+// the tick is 1 ms, as configured in the Arduino core
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms)  ((TickType_t)(ms))
+
+#define configASSERT(x) assert(x)
+
+#define NOINLINE_ATTR __attribute__((noinline))
+
+#endif  // #ifdef FreeRTOS_h
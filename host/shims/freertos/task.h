@@ -0,0 +1,15 @@
+#ifndef task_h
+#define task_h
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct tskTaskControlBlock *TaskHandle_t;
+
+BaseType_t xTaskCreate(
+    TaskFunction_t function, const char *name, uint32_t stackDepth,
+    void *parameters, UBaseType_t priority, TaskHandle_t *createdTask
+);
+void vTaskDelete(TaskHandle_t task);  // NULL deletes the calling task
+void vTaskDelay(TickType_t ticks);
+
+#endif  // #ifdef task_h
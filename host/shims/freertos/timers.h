@@ -0,0 +1,20 @@
+#ifndef timers_h
+#define timers_h
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct tmrTimerControl *TimerHandle_t;
+typedef void (*TimerCallbackFunction_t)(TimerHandle_t timer);
+
+TimerHandle_t xTimerCreate(
+    const char *name, TickType_t period, UBaseType_t autoReload, void *id,
+    TimerCallbackFunction_t callback
+);
+// the callbacks run in the thread that calls simRtos::runUntil()
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period, TickType_t ticksToWait);
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t ticksToWait);
+BaseType_t xTimerDelete(TimerHandle_t timer, TickType_t ticksToWait);
+BaseType_t xTimerIsTimerActive(TimerHandle_t timer);
+void *pvTimerGetTimerID(TimerHandle_t timer);
+
+#endif  // #ifdef timers_h
@@ -0,0 +1,329 @@
+#include "sim_rtos.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "esp_timer.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+
+
+static const int64_t forever = std::numeric_limits<int64_t>::max();
+
+struct QueueDefinition {
+    size_t                            length;
+    size_t                            itemSize;
+    std::deque<std::vector<uint8_t>>  items;
+};
+
+struct tskTaskControlBlock {
+    TaskFunction_t   function;
+    void            *parameters;
+    std::thread      thread;
+    bool             started = false;
+    bool             finished = false;
+    bool             deleted = false;
+    // what the blocked task waits for, whichever comes first
+    QueueDefinition *waitingOn = nullptr;
+    int64_t          wakeTime = forever;
+};
+
+struct tmrTimerControl {
+    TickType_t              period;
+    bool                    autoReload;
+    void                   *id;
+    TimerCallbackFunction_t callback;
+    bool                    active = false;
+    int64_t                 expiry = 0;
+};
+
+// thrown in a deleted task to unwind its stack
+struct TaskDeleted {};
+
+/*
+ * Whoever runs holds the baton: `running` is the task, or nullptr for the
+ * main thread. Kernel state is guarded by `kernelLock`, the code of the
+ * tasks runs without it.
+ */
+static std::mutex                         kernelLock;
+static std::condition_variable            batonPassed;
+static tskTaskControlBlock               *running = nullptr;
+static thread_local tskTaskControlBlock  *self = nullptr;
+static int64_t                            clockTime = 0;
+static std::vector<tskTaskControlBlock *> tasks;
+static std::vector<tmrTimerControl *>     timers;
+
+
+static bool isReady(const tskTaskControlBlock *task)
+{
+    if (task->finished)
+        return false;
+    return !task->started || task->wakeTime <= clockTime
+           || (task->waitingOn != nullptr && !task->waitingOn->items.empty());
+}
+
+/* Main thread: lets `task` run until it blocks or finishes */
+static void switchTo(std::unique_lock<std::mutex> &lock, tskTaskControlBlock *task)
+{
+    task->started = true;
+    running = task;
+    batonPassed.notify_all();
+    batonPassed.wait(lock, [] { return running == nullptr; });
+}
+
+/* Task: gives the baton back to the main thread until it's woken */
+static void block(std::unique_lock<std::mutex> &lock)
+{
+    tskTaskControlBlock *task = self;
+
+    running = nullptr;
+    batonPassed.notify_all();
+    batonPassed.wait(lock, [task] { return running == task; });
+    task->waitingOn = nullptr;
+    task->wakeTime = forever;
+    if (task->deleted)
+        throw TaskDeleted();
+}
+
+static void runReady(std::unique_lock<std::mutex> &lock)
+{
+    for (bool ran = true; ran;) {
+        ran = false;
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            if (isReady(tasks[i])) {
+                switchTo(lock, tasks[i]);
+                ran = true;
+            }
+        }
+    }
+}
+
+static void taskMain(tskTaskControlBlock *task)
+{
+    std::unique_lock<std::mutex> lock(kernelLock);
+
+    self = task;
+    batonPassed.wait(lock, [task] { return running == task; });
+    if (!task->deleted) {
+        lock.unlock();
+        try {
+            task->function(task->parameters);
+        } catch (const TaskDeleted &) {
+        }
+        lock.lock();
+    }
+    task->finished = true;
+    running = nullptr;
+    batonPassed.notify_all();
+}
+
+
+int64_t simRtos::now()
+{
+    std::lock_guard<std::mutex> lock(kernelLock);
+    return clockTime;
+}
+
+void simRtos::delay(int64_t us)
+{
+    std::unique_lock<std::mutex> lock(kernelLock);
+
+    if (self == nullptr) {
+        lock.unlock();
+        runUntil(now() + us);
+        return;
+    }
+    self->wakeTime = clockTime + us;
+    block(lock);
+}
+
+void simRtos::runUntil(int64_t time)
+{
+    std::unique_lock<std::mutex> lock(kernelLock);
+
+    while (true) {
+        runReady(lock);
+
+        int64_t          next = time;
+        tmrTimerControl *due = nullptr;
+        for (tskTaskControlBlock *task : tasks)
+            if (!task->finished)
+                next = std::min(next, task->wakeTime);
+        for (tmrTimerControl *timer : timers) {
+            if (timer->active && timer->expiry <= next) {
+                next = timer->expiry;
+                due = timer;
+            }
+        }
+        clockTime = std::max(clockTime, next);
+
+        if (due != nullptr) {
+            due->active = due->autoReload;
+            due->expiry += due->period * 1000;
+            lock.unlock();
+            due->callback(due);  // the timer daemon task
+            lock.lock();
+        } else if (next >= time) {
+            runReady(lock);
+            return;
+        }
+    }
+}
+
+int64_t esp_timer_get_time()
+{
+    return simRtos::now();
+}
+
+
+BaseType_t xTaskCreate(
+    TaskFunction_t function, const char *, uint32_t, void *parameters,
+    UBaseType_t, TaskHandle_t *createdTask
+)
+{
+    std::unique_lock<std::mutex> lock(kernelLock);
+    tskTaskControlBlock *task = new tskTaskControlBlock();
+
+    task->function = function;
+    task->parameters = parameters;
+    task->thread = std::thread(taskMain, task);
+    tasks.push_back(task);
+    if (createdTask != nullptr)
+        *createdTask = task;
+    if (self == nullptr)
+        runReady(lock);
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    std::unique_lock<std::mutex> lock(kernelLock);
+
+    if (task == nullptr || task == self) {
+        lock.unlock();
+        throw TaskDeleted();
+    }
+    // the task unwinds from where it's blocked
+    task->deleted = true;
+    if (!task->finished)
+        switchTo(lock, task);
+    lock.unlock();
+    task->thread.join();
+    lock.lock();
+    tasks.erase(std::find(tasks.begin(), tasks.end(), task));
+    delete task;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    simRtos::delay((int64_t)ticks * 1000);
+}
+
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize)
+{
+    return new QueueDefinition {length, itemSize, {}};
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    std::lock_guard<std::mutex> lock(kernelLock);
+
+    for (tskTaskControlBlock *task : tasks)
+        if (task->waitingOn == queue)
+            task->waitingOn = nullptr;  // blocks forever, as on the device
+    delete queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t)
+{
+    std::unique_lock<std::mutex> lock(kernelLock);
+
+    // a full queue would block the sender until a task receives, only the
+    // main thread can wait for that
+    if (queue->items.size() == queue->length && self == nullptr)
+        runReady(lock);
+    if (queue->items.size() == queue->length)
+        return errQUEUE_FULL;
+
+    const uint8_t *bytes = (const uint8_t *)item;
+    queue->items.emplace_back(bytes, bytes + queue->itemSize);
+    if (self == nullptr)
+        runReady(lock);
+    return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *buffer, TickType_t ticksToWait)
+{
+    std::unique_lock<std::mutex> lock(kernelLock);
+
+    if (queue->items.empty() && ticksToWait != 0 && self != nullptr) {
+        self->waitingOn = queue;
+        if (ticksToWait != portMAX_DELAY)
+            self->wakeTime = clockTime + (int64_t)ticksToWait * 1000;
+        block(lock);
+    }
+    if (queue->items.empty())
+        return pdFALSE;
+    memcpy(buffer, queue->items.front().data(), queue->itemSize);
+    queue->items.pop_front();
+    return pdTRUE;
+}
+
+
+TimerHandle_t xTimerCreate(
+    const char *, TickType_t period, UBaseType_t autoReload, void *id,
+    TimerCallbackFunction_t callback
+)
+{
+    std::lock_guard<std::mutex> lock(kernelLock);
+    tmrTimerControl *timer = new tmrTimerControl {period, autoReload != 0, id, callback};
+
+    timers.push_back(timer);
+    return timer;
+}
+
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period, TickType_t)
+{
+    std::lock_guard<std::mutex> lock(kernelLock);
+
+    timer->period = period;
+    timer->active = true;
+    timer->expiry = clockTime + (int64_t)period * 1000;
+    return pdPASS;
+}
+
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t)
+{
+    std::lock_guard<std::mutex> lock(kernelLock);
+
+    timer->active = false;
+    return pdPASS;
+}
+
+BaseType_t xTimerDelete(TimerHandle_t timer, TickType_t)
+{
+    std::lock_guard<std::mutex> lock(kernelLock);
+
+    timers.erase(std::find(timers.begin(), timers.end(), timer));
+    delete timer;
+    return pdPASS;
+}
+
+BaseType_t xTimerIsTimerActive(TimerHandle_t timer)
+{
+    std::lock_guard<std::mutex> lock(kernelLock);
+    return timer->active;
+}
+
+void *pvTimerGetTimerID(TimerHandle_t timer)
+{
+    return timer->id;
+}
@@ -0,0 +1,30 @@
+#ifndef sim_rtos_hpp
+#define sim_rtos_hpp
+/**
+ * Simulated time behind the FreeRTOS and esp_timer shims. Tasks are
+ * threads, but only one of them runs at a time and the clock stands still
+ * while it does; the clock moves only when every task is blocked, to the
+ * next timeout or software timer. A run is the same on every host and
+ * doesn't depend on the host's speed.
+ *
+ * The main thread drives the simulation: it calls the code under test as
+ * the other tasks of the firmware would, and runUntil() lets the tasks and
+ * the timers run. A send to a queue from the main thread wakes the task
+ * waiting on it at once, as the player's task has the highest priority.
+ */
+
+#include <cstdint>
+
+
+namespace simRtos {
+    int64_t now();  // us
+
+    // the calling task blocks for `us`, the time the work it models takes;
+    // the main thread runs the tasks and the timers meanwhile
+    void delay(int64_t us);
+
+    // runs the tasks and the timers up to `time`, us; main thread only
+    void runUntil(int64_t time);
+}
+
+#endif  // #ifdef sim_rtos_hpp
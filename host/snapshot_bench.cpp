@@ -0,0 +1,175 @@
+/**
+ * Measures the read path of GET /alarms under contention: reader threads
+ * serialize the alarms in a loop while a writer mutates them as fast as it
+ * can, as the event loop does in a storm of firings.
+ *
+ * Two ways of sharing the alarms are compared:
+ *  - snapshot: the writer publishes an immutable copy after each mutation
+ *    with std::atomic_store, readers std::atomic_load it, as AlarmService
+ *    does (see AlarmService::publishSnapshot())
+ *  - mutex: readers serialize the live table under the lock the writer
+ *    takes for each mutation, the alternative the snapshot replaced
+ *
+ * usage: snapshot_bench [alarms] [ms per run]
+ * prints host mutation latency of the writer and reads per second; the
+ * readers and the writer only overlap in time on a multi-core host
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "AlarmTable.hpp"
+
+
+using Clock = std::chrono::steady_clock;
+
+// a mutation this slow has waited for something, a reader or the host scheduler
+static const uint64_t stallNs = 100000;
+
+struct Snapshot {
+    uint32_t           version;
+    std::vector<Alarm> alarms;
+};
+
+
+/* Stands for the JSON serialization of GET /alarms */
+static size_t serialize(const Alarm &alarm, char *buf, size_t size)
+{
+    return snprintf(
+        buf, size, "{\"id\":%" PRIu64 ",\"hour\":%u,\"minute\":%u,\"days\":%u,\"enabled\":%d},",
+        alarm.id(), alarm.hour, alarm.minute, alarm.daysOfWeek.daysMask,
+        alarm.enabled
+    );
+}
+
+struct Result {
+    uint64_t mutations = 0;
+    uint64_t mutationNs = 0;
+    uint64_t maxMutationNs = 0;
+    uint64_t stalls = 0;  // mutations that took longer than stallNs
+    uint64_t reads = 0;
+};
+
+class Bench {
+public:
+    Bench(size_t alarms, bool snapshot) : m_useSnapshot(snapshot)
+    {
+        for (size_t i = 0; i < alarms; ++i)
+            m_ids.push_back(m_alarms.insert(Alarm(i % 24, i % 60, i & 0x7f, true))->id());
+        publish();
+    }
+
+    Result run(int readers, std::chrono::milliseconds time)
+    {
+        Result result;
+        std::atomic<uint64_t> reads{0};
+        std::vector<std::thread> threads;
+
+        for (int i = 0; i < readers; ++i)
+            threads.emplace_back([&] { reads += read(); });
+
+        Clock::time_point end = Clock::now() + time;
+        for (size_t i = 0; Clock::now() < end; ++i) {
+            Clock::time_point start = Clock::now();
+            mutate(m_ids[i % m_ids.size()]);
+            uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                Clock::now() - start
+            ).count();
+
+            ++result.mutations;
+            result.mutationNs += ns;
+            result.maxMutationNs = std::max(result.maxMutationNs, ns);
+            result.stalls += ns > stallNs;
+        }
+
+        m_stop = true;
+        for (auto &thread : threads)
+            thread.join();
+        result.reads = reads;
+        return result;
+    }
+
+private:
+    /* A firing: the alarm is toggled, as a one-shot alarm is disabled */
+    void mutate(Alarm::id_t id)
+    {
+        if (m_useSnapshot) {
+            Alarm *alarm = m_alarms.find(id);
+            alarm->enabled = !alarm->enabled;
+            publish();
+        } else {
+            std::lock_guard<std::mutex> guard(m_lock);
+            Alarm *alarm = m_alarms.find(id);
+            alarm->enabled = !alarm->enabled;
+        }
+    }
+
+    void publish()
+    {
+        auto snapshot = std::make_shared<Snapshot>();
+
+        snapshot->version = m_version++;
+        snapshot->alarms.reserve(m_alarms.size());
+        m_alarms.forEach([&](const Alarm &alarm) { snapshot->alarms.push_back(alarm); });
+        std::atomic_store(&m_snapshot, std::shared_ptr<const Snapshot>(snapshot));
+    }
+
+    uint64_t read()
+    {
+        char buf[128];
+        size_t bytes = 0;
+        uint64_t reads = 0;
+
+        while (!m_stop) {
+            if (m_useSnapshot) {
+                std::shared_ptr<const Snapshot> snapshot = std::atomic_load(&m_snapshot);
+                for (const Alarm &alarm : snapshot->alarms)
+                    bytes += serialize(alarm, buf, sizeof(buf));
+            } else {
+                std::lock_guard<std::mutex> guard(m_lock);
+                m_alarms.forEach([&](const Alarm &alarm) {
+                    bytes += serialize(alarm, buf, sizeof(buf));
+                });
+            }
+            ++reads;
+        }
+        return bytes > 0 ? reads : 0;
+    }
+
+    bool                            m_useSnapshot;
+    AlarmTable                      m_alarms;
+    std::vector<Alarm::id_t>        m_ids;
+    std::mutex                      m_lock;
+    std::shared_ptr<const Snapshot> m_snapshot;
+    uint32_t                        m_version = 0;
+    std::atomic<bool>               m_stop{false};
+};
+
+int main(int argc, char *argv[])
+{
+    size_t alarms = argc > 1 ? strtoul(argv[1], nullptr, 10) : 100;
+    std::chrono::milliseconds time(argc > 2 ? strtoul(argv[2], nullptr, 10) : 500);
+
+    printf(
+        "%-9s %7s %12s %14s %14s %8s %12s\n", "mode", "readers", "mutations/s",
+        "avg mutation", "max mutation", "stalls", "reads/s"
+    );
+    for (int readers : {0, 1, 2, 4}) {
+        for (bool snapshot : {true, false}) {
+            Result result = Bench(alarms, snapshot).run(readers, time);
+            double seconds = std::chrono::duration<double>(time).count();
+
+            printf(
+                "%-9s %7d %12.0f %11" PRIu64 " ns %11" PRIu64 " ns %8" PRIu64 " %12.0f\n",
+                snapshot ? "snapshot" : "mutex", readers,
+                result.mutations / seconds, result.mutationNs / result.mutations,
+                result.maxMutationNs, result.stalls, result.reads / seconds
+            );
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,194 @@
+/**
+ * Cuts the power after each change AlarmStore makes to the SD card (see
+ * shims/SD.h), for every commit of a run of random mutations that appends
+ * to the log and compacts it now and then. The store loaded after the power
+ * loss must have the alarms as they were before the commit or after it,
+ * and the commit after the reboot must keep them.
+ *
+ * usage: store_test [commits] [seed]
+ * exits with 1 on any mismatch
+ */
+
+#include <random>
+
+#include "AlarmStore.hpp"
+
+
+// keys are ids here, the store only passes them through
+RingtoneLibrary MainRingtoneLibrary;
+
+RingtoneLibrary::key_t RingtoneLibrary::keyOf(id_t id) const
+{
+    return id;
+}
+
+RingtoneLibrary::id_t RingtoneLibrary::findKey(key_t key) const
+{
+    return key;
+}
+
+
+static const size_t maxAlarms = 24;
+
+/* A mutation of AlarmService, as it reaches the table and the store */
+struct Mutation {
+    enum Kind { Insert, Erase, Update } kind;
+    Alarm::id_t id;     // of the erased or updated alarm
+    Alarm       alarm;  // the new state of an inserted or updated alarm
+
+    void apply(AlarmTable &table, AlarmStore &store) const
+    {
+        switch (kind) {
+        case Insert:
+            store.put(*table.insert(alarm));
+            break;
+        case Erase:
+            table.erase(id);
+            store.erase(id);
+            break;
+        case Update: {
+            Alarm *updated = table.find(id);
+            updated->hour = alarm.hour;
+            updated->minute = alarm.minute;
+            updated->enabled = alarm.enabled;
+            updated->ringtone = alarm.ringtone;
+            store.put(*updated);
+            break;
+        }
+        }
+    }
+};
+
+static Alarm randomAlarm(std::mt19937 &random)
+{
+    Alarm alarm(random() % 24, random() % 60, random() & 0x7f, random() % 2);
+    alarm.ringtone = random() % 4;
+    return alarm;
+}
+
+static std::vector<Mutation> randomMutations(std::mt19937 &random, AlarmTable table)
+{
+    std::vector<Mutation> mutations;
+    AlarmStore            scratch;  // nothing is committed
+    size_t                count = 1 + random() % 5;
+
+    for (size_t i = 0; i < count; ++i) {
+        std::vector<Alarm::id_t> ids;
+        table.forEach([&](const Alarm &alarm) { ids.push_back(alarm.id()); });
+
+        Mutation mutation {Mutation::Insert, 0, randomAlarm(random)};
+        if (!ids.empty() && (ids.size() == maxAlarms || random() % 3 != 0)) {
+            mutation.kind = random() % 3 == 0 ? Mutation::Erase : Mutation::Update;
+            mutation.id = ids[random() % ids.size()];
+        }
+        // applied to the copy, so the next ones see the ids it makes
+        mutation.apply(table, scratch);
+        mutations.push_back(mutation);
+    }
+    return mutations;
+}
+
+// the slots as they are stored, free ones by their ids only
+static bool sameSlots(AlarmTable &table, const std::vector<Alarm> &slots)
+{
+    size_t i = 0;
+    bool same = true;
+
+    table.forEachSlot([&](const Alarm &slot) {
+        if (i >= slots.size()) {
+            same = false;
+            return;
+        }
+        const Alarm &loaded = slots[i++];
+        same = same && slot.id() == loaded.id();
+        if (AlarmTable::isOccupied(slot.id())) {
+            same = same && slot.hour == loaded.hour && slot.minute == loaded.minute
+                   && slot.daysOfWeek.daysMask == loaded.daysOfWeek.daysMask
+                   && slot.enabled == loaded.enabled
+                   && slot.isMissed() == loaded.isMissed()
+                   && slot.ringtone == loaded.ringtone;
+        }
+    });
+    return same && i == slots.size();
+}
+
+static std::vector<Alarm> reboot(AlarmStore &store)
+{
+    std::vector<Alarm> slots;
+
+    store.begin("/alarms");
+    store.load(slots);
+    return slots;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t       commits = argc > 1 ? strtoul(argv[1], nullptr, 10) : 200;
+    std::mt19937 random(argc > 2 ? strtoul(argv[2], nullptr, 10) : 1);
+    AlarmTable   table;
+    size_t       powerLosses = 0, compactions = 0, failures = 0;
+
+    for (size_t commit = 0; commit < commits; ++commit) {
+        std::vector<Mutation> mutations = randomMutations(random, table);
+        SDFS::files_t         before = SD.files;
+        AlarmTable            after;
+
+        // k is the last change of the commit that reaches the card
+        for (size_t k = 0;; ++k) {
+            AlarmTable table1 = table;
+            AlarmStore store;
+
+            SD.files = before;
+            reboot(store);
+            SD.steps = 0;
+            SD.powerLossStep = k;
+            uint32_t compactionsBefore = store.stats().compactions;
+            for (const Mutation &mutation : mutations)
+                mutation.apply(table1, store);
+            store.commit(table1);
+            bool complete = SD.steps <= k;
+            SD.powerLossStep = SIZE_MAX;
+
+            if (complete) {
+                after = table1;
+                compactions += store.stats().compactions - compactionsBefore;
+                break;
+            }
+            ++powerLosses;
+
+            AlarmStore rebooted;
+            std::vector<Alarm> slots = reboot(rebooted);
+            if (!sameSlots(table, slots) && !sameSlots(table1, slots)) {
+                printf("commit %zu, power lost after change %zu: the alarms are lost\n", commit, k);
+                ++failures;
+                continue;
+            }
+
+            // the store is repaired by the next commit
+            AlarmTable table2;
+            table2.assign(std::move(slots));
+            Mutation{Mutation::Insert, 0, randomAlarm(random)}.apply(table2, rebooted);
+            rebooted.commit(table2);
+
+            AlarmStore again;
+            if (!sameSlots(table2, reboot(again))) {
+                printf("commit %zu, power lost after change %zu: the next commit is lost\n", commit, k);
+                ++failures;
+            }
+        }
+
+        // the run goes on from the commit that made it
+        AlarmStore store;
+        if (!sameSlots(after, reboot(store))) {
+            printf("commit %zu: the alarms are lost without a power loss\n", commit);
+            ++failures;
+        }
+        table = after;
+    }
+
+    printf(
+        "%zu commits, %zu compactions, %zu power losses, %zu failed\n", commits,
+        compactions, powerLosses, failures
+    );
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,162 @@
+/**
+ * Measures the heap the alarms take before and after 1k add/remove cycles,
+ * each of which removes a random alarm and adds a new one, as the web API
+ * does. Two containers are compared:
+ *  - table: AlarmTable, as AlarmService keeps the alarms
+ *  - map: unordered_map of unique_ptr<Alarm> by id, the one it replaced
+ *
+ * The heap is counted by the allocations of operator new, with the bytes
+ * asked for; malloc's own headers aren't counted, they add the same per
+ * allocation on the host and on ESP32. The largest free block is only
+ * known on the device, dumpAlarms() reports it.
+ *
+ * usage: table_bench [cycles]
+ * prints the live heap per alarm and the allocations made by the cycles
+ */
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <random>
+#include <unordered_map>
+
+#include "AlarmTable.hpp"
+
+
+static size_t allocations = 0;
+static size_t liveBytes = 0;
+static size_t liveBlocks = 0;
+
+// the size is kept in front of the block, so operator delete can count it
+static const size_t header = alignof(std::max_align_t);
+
+void *operator new(size_t size)
+{
+    char *block = static_cast<char *>(malloc(size + header));
+    if (block == nullptr)
+        throw std::bad_alloc();
+    *reinterpret_cast<size_t *>(block) = size;
+    ++allocations;
+    ++liveBlocks;
+    liveBytes += size;
+    return block + header;
+}
+
+void operator delete(void *ptr) noexcept
+{
+    if (ptr == nullptr)
+        return;
+    char *block = static_cast<char *>(ptr) - header;
+    --liveBlocks;
+    liveBytes -= *reinterpret_cast<size_t *>(block);
+    free(block);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    operator delete(ptr);
+}
+
+
+struct Heap {
+    size_t bytes;
+    size_t blocks;
+
+    static Heap now() { return {liveBytes, liveBlocks}; }
+    Heap operator-(const Heap &other) const
+    {
+        return {bytes - other.bytes, blocks - other.blocks};
+    }
+};
+
+struct Result {
+    Heap   before;       // the alarms before the cycles
+    Heap   after;        // and after them
+    size_t allocations;  // made by the cycles
+};
+
+static Alarm randomAlarm(std::mt19937 &random)
+{
+    return Alarm(random() % 24, random() % 60, random() & 0x7f, random() % 2);
+}
+
+static Result runTable(size_t alarms, size_t cycles, std::mt19937 &random)
+{
+    std::vector<Alarm::id_t> ids;  // of the alarms in the table
+    Result                   result;
+
+    ids.reserve(alarms);  // before the heap is counted
+    Heap       empty = Heap::now();
+    AlarmTable table;
+
+    for (size_t i = 0; i < alarms; ++i)
+        ids.push_back(table.insert(randomAlarm(random))->id());
+    result.before = Heap::now() - empty;
+
+    size_t start = allocations;
+    for (size_t i = 0; i < cycles; ++i) {
+        Alarm::id_t &id = ids[random() % ids.size()];
+        table.erase(id);
+        id = table.insert(randomAlarm(random))->id();
+    }
+    result.allocations = allocations - start;
+    result.after = Heap::now() - empty;
+    return result;
+}
+
+static Result runMap(size_t alarms, size_t cycles, std::mt19937 &random)
+{
+    std::vector<Alarm::id_t> ids;
+    Alarm::id_t              nextId = 1;
+    Result                   result;
+
+    ids.reserve(alarms);
+    Heap empty = Heap::now();
+    std::unordered_map<Alarm::id_t, std::unique_ptr<Alarm>> map;
+
+    for (size_t i = 0; i < alarms; ++i) {
+        map[nextId] = std::make_unique<Alarm>(randomAlarm(random));
+        ids.push_back(nextId++);
+    }
+    result.before = Heap::now() - empty;
+
+    size_t start = allocations;
+    for (size_t i = 0; i < cycles; ++i) {
+        Alarm::id_t &id = ids[random() % ids.size()];
+        map.erase(id);
+        id = nextId++;
+        map[id] = std::make_unique<Alarm>(randomAlarm(random));
+    }
+    result.allocations = allocations - start;
+    result.after = Heap::now() - empty;
+    return result;
+}
+
+static void print(const char *name, size_t alarms, const Result &result)
+{
+    printf(
+        "%-6s %6zu %8zu %8.1f %8zu %8zu %8.1f %8zu %12zu\n", name, alarms,
+        result.before.bytes, double(result.before.bytes) / alarms,
+        result.before.blocks, result.after.bytes,
+        double(result.after.bytes) / alarms, result.after.blocks,
+        result.allocations
+    );
+}
+
+int main(int argc, char *argv[])
+{
+    size_t cycles = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000;
+
+    printf("%zu add/remove cycles; heap before and after them\n", cycles);
+    printf(
+        "%-6s %6s %8s %8s %8s %8s %8s %8s %12s\n", "", "alarms", "bytes",
+        "/alarm", "blocks", "bytes", "/alarm", "blocks", "allocations"
+    );
+    for (size_t alarms : {10, 100, 1000}) {
+        std::mt19937 random(alarms);
+        print("table", alarms, runTable(alarms, cycles, random));
+        random.seed(alarms);
+        print("map", alarms, runMap(alarms, cycles, random));
+    }
+    return 0;
+}
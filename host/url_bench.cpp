@@ -0,0 +1,143 @@
+/**
+ * Compares UrlParser::match() with the linear scan it replaced: the old
+ * parser walked a multiset of the endpoints, copying each one, compared
+ * the url with every pattern character by character, and parsed the body
+ * of any request into a 1 KB document. Each route is "/r<i>/{id}/act",
+ * the request is a GET of the one added last.
+ *
+ * It's built with ArduinoJson and mongoose, see the Makefile.
+ *
+ * usage: url_bench [matches]
+ * prints host ns per match for 10, 100 and 1000 routes, the handler included
+ */
+
+#include <chrono>
+#include <map>
+
+#include "UrlParser.hpp"
+
+
+using Clock = std::chrono::steady_clock;
+
+
+/* The old UrlParser::match() and matchUrl(), the callback gets the same Params */
+class LinearParser {
+public:
+    using params_t = std::map<std::string, std::string>;
+
+    void addEndpoint(const UrlParser::Endpoint &endpoint) { m_endpoints.insert(endpoint); }
+
+    UrlParser::Result match(const mg_http_message &request, UrlParser::Response &response)
+    {
+        params_t params;
+
+        for (auto endpoint : m_endpoints) {
+            if (mg_vcmp(&request.method, endpoint.method.c_str()) == 0
+                && matchUrl(
+                    std::string_view(request.uri.ptr, request.uri.len),
+                    endpoint.pattern, params
+                )) {
+
+                StaticJsonDocument<1024> requestDoc;
+                deserializeJson(requestDoc, request.body.ptr, request.body.len);
+                JsonVariant requestJson = requestDoc.as<JsonVariant>();
+
+                UrlParser::Params urlParams;
+                for (const auto &param : params)
+                    urlParams.add(param.first, param.second);
+                return endpoint(UrlParser::Request{request, urlParams, requestJson}, response);
+            }
+            params.clear();
+        }
+        return UrlParser::Result(404, "Not Found");
+    }
+
+private:
+    static bool matchUrl(std::string_view url, std::string_view pattern, params_t &params)
+    {
+        url.remove_prefix(url.front() == '/' ? 1 : 0);
+        url.remove_suffix(url.back() == '/' ? 1 : 0);
+        pattern.remove_prefix(pattern.front() == '/' ? 1 : 0);
+        pattern.remove_suffix(pattern.back() == '/' ? 1 : 0);
+
+        size_t i = 0, j = 0;
+        while (i < url.length() && j < pattern.length()) {
+            if (pattern[j] == '{') {
+                size_t wildcardEnd = pattern.find('}', j);
+                if (wildcardEnd == std::string_view::npos)
+                    return false;
+                size_t urlEnd = url.find('/', i);
+
+                params.emplace(
+                    pattern.substr(j + 1, wildcardEnd - j - 1), url.substr(i, urlEnd - i)
+                );
+                if (urlEnd == std::string_view::npos)
+                    return wildcardEnd == pattern.length() - 1;
+                i = urlEnd;
+                j = wildcardEnd + 1;
+            } else if (pattern[j] == url[i]) {
+                i++;
+                j++;
+            } else {
+                return false;
+            }
+        }
+        return i >= url.length() && j >= pattern.length();
+    }
+
+    std::multiset<UrlParser::Endpoint> m_endpoints;
+};
+
+
+static mg_str makeStr(std::string_view str)
+{
+    return mg_str_n(str.data(), str.size());
+}
+
+template<class Parser>
+static double bench(Parser &parser, const std::string &uri, size_t matches)
+{
+    mg_http_message request = {};
+    DynamicJsonDocument responseDoc(256);
+
+    request.method = makeStr("GET");
+    request.uri = makeStr(uri);
+    request.body = makeStr("");
+
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < matches; ++i) {
+        UrlParser::Response response;
+        response.data = responseDoc.to<JsonObject>();
+        if (parser.match(request, response).code != 200) {
+            printf("%s didn't match\n", uri.c_str());
+            exit(1);
+        }
+    }
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / matches;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t matches = argc > 1 ? strtoul(argv[1], nullptr, 10) : 20000;
+    UrlParser::callback_t handler = [](const UrlParser::Request &, UrlParser::Response &) {
+        return UrlParser::Result(200);
+    };
+
+    printf("%-8s %12s %12s\n", "routes", "linear, ns", "trie, ns");
+    for (size_t routes : {10, 100, 1000}) {
+        LinearParser linear;
+        UrlParser trie({});
+
+        for (size_t i = 0; i < routes; ++i) {
+            std::string pattern = "/r" + std::to_string(i) + "/{id}/act";
+            linear.addEndpoint({0, "GET", pattern, handler});
+            trie.addEndpoint(makeStr("GET"), makeStr(pattern), 0, handler);
+        }
+
+        std::string uri = "/r" + std::to_string(routes - 1) + "/42/act";
+        double linearNs = bench(linear, uri, matches);
+        double trieNs = bench(trie, uri, matches);
+        printf("%-8zu %12.0f %12.0f\n", routes, linearNs, trieNs);
+    }
+    return 0;
+}
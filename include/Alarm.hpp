@@ -1,3 +1,6 @@
+#ifndef Alarm_hpp
+#define Alarm_hpp
+
 #include <string>
 
 #include "Arduino.h"
@@ -10,6 +13,9 @@ class Alarm {
 public:
     using id_t = uint64_t;
     friend class AlarmService;
+    friend class AlarmScheduler;
+    friend class AlarmTable;
+    friend class AlarmStore;
 
     class DaysOfWeek {
     public:
@@ -43,30 +49,67 @@ public:
     byte       hour;
     byte       minute;
     DaysOfWeek daysOfWeek;
+    uint16_t   ringtone = 0;  // id in RingtoneLibrary, 0 is the default one
 
 private:
     bool m_missed = true;
-    id_t m_id;
+    id_t m_id = 0;  // assigned by AlarmTable once the alarm is inserted
 };
 
+// alarms are stored by value in AlarmTable, so keep them small
+static_assert(sizeof(Alarm) <= 16);
+
 
 /**
  * Class that stores an alarm as is's represented in DS3231.
  * It can be bound to the exact day of week or fire every day.
+ *
+ * The time of the alarm is cached as a minute of its period (a minute of the
+ * week for alarms bound to a day of week, a minute of the day otherwise),
+ * so finding the next firing is plain integer arithmetic on unixtime.
+ * The parent's time is copied on construction, so HwAlarm must be recreated
+ * once the parent alarm's time changes. The parent is referenced by its
+ * index in AlarmTable.
  */
 class HwAlarm {
 public:
-    HwAlarm(Alarm *parent, byte dayOfWeek);
-    HwAlarm(Alarm *parent);
+    static const uint16_t minutesPerDay  = 24 * 60;
+    static const uint16_t minutesPerWeek = 7 * minutesPerDay;
 
-    Alarm &parentAlarm() const { return *m_parentAlarm; };
-    byte  dayOfWeek()    const { return m_dayOfWeek; };
+    HwAlarm(const Alarm &parent, uint16_t parentIndex, byte dayOfWeek);
+    HwAlarm(const Alarm &parent, uint16_t parentIndex);
+
+    uint16_t parentIndex()    const { return m_parentIndex; };
+    byte     dayOfWeek()      const { return m_dayOfWeek; };
+    byte     hour()           const { return m_minute % minutesPerDay / 60; };
+    byte     minute()         const { return m_minute % 60; };
+    bool     usesDaysOfWeek() const { return m_period == minutesPerWeek; };
+    uint16_t minuteOfPeriod() const { return m_minute; };
+    uint16_t period()         const { return m_period; };
 
     std::string toString() const;
+    uint32_t nextFiring(uint32_t now) const;
+    bool     hasFired(uint32_t when)  const;
     DateTime nextFiring(const DateTime &now) const;
     bool     hasFired(const DateTime &when)  const;
 
+    /* Writes the next firing of each of `count` alarms to `out` */
+    static void nextFirings(
+        const HwAlarm *alarms, size_t count, uint32_t now, uint32_t *out
+    );
+
+    /* Minute of the week (or of the day) for unixtime, weeks start on Monday */
+    static uint16_t minuteOfPeriodAt(uint32_t time, uint16_t period);
+
+    /* DateTime-based versions, used to verify the integer ones in debug builds */
+    DateTime referenceNextFiring(const DateTime &now) const;
+    bool     referenceHasFired(const DateTime &when)  const;
+
 private:
-    Alarm *m_parentAlarm;
-    byte   m_dayOfWeek;  // Stored from 0(Monday) to 6(Sunday)
-};
\ No newline at end of file
+    uint16_t m_parentIndex;
+    byte     m_dayOfWeek;  // Stored from 0(Monday) to 6(Sunday)
+    uint16_t m_minute;     // minute of the period when the alarm fires
+    uint16_t m_period;     // minutesPerWeek or minutesPerDay
+};
+
+#endif  // #ifdef Alarm_hpp
@@ -0,0 +1,80 @@
+#ifndef AlarmQueue_hpp
+#define AlarmQueue_hpp
+
+#include <vector>
+
+#include "Arduino.h"
+
+#include "Alarm.hpp"
+#include "WeekIndex.hpp"
+
+
+/**
+ * Indexed binary min-heap of HwAlarms keyed by the unixtime of their next
+ * firing. Every pushed HwAlarm gets a stable handle, which can be used later
+ * to remove or reschedule it in O(log n) without searching the heap.
+ * Scheduled HwAlarms are also indexed by the minute of the week they fire at
+ * and grouped by their parent alarm's index.
+ */
+class AlarmQueue {
+public:
+    using handle_t = WeekIndex::handle_t;
+    static constexpr handle_t noHandle = WeekIndex::noHandle;
+
+    struct Entry {
+        uint32_t fireTime;  // unixtime of the next firing
+        handle_t handle;
+    };
+
+    handle_t push(const HwAlarm &alarm, uint32_t fireTime);  // noHandle if full
+    void     remove(handle_t handle);
+    void     removeParent(uint16_t parentIndex);  // removes all parent's HwAlarms
+    void     reschedule(handle_t handle, uint32_t fireTime);
+    void     replace(handle_t handle, const HwAlarm &alarm, uint32_t fireTime);
+    void     clear();
+    void     rescheduleAll(uint32_t now);  // O(n), recomputes all fire times
+
+    bool            empty()                 const { return m_heap.empty(); }
+    size_t          size()                  const { return m_heap.size(); }
+    const Entry     &top()                  const { return m_heap.front(); }
+    const Entry     &entry(handle_t handle) const { return m_heap[m_positions[handle]]; }
+    const WeekIndex &index()                const { return m_index; }
+    HwAlarm         &operator[](handle_t handle)  { return m_alarms[handle]; }
+    const HwAlarm   &operator[](handle_t handle) const { return m_alarms[handle]; }
+
+    bool isScheduled(uint16_t parentIndex) const
+    {
+        return parentIndex < m_firstOfParent.size()
+               && m_firstOfParent[parentIndex] != noHandle;
+    }
+
+    /* Calls `fn(handle)` for each HwAlarm of the parent alarm */
+    template<class Fn> void forEachOf(uint16_t parentIndex, Fn fn) const
+    {
+        if (!isScheduled(parentIndex))
+            return;
+        for (handle_t h = m_firstOfParent[parentIndex]; h != noHandle;
+             h = m_nextOfParent[h])
+            fn(h);
+    }
+
+    // entries are iterated in heap order, not in the order of firing
+    std::vector<Entry>::const_iterator begin() const { return m_heap.begin(); }
+    std::vector<Entry>::const_iterator end()   const { return m_heap.end(); }
+
+private:
+    static bool less(const Entry &a, const Entry &b);
+    void siftUp(size_t pos);
+    void siftDown(size_t pos);
+    void place(size_t pos, const Entry &entry);
+
+    std::vector<Entry>    m_heap;
+    std::vector<HwAlarm>  m_alarms;     // indexed by handle
+    std::vector<handle_t> m_positions;  // handle -> position in m_heap
+    std::vector<handle_t> m_freeHandles;
+    std::vector<handle_t> m_firstOfParent;  // parent index -> its first HwAlarm
+    std::vector<handle_t> m_nextOfParent;   // handle -> next HwAlarm of the parent
+    WeekIndex             m_index;
+};
+
+#endif  // #ifdef AlarmQueue_hpp
@@ -0,0 +1,85 @@
+#ifndef AlarmScheduler_hpp
+#define AlarmScheduler_hpp
+
+#include <vector>
+
+#include "Arduino.h"
+
+#include "Alarm.hpp"
+#include "AlarmQueue.hpp"
+#include "AlarmTable.hpp"
+
+
+/**
+ * Scheduling core of AlarmService: the alarms, their HwAlarms ordered by
+ * the next firing and the choice of firings for the two DS3231 slots.
+ * It doesn't touch the RTC, the clock or the player, the time is passed
+ * as unixtime, so the same code runs under simulated time on the host
+ * (see host/alarm_sim.cpp).
+ */
+class AlarmScheduler {
+public:
+    /* An alarm that has fired, processing it has scheduled the next firing */
+    struct Firing {
+        Alarm::id_t id;
+        uint32_t    fireTime;  // unixtime the HwAlarm was due
+    };
+
+    /* Firings each of DS3231 slots has to hold, and which of them changed */
+    struct SlotPlan {
+        uint32_t times[2];    // unixtime of the firing, 0 to disable the slot
+        bool     program[2];  // the slot has to be (re)programmed
+    };
+
+    // every alarm has up to 7 HwAlarms, so the queue never runs out of handles
+    static const size_t maxAlarms = AlarmQueue::noHandle / 7;
+
+    // schedules the alarm if it's enabled, nullptr if there are maxAlarms
+    Alarm *insert(const Alarm &alarm, uint32_t now);
+    bool   erase(Alarm::id_t id);
+    // replaces the contents with restored slots and schedules them at once
+    void   restore(std::vector<Alarm> &&slots, uint32_t now);
+
+    void schedule(Alarm &alarm, uint32_t now);  // does nothing if disabled
+    void unschedule(Alarm &alarm);
+    void retime(Alarm &alarm, uint32_t now);    // after the time of the alarm changes
+    void rescheduleAll(uint32_t now);           // after the clock is adjusted
+
+    /*
+     * Processes the firings due by `now` in the order of their time, the
+     * first one is to be played, others are skipped; nothing is due if the
+     * interrupt was spurious
+     */
+    std::vector<Firing> fire(uint32_t now);
+
+    /* Plans the slots to hold the next two distinct firings; the slots
+     * whose firing differs from `armed` are reprogrammed, unused ones are
+     * always disabled */
+    SlotPlan planSlots(const uint32_t armed[2]) const;
+
+    Alarm            *find(Alarm::id_t id) { return m_alarms.find(id); }
+    Alarm            *next();  // the alarm of the earliest firing, if any
+    AlarmTable       &alarms()             { return m_alarms; }
+    const AlarmQueue &queue()        const { return m_queue; }
+
+    static std::vector<HwAlarm> toHwAlarms(const Alarm &alarm);
+
+private:
+    void     disable(Alarm &alarm);  // when its HwAlarms don't fit in the queue
+    void     process(const AlarmQueue::Entry &entry, uint32_t now);
+    uint32_t nextDistinctFiring(uint32_t fireTime) const;
+
+    /*
+     * we need to get alarms by id as fast as possible without a heap
+     * allocation per alarm, so they're stored in a slot map
+     * (id encodes the slot index)
+     */
+    AlarmTable m_alarms;
+    /*
+     * only HwAlarms of enabled alarms are scheduled, they are ordered
+     * by the time of the next firing
+     */
+    AlarmQueue m_queue;
+};
+
+#endif  // #ifdef AlarmScheduler_hpp
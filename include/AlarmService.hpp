@@ -1,100 +1,201 @@
 #ifndef AlarmService_hpp
 #define AlarmService_hpp
 
+#include <functional>
+#include <future>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <thread>
-#include <unordered_map>
 #include <vector>
 
 #include "RTClib.h"
 #include "freertos/FreeRTOS.h"
 
 #include "Alarm.hpp"
+#include "AlarmScheduler.hpp"
+#include "AlarmStore.hpp"
 #include "AudioLooper.hpp"
+#include "RingtoneLibrary.hpp"
+#include "TimeService.hpp"
 #include "Tools.hpp"
 
 
 class AlarmService {
-    using AlarmPtr = std::unique_ptr<Alarm>;
-    using AlarmMap = std::unordered_map<Alarm::id_t, AlarmPtr>;
-
 public:
+    /*
+     * Immutable copy of the alarms, a new one is published after each
+     * batch of mutations, so readers never wait for the event loop
+     */
+    struct Snapshot {
+        uint32_t           version;
+        std::vector<Alarm> alarms;
+    };
+    using SnapshotPtr = std::shared_ptr<const Snapshot>;
+
+    /* Counters of the scheduler's work since boot */
+    struct Stats {
+        uint32_t fired;           // alarms that started playing
+        uint32_t skipped;         // alarms that fired while another one played
+        uint32_t missed;          // alarms that played until timeout
+        uint32_t events;          // commands from ISRs processed by the event loop
+        uint32_t mutations;       // API calls executed by the event loop
+        uint32_t flushes;         // batches of changes written to the RTC and SD
+        uint32_t wakeups;         // times the event loop woke up
+        uint32_t maxEventTime;    // the longest wakeup, us
+        uint64_t totalEventTime;  // us
+        uint32_t lastRearmTime;   // from the RTC interrupt to both slots armed, us
+        uint32_t maxRearmTime;    // us
+    };
+
+    struct AlarmTime {
+        byte hour;
+        byte minute;
+    };
+
+    /* Fields updateAlarm() changes at once, the ones without a value are kept */
+    struct AlarmChanges {
+        std::optional<AlarmTime> time;
+        std::optional<uint8_t>   daysOfWeek;
+        std::optional<uint16_t>  ringtone;
+    };
+
     ~AlarmService();
     
     void begin(
-        RTC_DS3231 *rtc, Audio *audio, std::shared_ptr<std::mutex> rtcMutex, byte intrPin,
-        byte alarmStopPin
+        RTC_DS3231 *rtc, TimeService *time, Audio *audio,
+        std::shared_ptr<std::mutex> rtcMutex, byte intrPin, byte alarmStopPin
     );
     void dumpAlarms();
 
-    /*****************
-     * public API,   *
-     * takes m_lock  *
-     *****************/
-    Alarm::id_t addAlarm(Alarm &alarm);                  // also takes m_rtcLock
-    bool removeAlarm(Alarm::id_t id);
-    bool setAlarmState(Alarm::id_t id, bool enabled);
-    bool setAlarmTime(Alarm::id_t id, byte hour, byte minute);
-    bool setAlarmDaysOfWeek(Alarm::id_t id, Alarm::DaysOfWeek daysOfWeek);
+    /*************************************************
+     * public API, executed by the event loop,       *
+     * futures are ready once the change is published *
+     *************************************************/
+    // ids are 0 (or none for a batch) if there are too many alarms
+    std::future<Alarm::id_t> addAlarm(const Alarm &alarm);
+    std::future<std::vector<Alarm::id_t>> addAlarms(const std::vector<Alarm> &alarms);
+    std::future<bool> removeAlarm(Alarm::id_t id);
+    std::future<bool> setAlarmState(Alarm::id_t id, bool enabled);
+    std::future<bool> updateAlarm(Alarm::id_t id, const AlarmChanges &changes);
+    std::future<bool> clearMissedFlag(Alarm::id_t id);
+    // must be called after the RTC time is stepped, doesn't wait for the event loop
+    void rescheduleAlarms();
+    std::future<AlarmStore::Stats> storeStats();
+    void reprimePlayer();  // after a ringtone file is replaced, doesn't wait
     void setVolume(byte volume);
-    bool clearMissedFlag(Alarm::id_t id);
 
     bool isAlarmRunning()       const { return m_runningAlarmId != 0; };
     Alarm::id_t runningAlarm()  const { return m_runningAlarmId; }
-    const AlarmMap &getAlarms() const { return m_alarms; };
+    SnapshotPtr getAlarms()     const { return std::atomic_load(&m_snapshot); };
+    Stats stats();              // takes m_statsLock only
+    AudioLooper::Stats audioStats() { return m_alarmPlayer->stats(); }
 
 private:
     struct Command {
         enum Type { FireAlarm, StopAlarm };
-        Type type;
+        Type    type;
+        int64_t time;  // esp_timer time when the command was sent, us
     };
 
-    // sets 1st enabled alarm on RTC's 2st slot
-    void updateAlarms();                                        // takes m_rtcLock
-    void setDs3231Alarm(const HwAlarm &alarm);                  // takes m_rtcLock
-    void addDs3231Alarm(HwAlarm &alarm, DateTime *now = NULL);  // takes m_rtcLock if now == NULL
-    void processAlarm(std::vector<HwAlarm>::iterator idx);      // non-blocking
-    std::vector<HwAlarm>::iterator firstEnabledHwAlarm();       // non-blocking
+    /* API call sent to the event loop, it's deleted once completed */
+    struct Mutation {
+        std::function<void()> run;       // executed by the event loop
+        std::function<void()> complete;  // makes the future ready after the flush
+    };
+
+    static const size_t isrQueueLength = 3;
+    static const size_t mutationQueueLength = 8;
+
+    /* Sends `fn` to the event loop, blocks only while the queue is full */
+    template<class Fn> auto submit(Fn fn) -> std::future<decltype(fn())>
+    {
+        using Result = decltype(fn());
+        auto promise = std::make_shared<std::promise<Result>>();
+        auto result = std::make_shared<Result>();
+        std::future<Result> future = promise->get_future();
 
-    void eventLoop();          // takes m_lock on each command
+        Mutation *mutation = new Mutation {
+            [=] { *result = fn(); },
+            [=] { promise->set_value(std::move(*result)); }};
+        xQueueSend(m_mutationQueue, &mutation, portMAX_DELAY);
+        return future;
+    }
+
+    /*
+     * Sends `fn` to the event loop without blocking, for the callbacks of
+     * the timer task; if the queue is full, `fn` is deferred, the event
+     * loop is busy with the queue anyway and runs it after the queue
+     */
+    template<class Fn> void post(Fn fn)
+    {
+        Mutation *mutation = new Mutation {fn, [] {}};
+
+        if (xQueueSend(m_mutationQueue, &mutation, 0) != pdTRUE) {
+            std::lock_guard deferredLock(m_deferredLock);
+            m_deferred.push_back(mutation);
+        }
+    }
+
+    // arms RTC's slots with the next two distinct firings of the scheduler
+    void updateAlarms();                                        // takes m_rtcLock
+    void setDs3231Alarm(byte slot, uint32_t fireTime);          // takes m_rtcLock
+    void disableDs3231Alarm(byte slot);                         // takes m_rtcLock
+    void postOverdueFiring(const DateTime &now);                // takes m_rtcLock
+    Alarm *insertAlarm(const Alarm &alarm, const DateTime &now); // non-blocking
+
+    void eventLoop();          // the only task that touches alarms after begin()
+    void processBatch();       // drains both queues, then flushes the changes
+    void processCommands();    // drains m_isrCmdQueue
     // eventloop commnads:
-    void onAlarmFired();       // takes m_rtcLock
+    void onAlarmFired(int64_t interruptTime);  // takes m_rtcLock
     void onAlarmStopped();     // non-blocking
 
-    void alarmMissed();        // non-blocking
+    void alarmMissed();        // posts a mutation, non-blocking
+    void primePlayer();        // non-blocking, when the next alarm is known
+    AudioLooper::Track trackOf(const Alarm &alarm) const;  // non-blocking
 
-    static std::vector<HwAlarm> alarmToHwAlarms(Alarm *alarm);
     friend void IRAM_ATTR onAlarm(void *selfPtr);
     friend void IRAM_ATTR onAlarmStop(void *selfPtr);
-    friend void updateDisplayTask(void *pvParameters); // TODO remove
-    void _dumpAlarms();  // internal version of dumpAlarms(), does not take m_lock
+    void _dumpAlarms();  // internal version of dumpAlarms(), called by the event loop
+    void publishSnapshot();  // called by the event loop after a batch of mutations
+    void restoreAlarms();    // rebuilds the scheduler at once
+    void countStat(uint32_t Stats::*counter);  // takes m_statsLock
 
-    /*
-     * we need to get alarms by id as fast as possible,
-     * so unordered_map is the best solution
-     * (with key = Alarm::id_t)
-     */
-    AlarmMap                     m_alarms;
-    std::vector<HwAlarm>         m_hwAlarms;
+    // alarms and their firings, everything but the hardware
+    AlarmScheduler               m_scheduler;
+    // every mutation is put to the store and committed with its batch
+    AlarmStore                   m_store;
+    bool                         m_dirty = false;  // the batch has changed alarms
 
     AudioLooper                 *m_alarmPlayer;
     Audio                       *m_audio;
     RTC_DS3231                  *m_rtc;
+    TimeService                 *m_time;  // RTC is used only for its alarms
     byte                         m_interruptPin;
     byte                         m_alarmStopPin;
     Alarm::id_t                  m_runningAlarmId;
+    /*
+     * unixtime each of DS3231 slots is armed with, 0 if it's disabled;
+     * slots are reprogrammed only when the firings they hold change
+     */
+    uint32_t                     m_armedTimes[2] = {};
+
+    Stats                        m_stats = {};
+    std::mutex                   m_statsLock;  // readers never wait for the event loop
+    SnapshotPtr                  m_snapshot;
+    uint32_t                     m_snapshotVersion = 0;
 
     TaskHandle_t                 m_eventLoopTask;
     QueueHandle_t                m_isrCmdQueue;
+    QueueHandle_t                m_mutationQueue;  // Mutation pointers from the API
+    QueueSetHandle_t             m_queueSet;       // both queues, wakes the event loop
+    // posted while m_mutationQueue was full, run after the queue is drained
+    std::vector<Mutation *>      m_deferred;
+    std::mutex                   m_deferredLock;   // held only to push or swap
 
-    /*
-     * the order in which locks are taken is as following:
-     *   1. m_lock
-     *   2. m_rtcLock
-     */
+    // shared with TimeService, alarms are programmed by the event loop only
     std::shared_ptr<std::mutex>  m_rtcLock;
-    std::mutex                   m_lock;
 };
 
 extern AlarmService MainAlarmService;
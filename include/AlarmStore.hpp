@@ -0,0 +1,101 @@
+#ifndef AlarmStore_hpp
+#define AlarmStore_hpp
+
+#include <string>
+#include <vector>
+
+#include "Arduino.h"
+#include "SD.h"
+
+#include "Alarm.hpp"
+#include "AlarmTable.hpp"
+#include "RingtoneLibrary.hpp"
+
+
+/**
+ * Durable copy of AlarmTable on the SD card. Every mutation appends
+ * a CRC-checked record with the whole state of one alarm (or its removal)
+ * to the log, so replaying the log over the snapshot in order restores the
+ * table with the same ids. Once the log grows larger than the table, it's
+ * compacted into a new snapshot.
+ *
+ * Each compaction numbers the snapshot and the log it starts with a new
+ * generation. A compaction cut short by a power loss leaves the new snapshot
+ * next to the old log, whose records are older than the snapshot, so a log
+ * of another generation is never replayed.
+ *
+ * Records are buffered by put() and erase() and written at once by commit().
+ * Ringtones are stored by their keys, as their ids change when the index of
+ * RingtoneLibrary is rebuilt, so the library is loaded before the store.
+ */
+class AlarmStore {
+public:
+    struct Stats {
+        uint32_t records;        // records appended to the log
+        uint32_t compactions;
+        uint32_t corruptRecords; // records failed CRC check on load
+        uint32_t loadTime;       // us
+        uint64_t recordBytes;    // bytes of the appended records
+        uint64_t sectorBytes;    // bytes of the SD sectors rewritten for them
+    };
+
+    bool begin(const std::string &dir);
+
+    // restores the slots of AlarmTable, ids and free slots included
+    bool load(std::vector<Alarm> &slots);
+    void put(const Alarm &alarm);
+    void erase(Alarm::id_t id);
+    bool commit(AlarmTable &table);   // also compacts the log if needed
+    bool compact(AlarmTable &table);  // writes the snapshot, clears the log
+
+    const Stats &stats() const { return m_stats; }
+
+private:
+    enum RecordType : uint8_t { PutRecord = 1, EraseRecord = 2 };
+    enum RecordFlags : uint8_t { Enabled = 1, Missed = 2 };
+
+    struct Record {
+        uint32_t crc;  // of the rest of the record
+        uint8_t  type;
+        uint8_t  hour;
+        uint8_t  minute;
+        uint8_t  daysMask;
+        uint8_t  flags;
+        uint8_t  reserved[3];
+        uint32_t ringtone;  // key of the ringtone in RingtoneLibrary
+        uint64_t id;
+    };
+    static_assert(sizeof(Record) == 24);
+    static_assert(sizeof(RingtoneLibrary::key_t) == sizeof(Record::ringtone));
+
+    struct SnapshotHeader {
+        uint32_t magic;
+        uint32_t records;     // a snapshot with less records is incomplete
+        uint32_t generation;  // of the compaction that wrote it
+    };
+
+    struct LogHeader {
+        uint32_t magic;
+        uint32_t generation;  // of the snapshot the records follow
+    };
+
+    static Record makeRecord(RecordType type, const Alarm &alarm);
+    static uint32_t recordCrc(const Record &record);
+    static void apply(const Record &record, std::vector<Alarm> &slots);
+    // applies records until the end of file or a broken one, returns their count
+    size_t readRecords(File &file, size_t maxRecords, std::vector<Alarm> &slots);
+    void countWrite(size_t offset, size_t size);
+    // reads the records of the log if it follows the snapshot of `generation`
+    bool loadLog(uint32_t generation, std::vector<Alarm> &slots);
+
+    std::string          m_logPath;
+    std::string          m_snapshotPath;
+    std::string          m_tmpPath;
+    std::vector<Record>  m_pending;
+    size_t               m_logRecords = 0;  // records in the log file
+    uint32_t             m_generation = 0;  // of the snapshot, 0 before the first one
+    bool                 m_corrupt = false; // the log has a broken tail
+    Stats                m_stats = {};
+};
+
+#endif  // #ifdef AlarmStore_hpp
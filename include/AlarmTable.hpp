@@ -0,0 +1,58 @@
+#ifndef AlarmTable_hpp
+#define AlarmTable_hpp
+
+#include <vector>
+
+#include "Arduino.h"
+
+#include "Alarm.hpp"
+
+
+/**
+ * Generational slot map of alarms. Alarms are stored by value in a flat
+ * vector, and freed slots are reused. An alarm id encodes its slot index
+ * (16 low bits) and the slot's generation (48 high bits), so looking an
+ * alarm up by id is an index plus a comparison.
+ *
+ * The generation is odd for occupied slots and even for free ones, so stale
+ * ids never match a slot. Pointers to alarms are invalidated by insert().
+ */
+class AlarmTable {
+public:
+    using index_t = uint16_t;
+
+    Alarm *insert(const Alarm &alarm);  // assigns a new id to the inserted alarm
+    bool   erase(Alarm::id_t id);
+    Alarm *find(Alarm::id_t id);
+    // replaces the contents with restored slots, their ids are kept
+    void   assign(std::vector<Alarm> &&slots);
+
+    Alarm  &operator[](index_t index)       { return m_slots[index]; }
+    size_t size()                     const { return m_size; }
+    size_t capacity()                 const { return m_slots.capacity(); }
+
+    static index_t indexOf(Alarm::id_t id) { return id & 0xffff; }
+    static bool    isOccupied(Alarm::id_t id) { return (id >> 16) & 1; }
+
+    /* Calls `fn(alarm)` for each alarm in the table */
+    template<class Fn> void forEach(Fn fn)
+    {
+        for (Alarm &alarm : m_slots)
+            if (isOccupied(alarm.m_id))
+                fn(alarm);
+    }
+
+    /* Calls `fn(slot)` for each slot, including free ones */
+    template<class Fn> void forEachSlot(Fn fn) const
+    {
+        for (const Alarm &slot : m_slots)
+            fn(slot);
+    }
+
+private:
+    std::vector<Alarm>   m_slots;
+    std::vector<index_t> m_freeSlots;
+    size_t               m_size = 0;
+};
+
+#endif  // #ifdef AlarmTable_hpp
@@ -1,36 +1,123 @@
+#include <atomic>
 #include <freertos/FreeRTOS.h>
 #include <functional>
+#include <mutex>
 #include <string>
 
 #include "Audio.h"
 #include "SD.h"
 
+#include "Mixer.hpp"
+
 
 class AudioLooper {
 public:
-    AudioLooper(Audio *audio, std::string filePath);
+    struct Stats {
+        uint32_t loops;           // times the ringtone started over
+        uint32_t reconnects;      // times the file was reopened to loop it
+        uint32_t lastGapSamples;  // silence at the last loop, samples
+        uint32_t maxGapSamples;
+        uint32_t underruns;       // times the output ran out of samples
+        uint32_t starts;
+        uint32_t lastStartLatency;  // from start() to the first frame, us
+        uint32_t maxStartLatency;
+        uint32_t stops;
+        uint32_t lastStopLatency;   // from stop() to the end of the fade, us
+        uint32_t maxStopLatency;
+        // the pump's work, [0] while idle and [1] while playing
+        uint32_t wakeups[2];
+        uint64_t busyTime[2];     // us
+        uint64_t totalTime[2];    // us
+    };
+
+    /* File to play, it's copied to the commands, so its size is fixed */
+    struct Track {
+        char     path[48];
+        uint32_t firstFrame;  // offset of the first audio frame, past the tags
+        uint32_t revision;    // of the file, a replaced one is opened again
+    };
+
+    AudioLooper(Audio *audio);
     ~AudioLooper();
 
+    // false if the path doesn't fit in Track, it's never truncated
+    static bool makeTrack(
+        const std::string &path, Track &track, uint32_t firstFrame = 0,
+        uint32_t revision = 0
+    );
+
     void begin(std::function<void()> timeoutExpiredCallback);
-    void start(unsigned long timeoutSeconds);
-    void start();
-    void stop();
-    void setAudioPath(std::string &filePath);
+    void start(const Track &track, unsigned long timeoutSeconds);
+    void start(const Track &track);
+    void stop();      // fades the ringtone out, then stops the decoder
+    void chime();     // signals over the ringtone, if it's playing
+    // opens the file and pauses the decoder before its first frame,
+    // so the next start() of the same track only resumes it
+    void prime(const Track &track);
+    Stats stats();  // takes m_statsLock
     static void onTimer(TimerHandle_t handle);
+    // called by the decoder before each frame goes to I2S, mixes it in place
+    void onFrame(int16_t *buffer, uint16_t samples);
 
 private:
     void looperTask();
-    enum CommandType { StopCmd, StartCmd };
+    // opens the file in the loop mode of the decoder
+    void connect(const Track &track);
+    static bool isSameTrack(const Track &a, const Track &b)
+    {
+        return strcmp(a.path, b.path) == 0 && a.revision == b.revision;
+    }
+    void pump();     // decodes until the output is full
+    TickType_t refillDelay() const;  // until the output needs more samples
+    int64_t bufferedUntil() const;   // when the samples handed to I2S run out
+    void countWakeup(bool wasPlaying, int64_t wakeTime);  // takes m_statsLock
+    void primeTrack(const Track &track);
+    void finishStop();  // once the fade out is over
+    uint32_t sampleRate() const;  // of the decoded file, or the default one
+    uint32_t samplesIn(uint32_t ms) const;
+    enum CommandType { StopCmd, StartCmd, PrimeCmd, ChimeCmd };
     struct AudioCmd {
-        CommandType  type;
-        unsigned int arg;  // timeout duration in seconds
+        CommandType   type;
+        unsigned long arg = 0;     // timeout duration in seconds
+        Track         track = {};  // for StartCmd and PrimeCmd
+        int64_t       time = 0;    // esp_timer time when it was sent
     };
 
     Audio                   *m_audio;
     TaskHandle_t             m_audioTask = nullptr;
     TimerHandle_t            m_autoStopTimer;
     QueueHandle_t            m_cmdQueue;
-    std::string              m_filePath;
-    unsigned long            m_startTime;
+    Track                    m_track = {};      // owned by looperTask
+    bool                     m_primed = false;  // owned by looperTask
+    std::atomic<bool>        m_primeRequested{false};
+    Track                    m_requestedPrime = {};  // owned by the caller of prime()
+    // the way through the file, to see when it starts over (looperTask only)
+    uint32_t                 m_lastFilePos = 0;
+    bool                     m_looped = false;  // the next frame measures the gap
+    bool                     m_playing = false;  // owned by looperTask
+    // the rest is owned by looperTask too; the decoder runs while stopping
+    bool                     m_stopping = false;
+    int64_t                  m_stopDeadline = 0;
+    // the next track is primed once the stopping one is silent
+    Track                    m_pendingPrime = {};
+    bool                     m_primePending = false;
+    Mixer                    m_mixer;  // process() is called by the decoder
+    /*
+     * The output is modeled so the pump sleeps while it plays: the samples
+     * handed to I2S since the output last ran dry, and the esp_timer time
+     * it started again, 0 until the first frame. The end is computed from
+     * the whole count, so the rounding of each frame doesn't add up.
+     */
+    int64_t                  m_bufferedSince = 0;
+    uint64_t                 m_bufferedSamples = 0;
+    uint32_t                 m_frames = 0;  // handed to I2S
+    // guarded by m_statsLock, the state the pump sleeps in since m_lastWakeEnd
+    bool                     m_sleepPlaying = false;
+    int64_t                  m_lastWakeEnd = 0;
+    Stats                    m_stats = {};
+    std::mutex               m_statsLock;
+    // esp_timer time of the command being measured, 0 once it's done
+    int64_t                  m_startCmdTime = 0;  // owned by looperTask
+    int64_t                  m_stopCmdTime = 0;   // owned by looperTask
     std::function<void()>    m_timeoutExpiredCallback;
 };
\ No newline at end of file
@@ -0,0 +1,85 @@
+#ifndef BodyWriters_hpp
+#define BodyWriters_hpp
+
+#include <vector>
+
+#include "Arduino.h"
+
+#include "AlarmService.hpp"
+#include "RingtoneLibrary.hpp"
+#include "UrlParser.hpp"
+
+
+/**
+ * Writes ids of the added alarms as {"ids": [...]}, as many ids per chunk
+ * as fit in its buffer
+ */
+class IdsWriter : public UrlParser::BodyWriter {
+public:
+    IdsWriter(std::vector<Alarm::id_t> &&ids) : m_ids(std::move(ids)) {}
+
+    bool write(mg_connection *conn) override;
+
+private:
+    static const size_t chunkSize = 256;
+    static const size_t maxIdLength = 20;  // digits of UINT64_MAX
+
+    std::vector<Alarm::id_t> m_ids;
+    size_t                   m_next = 0;  // id to write, size() + 1 when done
+};
+
+/**
+ * Writes a JSON array, as many items per chunk as fit in its buffer, so
+ * the memory doesn't depend on their number
+ */
+class ArrayWriter : public UrlParser::BodyWriter {
+public:
+    bool write(mg_connection *conn) override;
+    // an item didn't fit even in a chunk of its own
+    bool failed() const override { return m_failed; }
+
+protected:
+    virtual size_t size() const = 0;
+    // returns the length of the JSON of item `index`, 0 if it doesn't fit
+    // in `size`
+    virtual size_t writeItem(size_t index, char *buf, size_t size) const = 0;
+    // one byte is left for the ',' or ']' after the item
+    static size_t serializeItem(const JsonDocument &item, char *buf, size_t size);
+
+private:
+    static const size_t chunkSize = 512;
+
+    size_t m_next = 0;  // item to write, size() + 1 when done
+    bool   m_failed = false;
+};
+
+/* Writes the alarms of a snapshot */
+class AlarmsWriter : public ArrayWriter {
+public:
+    AlarmsWriter(AlarmService::SnapshotPtr snapshot, RingtoneLibrary::CatalogPtr ringtones) :
+    m_snapshot(snapshot), m_ringtones(ringtones)
+    {}
+
+protected:
+    size_t size() const override { return m_snapshot->alarms.size(); }
+    size_t writeItem(size_t index, char *buf, size_t size) const override;
+
+private:
+    AlarmService::SnapshotPtr   m_snapshot;
+    RingtoneLibrary::CatalogPtr m_ringtones;
+};
+
+/* Writes the ringtones of a catalog */
+class RingtonesWriter : public ArrayWriter {
+public:
+    RingtonesWriter(RingtoneLibrary::CatalogPtr catalog) : m_catalog(catalog) {}
+
+protected:
+    size_t size() const override { return m_catalog->entries.size(); }
+    size_t writeItem(size_t index, char *buf, size_t size) const override;
+
+private:
+    RingtoneLibrary::CatalogPtr m_catalog;
+};
+
+#endif  // #ifdef BodyWriters_hpp
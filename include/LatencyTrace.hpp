@@ -0,0 +1,98 @@
+#ifndef LatencyTrace_hpp
+#define LatencyTrace_hpp
+
+#include <atomic>
+#include <mutex>
+
+#include "Arduino.h"
+
+
+/**
+ * Timestamps an alarm firing at each stage, from the RTC interrupt to the
+ * first audio frame. record() is lock-free and safe in ISRs, it writes the
+ * stage to a ring buffer; collect() folds the ring into per-stage latency
+ * histograms, which are kept since boot.
+ *
+ * Each stage is recorded only once per firing, so it can be called on
+ * every audio frame or every reconnect of the player.
+ */
+class LatencyTrace {
+public:
+    enum Stage : uint8_t {
+        Interrupt,     // DS3231 INT edge, starts a new firing
+        Dequeued,      // the event loop got FireAlarm
+        Rearmed,       // both RTC slots are armed with the next firings
+        PlayerStarted, // AudioLooper::start() was called
+        PlayerWoken,   // the looper task got StartCmd
+        FileOpened,    // connecttoSD() returned, the player wasn't primed
+        Resumed,       // the primed player was resumed
+        FirstFrame,    // the first decoded frame went to I2S
+        stageCount
+    };
+
+    /* Latencies since boot, us */
+    struct Summary {
+        uint32_t count;
+        uint32_t p50;   // upper bound of the histogram bucket, within 25%
+        uint32_t p99;
+        uint32_t max;
+    };
+
+    void IRAM_ATTR record(Stage stage);
+    void IRAM_ATTR record(Stage stage, int64_t time);
+
+    void collect();  // takes m_collectLock
+    // from the previous stage the firing got to (`Interrupt` has none)
+    Summary summary(Stage stage);  // takes m_collectLock
+    // the whole way to the first frame, with or without a primed player
+    Summary total(bool primed);    // takes m_collectLock
+    uint32_t firings() const { return m_firing.load(std::memory_order_relaxed); }
+    uint32_t lostEvents();  // takes m_collectLock
+
+    static const char *stageName(Stage stage);
+
+private:
+    struct Event {
+        std::atomic<uint32_t> seq;  // index of the event + 1 once it's written
+        uint32_t              firing;
+        Stage                 stage;
+        int64_t               time;
+    };
+
+    // 4 buckets per power of two, latencies above 16 s share the last one
+    static const size_t bucketCount = 96;
+    static const size_t ringSize = 64;  // enough for 9 firings between collects
+
+    struct Histogram {
+        uint32_t count;
+        uint32_t max;
+        uint32_t buckets[bucketCount];
+    };
+
+    static size_t bucketOf(uint32_t latency);
+    static uint32_t bucketBound(size_t bucket);
+    static uint32_t percentile(const Histogram &hist, uint32_t permille);
+    static Summary summarize(const Histogram &hist);
+    void fold(const Event &event);
+    static void add(Histogram &hist, uint32_t latency);
+
+    Event                    m_ring[ringSize] = {};
+    std::atomic<uint32_t>    m_head{0};   // events claimed by writers
+    std::atomic<uint32_t>    m_firing{0};
+    // the last firing each stage was recorded for
+    std::atomic<uint32_t>    m_recorded[stageCount] = {};
+
+    // owned by collect()
+    std::mutex               m_collectLock;
+    uint32_t                 m_tail = 0;  // events folded or lost
+    uint32_t                 m_lost = 0;  // overwritten before collect()
+    uint32_t                 m_foldedFiring = 0;
+    uint16_t                 m_seenStages = 0;  // bitmask for m_foldedFiring
+    int64_t                  m_stageTimes[stageCount];
+    Histogram                m_histograms[stageCount] = {};
+    Histogram                m_totals[2] = {};  // cold, primed
+};
+
+extern LatencyTrace MainLatencyTrace;
+
+#endif  // #ifdef LatencyTrace_hpp
@@ -0,0 +1,75 @@
+#ifndef Mixer_hpp
+#define Mixer_hpp
+
+#include "Arduino.h"
+
+
+/**
+ * Mixing stage between the decoder and I2S. Voice 0 is the decoded stream,
+ * the rest are tone generators, so short signals are played over the
+ * ringtone without stopping it. Each voice has a Q15 gain which is ramped
+ * linearly, one step per sample, so fades start and end at exact samples.
+ *
+ * process() gets every decoded frame, the tones sound only while the
+ * decoder produces frames. The mixer isn't thread-safe, it's owned by the
+ * task that runs the decoder.
+ */
+class Mixer {
+public:
+    using gain_t = int32_t;  // Q15
+    static constexpr gain_t unityGain = 1 << 15;
+    static constexpr size_t voiceCount = 4;
+    static constexpr size_t streamVoice = 0;
+
+    Mixer();
+
+    // gains are clamped to [0, unityGain], the mixer only attenuates
+    void   setGain(size_t voice, gain_t gain);
+    // ramps the gain from the current one to `gain` in `samples`
+    void   fade(size_t voice, gain_t gain, uint32_t samples);
+    bool   isFading(size_t voice) const { return m_voices[voice].rampLeft != 0; }
+    gain_t gain(size_t voice)     const { return m_voices[voice].level >> levelShift; }
+
+    /*
+     * Plays a sine tone after `delay` samples on a free tone voice, it fades
+     * in and out in `ramp` samples so there are no clicks; false if all
+     * of the tone voices are busy
+     */
+    bool playTone(
+        uint32_t frequency, uint32_t sampleRate, uint32_t delay,
+        uint32_t length, uint32_t ramp, gain_t gain
+    );
+    void stopTones();
+
+    // mixes the voices into interleaved stereo `samples` in place
+    void process(int16_t *samples, uint16_t frames);
+
+private:
+    // levels have 15 more fraction bits than gains, so ramps of any length
+    // have a nonzero step
+    static const int levelShift = 15;
+
+    struct Voice {
+        int32_t  level;     // gain << levelShift
+        int32_t  step;      // added to the level each sample of the ramp
+        int32_t  target;
+        uint32_t rampLeft;  // samples
+        // tone voices only
+        bool     active;
+        uint32_t phase;     // of the sine, a full period is 2^32
+        uint32_t phaseStep;
+        uint32_t delay;     // samples before the tone starts
+        uint32_t left;      // samples until the tone ends
+        uint32_t ramp;      // samples of the fade in and out
+    };
+
+    static int32_t levelOf(gain_t gain);
+    static void startRamp(Voice &voice, int32_t level, uint32_t samples);
+    static int32_t advance(Voice &voice);  // returns the gain for the sample
+    int32_t nextTone(Voice &voice);       // returns the Q15 sample
+
+    Voice  m_voices[voiceCount] = {};
+    size_t m_activeTones = 0;
+};
+
+#endif  // #ifdef Mixer_hpp
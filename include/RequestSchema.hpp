@@ -0,0 +1,130 @@
+#ifndef RequestSchema_hpp
+#define RequestSchema_hpp
+
+#include <cstring>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <utility>
+
+#include "ArduinoJson.h"
+#include "UrlParser.hpp"
+
+
+/**
+ * Declarative schemas of JSON request bodies. A schema is a constexpr list
+ * of fields, each one has a name, a member of a plain struct and a parser,
+ * which is a type with
+ *     static UrlParser::Result parse(JsonVariant json, Value &value);
+ * that returns the error of the field if `json` is invalid.
+ *
+ * Schema::parse() walks the members of the object once, each key is looked
+ * up among the field names and the value goes right to its parser, then
+ * the required fields that weren't there are reported as missing. Optional
+ * fields are std::optional members, or plain ones with a default.
+ *
+ * sample:
+ * struct Volume { int volume; };
+ * static constexpr auto volumeSchema = schema::make<Volume>(
+ *     schema::required<VolumeParser>("volume", &Volume::volume)
+ * );
+ */
+namespace schema {
+
+inline UrlParser::Result missingField(std::string fieldName)
+{
+    return UrlParser::Result(400, "Missing '" + fieldName + "' field");
+}
+
+template<class T, class Parser, class Member>
+struct Field {
+    const char *name;
+    Member T::*member;
+    bool        required;
+
+    UrlParser::Result parse(JsonVariant json, T &out) const
+    {
+        return Parser::parse(json, valueOf(out.*member));
+    }
+
+private:
+    template<class V>
+    static V &valueOf(V &value) { return value; }
+    template<class V>
+    static V &valueOf(std::optional<V> &value) { return value.emplace(); }
+};
+
+template<class Parser, class T, class Member>
+constexpr Field<T, Parser, Member> required(const char *name, Member T::*member)
+{
+    return {name, member, true};
+}
+
+template<class Parser, class T, class Member>
+constexpr Field<T, Parser, Member> optional(const char *name, Member T::*member)
+{
+    return {name, member, false};
+}
+
+template<class T, class... Fields>
+class Schema {
+public:
+    static_assert(sizeof...(Fields) <= 32, "presence of fields is a 32-bit mask");
+
+    constexpr Schema(Fields... fields) : m_fields(fields...) {}
+
+    // fills `out` from the object in `json`, anything else has no fields
+    UrlParser::Result parse(JsonVariant json, T &out) const
+    {
+        auto indices = std::index_sequence_for<Fields...>();
+        uint32_t seen = 0;
+
+        for (JsonPair pair : json.as<JsonObject>()) {
+            UrlParser::Result result =
+                parseMember(pair.key().c_str(), pair.value(), out, seen, indices);
+            if (!result.success) {
+                return result;
+            }
+        }
+        return checkRequired(seen, indices);
+    }
+
+private:
+    // the first field named `key` parses the value, unknown keys are skipped
+    template<size_t... I>
+    UrlParser::Result parseMember(
+        const char *key, JsonVariant value, T &out, uint32_t &seen,
+        std::index_sequence<I...>
+    ) const
+    {
+        UrlParser::Result result(200);
+
+        ((strcmp(key, std::get<I>(m_fields).name) == 0
+          && (result = std::get<I>(m_fields).parse(value, out), seen |= 1u << I, true))
+         || ...);
+        return result;
+    }
+
+    template<size_t... I>
+    UrlParser::Result checkRequired(uint32_t seen, std::index_sequence<I...>) const
+    {
+        UrlParser::Result result(200);
+
+        ((std::get<I>(m_fields).required && !(seen & 1u << I)
+          && (result = missingField(std::get<I>(m_fields).name), true))
+         || ...);
+        return result;
+    }
+
+    std::tuple<Fields...> m_fields;
+};
+
+template<class T, class... Fields>
+constexpr Schema<T, Fields...> make(Fields... fields)
+{
+    return Schema<T, Fields...>(fields...);
+}
+
+}  // namespace schema
+
+#endif  // #ifdef RequestSchema_hpp
@@ -0,0 +1,117 @@
+#ifndef RingtoneLibrary_hpp
+#define RingtoneLibrary_hpp
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Arduino.h"
+#include "SD.h"
+
+
+/**
+ * Catalog of the ringtones on the SD card. Metadata of every file is kept
+ * in an index file next to them, so the directory is scanned only once at
+ * boot, and only new or changed files are parsed then. After that the
+ * index is updated per file, once an upload is finished.
+ *
+ * Ringtones are referenced by id (1-based index in the catalog), which
+ * never changes for a name while running; id 0 is the default ringtone.
+ * A rebuilt index numbers the files anew, so what's stored is the key,
+ * a hash of the name, which alarms map back to an id once loaded.
+ * Lookups read an immutable catalog, they never wait for the index to be
+ * written.
+ */
+class RingtoneLibrary {
+public:
+    using id_t = uint16_t;
+    using key_t = uint32_t;
+    static const id_t  defaultRingtone = 0;
+    static const key_t defaultKey = 0;
+    // of the files, so they fit in AudioLooper::Track
+    static const size_t maxPathLength = 47;
+
+    enum Codec : uint8_t { UnknownCodec, Mp3Codec, WavCodec };
+
+    struct Entry {
+        std::string name;
+        uint32_t    size;        // bytes
+        uint32_t    modified;    // unixtime of the last write, to spot changes
+        Codec       codec;
+        uint32_t    sampleRate;  // Hz
+        uint32_t    duration;    // ms
+        uint32_t    firstFrame;  // offset of the first audio frame, past the tags
+        bool        available;   // the file is on the SD card and is playable
+        uint32_t    revision;    // changes when the file is replaced, not stored
+    };
+
+    /* entries[id - 1] is the ringtone with `id` */
+    struct Catalog {
+        std::vector<Entry>                    entries;
+        std::unordered_map<std::string, id_t> ids;
+        std::unordered_map<key_t, id_t>       keys;
+    };
+    using CatalogPtr = std::shared_ptr<const Catalog>;
+
+    bool begin(const std::string &dir);      // takes m_writeLock
+    // parses the file again, false if it's not playable; takes m_writeLock
+    bool update(const std::string &name);
+
+    CatalogPtr catalog() const { return std::atomic_load(&m_catalog); }
+    id_t find(const std::string &name) const;  // 0 if there's no such ringtone
+    // the stable reference to a ringtone, for storing it
+    key_t keyOf(id_t id) const;               // defaultKey for unknown ids
+    id_t  findKey(key_t key) const;           // 0 if there's no such ringtone
+    // false if the name's key belongs to another ringtone, or it's too long
+    bool  canAdd(const std::string &name) const;
+    static key_t keyOf(const std::string &name);
+    // false for the default ringtone and the ones that aren't available
+    bool get(id_t id, Entry &entry) const;
+    std::string path(const Entry &entry) const { return m_dir + "/" + entry.name; }
+
+    static const char *codecName(Codec codec);
+
+private:
+    struct IndexRecord {
+        uint32_t crc;  // of the rest of the record
+        char     name[33];
+        uint8_t  codec;
+        uint8_t  available;
+        uint8_t  reserved;
+        uint32_t size;
+        uint32_t modified;
+        uint32_t sampleRate;
+        uint32_t duration;
+        uint32_t firstFrame;
+    };
+    static_assert(sizeof(IndexRecord) == 60);
+
+    struct IndexHeader {
+        uint32_t magic;
+        uint32_t records;
+    };
+
+    bool loadIndex(Catalog &catalog);
+    bool writeIndex(const Catalog &catalog);
+    // parses the file, returns false if it's not a playable ringtone
+    static bool parse(File &file, Entry &entry);
+    static bool parseMp3(File &file, Entry &entry);
+    static bool parseWav(File &file, Entry &entry);
+    bool canAdd(const Catalog &catalog, const std::string &name) const;
+    static void put(Catalog &catalog, const Entry &entry);
+    void publish(Catalog &&catalog);
+
+    std::string  m_dir;
+    std::string  m_indexPath;
+    std::string  m_tmpPath;
+    CatalogPtr   m_catalog = std::make_shared<const Catalog>();
+    std::mutex   m_writeLock;  // serializes the index updates
+    uint32_t     m_revisions = 0;  // files updated since boot, under m_writeLock
+};
+
+extern RingtoneLibrary MainRingtoneLibrary;
+
+#endif  // #ifdef RingtoneLibrary_hpp
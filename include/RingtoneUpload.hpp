@@ -0,0 +1,72 @@
+#ifndef RingtoneUpload_hpp
+#define RingtoneUpload_hpp
+
+#include <string>
+#include <string_view>
+
+#include "Arduino.h"
+#include "SD.h"
+
+
+/**
+ * Writes one uploaded ringtone to the SD card as it arrives. The body goes
+ * to `<name>.part`, which replaces the ringtone only once all of it is
+ * written, so a broken upload never leaves a half of the file playable.
+ * FAT can't rename over a file, so the old one is moved to `<name>.bak`
+ * first and is removed only once the new one is in place; recover() puts
+ * it back if the power was lost in between.
+ * The format is checked by the first bytes, before the rest is received.
+ */
+class RingtoneUpload {
+public:
+    struct Stats {
+        uint32_t bytes;
+        uint32_t time;      // us from begin() to finish()
+        uint32_t peakHeap;  // bytes of heap used by the upload at most
+    };
+
+    static constexpr char   directory[] = "/ringtones";
+    static constexpr size_t maxNameLength = 32;
+
+    ~RingtoneUpload();  // removes the partial file if not finished
+
+    static bool isValidName(std::string_view name);
+    // restores the ringtones an interrupted finish() has moved away and
+    // removes the partial files, called before the ringtones are loaded
+    static void recover();
+    // free space of the SD card, measured by recover() and then counted by
+    // the uploads, as measuring it reads the whole FAT
+    static uint64_t freeBytes();
+    bool begin(const std::string &name, size_t size);
+    bool write(const uint8_t *data, size_t length);  // false if it's rejected
+    bool finish();
+
+    bool isComplete() const     { return m_received == m_size; }
+    bool isFinished() const     { return m_finished; }
+    bool formatRejected() const { return m_formatRejected; }
+    size_t remaining() const    { return m_size - m_received; }
+    const std::string &name() const { return m_name; }
+    const Stats &stats() const  { return m_stats; }
+
+private:
+    static constexpr size_t headerSize = 12;  // enough to tell the format
+
+    bool checkFormat() const;
+
+    std::string   m_name;
+    std::string   m_path;
+    std::string   m_partPath;
+    std::string   m_backupPath;
+    File          m_file;
+    size_t        m_size = 0;
+    size_t        m_received = 0;
+    uint8_t       m_header[headerSize];
+    bool          m_formatRejected = false;
+    bool          m_reserved = false;  // m_size is taken from freeBytes()
+    bool          m_finished = false;
+    int64_t       m_startTime = 0;
+    uint32_t      m_startHeap = 0;
+    Stats         m_stats = {};
+};
+
+#endif  // #ifdef RingtoneUpload_hpp
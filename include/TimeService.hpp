@@ -0,0 +1,75 @@
+#ifndef TimeService_hpp
+#define TimeService_hpp
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include "Arduino.h"
+#include "RTClib.h"
+#include "freertos/FreeRTOS.h"
+
+#include "Tools.hpp"
+
+
+/**
+ * Answers the current time from esp_timer without touching I2C.
+ * esp_timer is disciplined against the DS3231: every resync finds the edge
+ * of an RTC second, rebases on it and corrects the rate of esp_timer
+ * by the drift measured since the previous edge.
+ * now() is lock-free, the base is published through a seqlock.
+ */
+class TimeService {
+public:
+    struct Stats {
+        uint32_t rtcReads;        // I2C reads of the RTC made by TimeService
+        uint32_t resyncs;
+        int32_t  lastCorrection;  // estimated minus RTC time at the last edge, us
+        uint32_t microsPerSecond; // esp_timer us in an RTC second
+    };
+
+    void begin(
+        RTC_DS3231 *rtc, std::shared_ptr<std::mutex> rtcMutex,
+        uint32_t resyncInterval, std::function<void()> onTimeInvalid
+    );
+
+    DateTime now() const;       // lock-free, no I2C
+    uint32_t unixtime() const;  // lock-free, no I2C
+    // also returns how far the current second has gone, us
+    uint32_t unixtime(uint32_t *micros) const;
+    // takes m_rtcLock, returns how far the time has stepped, s
+    int32_t adjust(const DateTime &time);
+    Stats stats();
+
+    static bool isValid(const DateTime &time);
+
+private:
+    bool resync();   // takes m_rtcLock on each read
+    void resyncLoop();
+    void rebase(uint32_t time, int64_t micros, uint32_t microsPerSecond);
+    DateTime readRtc();  // takes m_rtcLock
+    void countRtcRead();  // takes m_statsLock
+
+    // the base can be rewritten only by one writer at a time
+    std::atomic<uint32_t>        m_seq{0};
+    uint32_t                     m_baseTime = 0;      // unixtime at m_baseMicros
+    int64_t                      m_baseMicros = 0;    // esp_timer time of an RTC second edge
+    uint32_t                     m_microsPerSecond = 1000000;
+    bool                         m_aligned = false;   // m_baseMicros is a measured edge
+    bool                         m_rateMeasured = false;
+
+    Stats                        m_stats = {};
+    std::mutex                   m_statsLock;
+    std::mutex                   m_writeLock;  // serializes resync() and adjust()
+
+    RTC_DS3231                  *m_rtc;
+    std::shared_ptr<std::mutex>  m_rtcLock;
+    uint32_t                     m_resyncInterval;  // ms
+    std::function<void()>        m_onTimeInvalid;
+    TaskHandle_t                 m_resyncTask;
+};
+
+extern TimeService MainTimeService;
+
+#endif  // #ifdef TimeService_hpp
@@ -4,24 +4,52 @@
 #include "Arduino.h"
 
 #include <functional>
-#include <map>
+#include <memory>
 #include <set>
 #include <string>
+#include <string_view>
 #include <variant>
-#include <variant>
+#include <vector>
 
 #include "../mongoose.h"
 #include "ArduinoJson.h"
 
 
+/**
+ * Routes requests to endpoints. Patterns are compiled into a trie of path
+ * segments, where {name} segments are wildcard edges and the endpoints are
+ * kept in the nodes where their patterns end. A request walks the trie
+ * by the segments of its url, so matching doesn't depend on the number of
+ * endpoints; if several endpoints match, the one with the lowest priority
+ * wins, and the one added first among equal priorities.
+ *
+ * Request bodies are parsed only for the endpoints that declare a JSON
+ * body, after the route is found, into a document that is reused between
+ * requests and grows with the size of the body.
+ *
+ * Responses go into a document of the capacity the endpoint declares, it's
+ * reused too, so Response::data is valid until the next match(). A response
+ * that doesn't fit is replaced with a 500; the ones that can grow without
+ * a limit are streamed with a BodyWriter instead.
+ */
 class UrlParser {
 public:
     struct Endpoint;
     struct Response;
     struct Result;
     struct Request;
+    class Params;
+    class BodyWriter;
+
+    static const size_t maxParams = 8;  // wildcards in a pattern
+    // bytes, larger ones get 413; a batch of 100 alarms is 9-13 KB of JSON
+    static const size_t maxBodySize = 16384;
+    // bytes of the response document, enough for an object with an error
+    static const size_t defaultResponseCapacity = 256;
+
+    enum BodyKind { NoBody, JsonBody };
 
-    using params_t = std::map<std::string, std::string>;
+    using params_t = Params;
     using callback_t = std::function<Result(const Request &, Response &)>;
 
     UrlParser(const std::multiset<Endpoint> &endpoints);
@@ -35,10 +63,86 @@ public:
     Result match(const mg_http_message &request, Response &response);
 
 private:
-    static bool
-        matchUrl(std::string_view url, std::string_view pattern, params_t &params);
+    using node_t = uint16_t;
+    static const node_t   noNode = UINT16_MAX;
+
+    using filter_t = std::shared_ptr<const DynamicJsonDocument>;
+
+    // the body document starts at minBodyCapacity or 2.5 times the body
+    // size (an alarm object takes about 210 bytes of the document for 85
+    // bytes of JSON), it's doubled while the body doesn't fit up to
+    // maxBodyCapacity and is kept for the next request if it's not larger
+    // than keptBodyCapacity
+    static const size_t minBodyCapacity = 256;
+    static const size_t keptBodyCapacity = 2048;
+    static const size_t maxBodyCapacity = 32768;
+    // a response document larger than this is freed by the next match()
+    static const size_t keptResponseCapacity = 1024;
+
+    struct Route {
+        size_t                   endpoint;  // index in m_endpoints
+        std::vector<std::string> params;    // names of the wildcards in order
+        filter_t                 filter;    // null to keep the whole body
+    };
 
-    std::multiset<Endpoint> m_endpoints;
+    struct Node {
+        // literal segments, sorted for binary search
+        std::vector<std::pair<std::string, node_t>> children;
+        node_t                                      wildcard = noNode;
+        std::vector<Route>                          routes;
+    };
+
+    /* The best route found so far and the wildcard values on its way */
+    struct Match {
+        const Route      *route = nullptr;
+        std::string_view  values[maxParams];
+    };
+
+    node_t addChild(node_t parent, std::string_view segment);
+    void matchNode(
+        node_t node, std::string_view path, const mg_str &method,
+        std::string_view *values, size_t depth, Match &best
+    ) const;
+    bool isBetter(const Route &route, const Match &best) const;
+    // deserializes the body into m_bodyDoc, an empty body is null
+    Result parseBody(const mg_str &body, const Route &route);
+    static filter_t compileFilter(const char *filter);
+    // empties m_responseDoc, reallocated if it has less than `capacity` or
+    // more than it should keep
+    JsonObject resetResponse(size_t capacity);
+
+    // strips a leading and a trailing slash
+    static std::string_view trimSlashes(std::string_view path);
+    // splits off the first segment of `path`
+    static std::string_view nextSegment(std::string_view &path);
+
+    std::vector<Endpoint> m_endpoints;
+    std::vector<Node>     m_nodes = std::vector<Node>(1);  // [0] is the root
+    // only used by match(), which runs in the mongoose task
+    std::unique_ptr<DynamicJsonDocument> m_bodyDoc;
+    std::unique_ptr<DynamicJsonDocument> m_responseDoc;
+};
+
+/**
+ * Values of the wildcards of the matched pattern, by their names. Both
+ * point to the request and the pattern, so they are valid only while
+ * the endpoint's callback runs.
+ */
+class UrlParser::Params {
+public:
+    void add(std::string_view name, std::string_view value);
+
+    size_t size() const { return m_size; }
+    // false if there is no such parameter
+    bool get(std::string_view name, std::string_view &value) const;
+    // false if there is no such parameter, or it's not a decimal
+    // number that fits in uint64_t
+    bool u64(std::string_view name, uint64_t &value) const;
+
+private:
+    std::string_view m_names[maxParams];
+    std::string_view m_values[maxParams];
+    size_t           m_size = 0;
 };
 
 struct UrlParser::Result {
@@ -57,6 +161,12 @@ struct UrlParser::Endpoint {
     std::string method;
     std::string pattern;
     callback_t callback;
+    BodyKind body = NoBody;
+    // ArduinoJson filter of the body, as JSON, null to keep all of it
+    const char *filter = nullptr;
+    // of the response document, the JSON_OBJECT_SIZE()s of what the
+    // callback adds to it
+    size_t responseCapacity = defaultResponseCapacity;
 
     Result operator()(const Request &request, Response &response) const
     {
@@ -69,15 +179,31 @@ struct UrlParser::Endpoint {
     }
 };
 
+/**
+ * Body of a response that is sent with chunked transfer encoding, a piece
+ * at a time once the connection has sent the previous ones, so its size
+ * doesn't depend on the memory
+ */
+class UrlParser::BodyWriter {
+public:
+    virtual ~BodyWriter() = default;
+    // appends the next chunk to `conn`, returns false once the body is over
+    virtual bool write(mg_connection *conn) = 0;
+    // the body is over without being complete, it must not be ended as
+    // if it were
+    virtual bool failed() const { return false; }
+};
+
 struct UrlParser::Response {
-    JsonVariant data;
-    std::string headers;
+    JsonVariant                 data;  // bound to the parser's document by match()
+    std::string                 headers;
+    std::unique_ptr<BodyWriter> body;  // sent instead of `data` if set
 };
 
 struct UrlParser::Request {
     const mg_http_message &rawMessage;
     const params_t &urlParams;
-    JsonVariant data;
+    JsonVariant data;  // null unless the endpoint has a JSON body
 };
 
 #endif  // #ifdef UrlParser_hpp
\ No newline at end of file
@@ -3,6 +3,10 @@
 
 #include "ArduinoJson.h"
 #include "AlarmService.hpp"
+#include "LatencyTrace.hpp"
+#include "RequestSchema.hpp"
+#include "RingtoneLibrary.hpp"
+#include "RingtoneUpload.hpp"
 #include "UrlParser.hpp"
 
 
@@ -23,13 +27,46 @@ static const UrlParser::Result invalidEnabledField(
 static const UrlParser::Result invalidVolumeField(
     400, "Invalid 'volume' field, must be a number between 0 and 100"
 );
+static const UrlParser::Result invalidAlarmsArray(
+    400, "Request body must be an array of alarms"
+);
+static const UrlParser::Result tooManyAlarms(
+    507, "Too many alarms, remove some of them first"
+);
 static const UrlParser::Result invalidId(
     400, "Invalid (or too large) id in url, must be a number"
 );
 
-inline auto missingField(std::string fieldName) {
-    return UrlParser::Result(400, "Missing '" + fieldName + "' field");
-}
+static const UrlParser::Result lengthRequired(
+    411, "Content-Length header is required"
+);
+static const UrlParser::Result invalidRingtoneName(
+    400, "Invalid ringtone name, must be up to 32 letters, digits, '_', '-' "
+         "or '.' and end with '.mp3' or '.wav'"
+);
+static const UrlParser::Result emptyRingtone(
+    400, "Ringtone file is empty"
+);
+static const UrlParser::Result ringtoneNameTaken(
+    409, "Ringtone name clashes with another ringtone, pick another one"
+);
+static const UrlParser::Result unsupportedRingtoneFormat(
+    415, "Ringtone must be an MP3 or WAV file matching its extension"
+);
+static const UrlParser::Result insufficientStorage(
+    507, "Not enough free space on the SD card"
+);
+static const UrlParser::Result ringtoneWriteFailed(
+    500, "Could not write the ringtone to the SD card"
+);
+static const UrlParser::Result invalidRingtoneField(
+    400, "Invalid 'ringtone' field, must be a ringtone name or null"
+);
+static const UrlParser::Result ringtoneNotFound(
+    400, "There's no such ringtone, it must be uploaded first"
+);
+
+using schema::missingField;
 
 inline auto alarmNotFound(Alarm::id_t id) {
     return UrlParser::Result(404, "Alarm with id " + std::to_string(id) + " not found");
@@ -40,6 +77,9 @@ namespace api {
     UrlParser::Result addAlarm(
         const UrlParser::Request &request, UrlParser::Response &response
     );
+    UrlParser::Result addAlarms(
+        const UrlParser::Request &request, UrlParser::Response &response
+    );
     UrlParser::Result getAlarms(
         const UrlParser::Request &request, UrlParser::Response &response
     );
@@ -61,6 +101,20 @@ namespace api {
     UrlParser::Result printAlarms(
         const UrlParser::Request &request, UrlParser::Response &response
     );
+    UrlParser::Result getStats(
+        const UrlParser::Request &request, UrlParser::Response &response
+    );
+    UrlParser::Result getLatencyStats(
+        const UrlParser::Request &request, UrlParser::Response &response
+    );
+    UrlParser::Result getAudioStats(
+        const UrlParser::Request &request, UrlParser::Response &response
+    );
+    UrlParser::Result getRingtones(
+        const UrlParser::Request &request, UrlParser::Response &response
+    );
+    // handles the whole event if it belongs to a ringtone upload
+    bool streamRingtone(mg_connection *conn, int evt, void *evtData);
 }
 
 extern UrlParser ApiUrlParser;
\ No newline at end of file
@@ -0,0 +1,135 @@
+#ifndef WeekIndex_hpp
+#define WeekIndex_hpp
+
+#include <algorithm>
+#include <vector>
+
+#include "Arduino.h"
+
+#include "Alarm.hpp"
+
+
+/**
+ * Two-level bitmap: a bit per slot and a summary bit per 32-bit word,
+ * so finding the next set bit takes a couple of word scans.
+ */
+template<size_t Bits> class MinuteBitmap {
+public:
+    void set(size_t bit)
+    {
+        m_words[bit / 32] |= 1u << (bit % 32);
+        m_summary[bit / 1024] |= 1u << (bit / 32 % 32);
+    }
+
+    void reset(size_t bit)
+    {
+        m_words[bit / 32] &= ~(1u << (bit % 32));
+        if (m_words[bit / 32] == 0)
+            m_summary[bit / 1024] &= ~(1u << (bit / 32 % 32));
+    }
+
+    bool test(size_t bit) const { return m_words[bit / 32] & (1u << (bit % 32)); }
+
+    /* Returns the first set bit not less than `from`, or -1 if there's none */
+    int findNext(size_t from) const
+    {
+        if (from >= Bits)
+            return -1;
+
+        size_t word = from / 32;
+        uint32_t bits = m_words[word] & (~0u << (from % 32));
+        if (bits)
+            return word * 32 + __builtin_ctz(bits);
+
+        // look for the next non-empty word in the summary
+        size_t next = word + 1;
+        for (size_t i = next / 32; i < summaryWords; ++i) {
+            uint32_t summary = m_summary[i];
+            if (i == next / 32)
+                summary &= ~0u << (next % 32);
+            if (summary) {
+                size_t found = i * 32 + __builtin_ctz(summary);
+                return found * 32 + __builtin_ctz(m_words[found]);
+            }
+        }
+        return -1;
+    }
+
+private:
+    static const size_t words = (Bits + 31) / 32;
+    static const size_t summaryWords = (words + 31) / 32;
+
+    uint32_t m_words[words] = {};
+    uint32_t m_summary[summaryWords] = {};
+};
+
+
+/**
+ * Index of HwAlarms by the minute of the week they fire at.
+ * Alarms bound to a day of week are indexed by the minute of the week,
+ * daily ones - by the minute of the day, so each HwAlarm takes one slot.
+ * HwAlarms firing at the same minute are linked into a list
+ * through their handles.
+ */
+class WeekIndex {
+public:
+    using handle_t = uint16_t;
+    static constexpr handle_t noHandle = UINT16_MAX;
+
+    void insert(handle_t handle, const HwAlarm &alarm);
+    void remove(handle_t handle, const HwAlarm &alarm);
+    void clear();
+
+    /* Returns the first minute of the week from `minuteOfWeek` (inclusive,
+     * wrapping around the end of the week) when any alarm fires, or -1 */
+    int nextOccupied(uint16_t minuteOfWeek) const;
+
+    /* Calls `fn(handle)` for each HwAlarm firing at the minute of the week */
+    template<class Fn> void forEachAt(uint16_t minuteOfWeek, Fn fn) const
+    {
+        uint16_t minuteOfDay = minuteOfWeek % HwAlarm::minutesPerDay;
+
+        if (m_week.test(minuteOfWeek))
+            for (handle_t h = head(minuteOfWeek); h != noHandle; h = m_next[h])
+                fn(h);
+        if (m_day.test(minuteOfDay))
+            for (handle_t h = head(dayKey(minuteOfDay)); h != noHandle; h = m_next[h])
+                fn(h);
+    }
+
+private:
+    static uint16_t key(const HwAlarm &alarm);
+    static uint16_t dayKey(uint16_t minuteOfDay)
+    {
+        return HwAlarm::minutesPerWeek + minuteOfDay;
+    }
+    handle_t head(uint16_t key) const { return findHead(key)->handle; }
+
+    struct Head {
+        uint16_t key;
+        handle_t handle;
+    };
+
+    // the first head with a key not less than `key`
+    std::vector<Head>::iterator findHead(uint16_t key)
+    {
+        return std::lower_bound(m_heads.begin(), m_heads.end(), key, keyLess);
+    }
+    std::vector<Head>::const_iterator findHead(uint16_t key) const
+    {
+        return std::lower_bound(m_heads.begin(), m_heads.end(), key, keyLess);
+    }
+    static bool keyLess(const Head &head, uint16_t key) { return head.key < key; }
+
+    MinuteBitmap<HwAlarm::minutesPerWeek> m_week;
+    MinuteBitmap<HwAlarm::minutesPerDay>  m_day;
+
+    // list heads only for occupied minutes sorted by key, 4 bytes each;
+    // keys of daily alarms are shifted by minutesPerWeek to share the
+    // vector with weekly ones
+    std::vector<Head>     m_heads;
+    std::vector<handle_t> m_next;  // indexed by handle
+    std::vector<handle_t> m_prev;  // indexed by handle
+};
+
+#endif  // #ifdef WeekIndex_hpp
@@ -1,5 +1,7 @@
 #include "Alarm.hpp"
 
+#include <cinttypes>
+
 
 /***************
  * class Alarm *
@@ -8,21 +10,18 @@
 Alarm::Alarm(byte hour, byte minute, DaysOfWeek daysOfWeek, bool enabled) :
 enabled(enabled), hour(hour), minute(minute), daysOfWeek(daysOfWeek)
 {
-    // unique alarm id:
-    // | 48 low bits of esp32 uptime in us | 16 high bits of random() |
-    m_id = (esp_timer_get_time() << 16) + (rand() >> 16);
     log_d("Created Alarm (%s)", CSTR(toString()));
 }
 
 std::string Alarm::toString() const
 {
     int len = snprintf(
-        nullptr, 0, "id=0x%016llx, time=%02d:%02d, enabled=%s", m_id, hour, minute,
+        nullptr, 0, "id=0x%016" PRIx64 ", time=%02d:%02d, enabled=%s", m_id, hour, minute,
         enabled ? "true" : "false"
     );
-    char buf[len];
+    char buf[len + 1];
     sprintf(
-        buf, "id=0x%016llx, time=%02d:%02d, enabled=%s", m_id, hour, minute,
+        buf, "id=0x%016" PRIx64 ", time=%02d:%02d, enabled=%s", m_id, hour, minute,
         enabled ? "true" : "false"
     );
 
@@ -56,51 +55,133 @@ bool Alarm::DaysOfWeek::isSet(byte day) const
  * class HwAlarm *
  *****************/
 
-HwAlarm::HwAlarm(Alarm *parent) : m_parentAlarm(parent), m_dayOfWeek(0)
+HwAlarm::HwAlarm(const Alarm &parent, uint16_t parentIndex) :
+m_parentIndex(parentIndex), m_dayOfWeek(0),
+m_minute(parent.hour * 60 + parent.minute), m_period(minutesPerDay)
 {
     log_d("Created HwAlarm (%s)", CSTR(toString()));
 }
 
-HwAlarm::HwAlarm(Alarm *parent, byte dayOfWeek) :
-m_parentAlarm(parent), m_dayOfWeek(dayOfWeek)
+HwAlarm::HwAlarm(const Alarm &parent, uint16_t parentIndex, byte dayOfWeek) :
+m_parentIndex(parentIndex), m_dayOfWeek(dayOfWeek)
 {
+    if (parent.usesDaysOfWeek()) {
+        m_minute = dayOfWeek * minutesPerDay + parent.hour * 60 + parent.minute;
+        m_period = minutesPerWeek;
+    } else {
+        m_minute = parent.hour * 60 + parent.minute;
+        m_period = minutesPerDay;
+    }
+
     log_d("Created HwAlarm (%s)", CSTR(toString()));
 }
 
 std::string HwAlarm::toString() const
 {
     int len = snprintf(
-        nullptr, 0, "parent=0x%016llx, time=%02d:%02d, addr=0x%08x",
-        parentAlarm().id(), parentAlarm().hour, parentAlarm().minute, (uint32_t)this
+        nullptr, 0, "parent=#%u, time=%02d:%02d, addr=0x%08x", parentIndex(),
+        hour(), minute(), (uint32_t)(uintptr_t)this
     );
-    char buf[len];
+    char buf[len + 1];
     sprintf(
-        buf, "parent=0x%016llx, time=%02d:%02d, addr=0x%08x", parentAlarm().id(),
-        parentAlarm().hour, parentAlarm().minute, (uint32_t)this
+        buf, "parent=#%u, time=%02d:%02d, addr=0x%08x", parentIndex(), hour(),
+        minute(), (uint32_t)(uintptr_t)this
     );
 
     /* if the instance is bound to a specific day of week */
-    if (parentAlarm().usesDaysOfWeek()) {
+    if (usesDaysOfWeek()) {
         int dowLen = snprintf(nullptr, 0, ", dow=%d", dayOfWeek());
-        char dowBuf[len + dowLen];
-        sprintf(dowBuf, ", dow=%d", dayOfWeek());
-        return std::string(strcat(buf, dowBuf));
+        char dowBuf[len + dowLen + 1];
+        sprintf(dowBuf, "%s, dow=%d", buf, dayOfWeek());
+        return std::string(dowBuf);
     };
 
     return std::string(buf);
 }
 
+/*
+ * 1970/01/01 was Thursday, so unixtime is shifted by 3 days
+ * to make the minute of the week start from Monday 00:00
+ */
+uint16_t HwAlarm::minuteOfPeriodAt(uint32_t time, uint16_t period)
+{
+    return (time / 60 + 3 * minutesPerDay) % period;
+}
+
+uint32_t HwAlarm::nextFiring(uint32_t now) const
+{
+    uint16_t nowMinute = minuteOfPeriodAt(now, m_period);
+    // minutes until the next firing, from 1 to m_period; if the alarm fires
+    // this minute, it's considered as fired, so the next firing is a period later
+    uint32_t delta = (m_minute + m_period - nowMinute - 1) % m_period + 1;
+
+    return (now / 60 + delta) * 60;
+}
+
+bool HwAlarm::hasFired(uint32_t when) const
+{
+    return m_minute <= minuteOfPeriodAt(when, m_period);
+}
+
+void HwAlarm::nextFirings(
+    const HwAlarm *alarms, size_t count, uint32_t now, uint32_t *out
+)
+{
+    // there are only two periods, so the divisions are done once per batch
+    uint16_t nowOfWeek = minuteOfPeriodAt(now, minutesPerWeek);
+    uint16_t nowOfDay = nowOfWeek % minutesPerDay;
+    uint32_t nowMinutes = now / 60;
+
+    for (size_t i = 0; i < count; ++i) {
+        const HwAlarm &alarm = alarms[i];
+        uint16_t nowMinute = alarm.m_period == minutesPerWeek ? nowOfWeek : nowOfDay;
+        // from 1 to the period, the same as in nextFiring()
+        int32_t delta = int32_t(alarm.m_minute) - nowMinute;
+        if (delta <= 0)
+            delta += alarm.m_period;
+
+        out[i] = (nowMinutes + delta) * 60;
+    }
+}
+
 DateTime HwAlarm::nextFiring(const DateTime &now) const
 {
-    int8_t hour = parentAlarm().hour;
-    int8_t minute = parentAlarm().minute;
+    DateTime ret(nextFiring(now.unixtime()));
+
+#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_DEBUG
+    if (ret != referenceNextFiring(now)) {
+        log_e(
+            "nextFiring() mismatch for HwAlarm (%s): %u != %u", CSTR(toString()),
+            ret.unixtime(), referenceNextFiring(now).unixtime()
+        );
+    }
+#endif
+    return ret;
+}
+
+bool HwAlarm::hasFired(const DateTime &when) const
+{
+    bool ret = hasFired(when.unixtime());
+
+#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_DEBUG
+    if (ret != referenceHasFired(when)) {
+        log_e("hasFired() mismatch for HwAlarm (%s)", CSTR(toString()));
+    }
+#endif
+    return ret;
+}
+
+DateTime HwAlarm::referenceNextFiring(const DateTime &now) const
+{
+    int8_t hour = this->hour();
+    int8_t minute = this->minute();
     int8_t nowDayOfWeek = CONVERT_DOWS(now.dayOfTheWeek());
     DateTime ret(now.year(), now.month(), now.day(), hour, minute);
 
     bool firedToday =
         hour != now.hour() ? hour < now.hour() : minute <= now.minute();
 
-    if (parentAlarm().usesDaysOfWeek()) {
+    if (usesDaysOfWeek()) {
         bool firedThisWeek = dayOfWeek() != nowDayOfWeek
                                  ? dayOfWeek() < nowDayOfWeek
                                  : firedToday;
@@ -114,16 +195,16 @@ DateTime HwAlarm::nextFiring(const DateTime &now) const
     }
 }
 
-bool HwAlarm::hasFired(const DateTime &when) const
+bool HwAlarm::referenceHasFired(const DateTime &when) const
 {
-    int8_t hour = parentAlarm().hour;
-    int8_t minute = parentAlarm().minute;
+    int8_t hour = this->hour();
+    int8_t minute = this->minute();
     int8_t whenDayOfWeek = CONVERT_DOWS(when.dayOfTheWeek());
 
     bool firedThatDay =
         hour != when.hour() ? hour < when.hour() : minute <= when.minute();
 
-    if (parentAlarm().usesDaysOfWeek()) {
+    if (usesDaysOfWeek()) {
         bool firedThatWeek = dayOfWeek() != whenDayOfWeek
                                  ? dayOfWeek() < whenDayOfWeek
                                  : firedThatDay;
@@ -0,0 +1,151 @@
+#include "AlarmQueue.hpp"
+
+
+AlarmQueue::handle_t AlarmQueue::push(const HwAlarm &alarm, uint32_t fireTime)
+{
+    handle_t handle;
+
+    if (m_freeHandles.empty()) {
+        // noHandle ends the lists of handles, so it's never given out
+        if (m_alarms.size() >= noHandle) {
+            log_e("Alarm queue is full");
+            return noHandle;
+        }
+        handle = m_alarms.size();
+        m_alarms.push_back(alarm);
+        m_positions.push_back(0);
+        m_nextOfParent.push_back(noHandle);
+    } else {
+        handle = m_freeHandles.back();
+        m_freeHandles.pop_back();
+        m_alarms[handle] = alarm;
+    }
+
+    if (alarm.parentIndex() >= m_firstOfParent.size())
+        m_firstOfParent.resize(alarm.parentIndex() + 1, noHandle);
+    m_nextOfParent[handle] = m_firstOfParent[alarm.parentIndex()];
+    m_firstOfParent[alarm.parentIndex()] = handle;
+
+    m_index.insert(handle, alarm);
+    m_heap.push_back({fireTime, handle});
+    m_positions[handle] = m_heap.size() - 1;
+    siftUp(m_heap.size() - 1);
+    return handle;
+}
+
+void AlarmQueue::remove(handle_t handle)
+{
+    size_t pos = m_positions[handle];
+    Entry last = m_heap.back();
+
+    // a parent has at most 7 HwAlarms, so walking its list is cheap
+    handle_t *link = &m_firstOfParent[m_alarms[handle].parentIndex()];
+    while (*link != handle)
+        link = &m_nextOfParent[*link];
+    *link = m_nextOfParent[handle];
+
+    m_index.remove(handle, m_alarms[handle]);
+    m_heap.pop_back();
+    m_freeHandles.push_back(handle);
+    if (pos == m_heap.size())
+        return;  // removed the last entry, nothing to restore
+
+    place(pos, last);
+    siftUp(pos);
+    siftDown(m_positions[last.handle]);
+}
+
+void AlarmQueue::removeParent(uint16_t parentIndex)
+{
+    while (isScheduled(parentIndex))
+        remove(m_firstOfParent[parentIndex]);
+}
+
+void AlarmQueue::reschedule(handle_t handle, uint32_t fireTime)
+{
+    size_t pos = m_positions[handle];
+    m_heap[pos].fireTime = fireTime;
+    siftUp(pos);
+    siftDown(m_positions[handle]);
+}
+
+void AlarmQueue::replace(handle_t handle, const HwAlarm &alarm, uint32_t fireTime)
+{
+    m_index.remove(handle, m_alarms[handle]);
+    m_alarms[handle] = alarm;
+    m_index.insert(handle, alarm);
+    reschedule(handle, fireTime);
+}
+
+void AlarmQueue::rescheduleAll(uint32_t now)
+{
+    // free handles are computed too, it's cheaper than skipping them
+    std::vector<uint32_t> fireTimes(m_alarms.size());
+    HwAlarm::nextFirings(m_alarms.data(), m_alarms.size(), now, fireTimes.data());
+
+    for (auto &entry : m_heap)
+        entry.fireTime = fireTimes[entry.handle];
+
+    // bottom-up heap construction
+    for (size_t pos = m_heap.size() / 2; pos-- > 0;)
+        siftDown(pos);
+}
+
+void AlarmQueue::clear()
+{
+    m_heap.clear();
+    m_alarms.clear();
+    m_positions.clear();
+    m_freeHandles.clear();
+    m_firstOfParent.clear();
+    m_nextOfParent.clear();
+    m_index.clear();
+}
+
+/* Alarms firing at the same time are ordered by handle to keep it stable */
+bool AlarmQueue::less(const Entry &a, const Entry &b)
+{
+    return a.fireTime != b.fireTime ? a.fireTime < b.fireTime
+                                    : a.handle < b.handle;
+}
+
+void AlarmQueue::place(size_t pos, const Entry &entry)
+{
+    m_heap[pos] = entry;
+    m_positions[entry.handle] = pos;
+}
+
+void AlarmQueue::siftUp(size_t pos)
+{
+    Entry entry = m_heap[pos];
+
+    while (pos > 0) {
+        size_t parent = (pos - 1) / 2;
+        if (!less(entry, m_heap[parent]))
+            break;
+
+        place(pos, m_heap[parent]);
+        pos = parent;
+    }
+    place(pos, entry);
+}
+
+void AlarmQueue::siftDown(size_t pos)
+{
+    Entry entry = m_heap[pos];
+    size_t size = m_heap.size();
+
+    while (true) {
+        size_t child = 2 * pos + 1;
+        if (child >= size)
+            break;
+        if (child + 1 < size && less(m_heap[child + 1], m_heap[child]))
+            ++child;
+        if (!less(m_heap[child], entry))
+            break;
+
+        place(pos, m_heap[child]);
+        pos = child;
+    }
+    place(pos, entry);
+}
@@ -0,0 +1,217 @@
+#include "AlarmScheduler.hpp"
+
+
+Alarm *AlarmScheduler::insert(const Alarm &alarm, uint32_t now)
+{
+    log_d("Adding alarm (%s)", CSTR(alarm.toString()));
+    if (m_alarms.size() >= maxAlarms) {
+        log_e("Can't add alarm (%s), there are too many", CSTR(alarm.toString()));
+        return nullptr;
+    }
+    Alarm *inserted = m_alarms.insert(alarm);
+
+    if (inserted != nullptr)
+        schedule(*inserted, now);
+    return inserted;
+}
+
+bool AlarmScheduler::erase(Alarm::id_t id)
+{
+    Alarm *alarm = m_alarms.find(id);
+    if (alarm == nullptr)
+        return false;
+
+    unschedule(*alarm);
+    return m_alarms.erase(id);
+}
+
+void AlarmScheduler::restore(std::vector<Alarm> &&slots, uint32_t now)
+{
+    m_queue.clear();
+    m_alarms.assign(std::move(slots));
+
+    // HwAlarms are pushed with the same fire time, so the heap isn't sifted
+    // until rescheduleAll() computes all fire times and heapifies at once
+    m_alarms.forEach([&](Alarm &alarm) {
+        if (!alarm.enabled)
+            return;
+        for (auto &hwAlarm : toHwAlarms(alarm)) {
+            if (m_queue.push(hwAlarm, 0) == AlarmQueue::noHandle) {
+                disable(alarm);
+                return;
+            }
+        }
+    });
+    m_queue.rescheduleAll(now);
+}
+
+void AlarmScheduler::schedule(Alarm &alarm, uint32_t now)
+{
+    if (!alarm.enabled || m_queue.isScheduled(AlarmTable::indexOf(alarm.id())))
+        return;  // disabled alarms are not scheduled, enabled ones are already
+
+    for (auto &hwAlarm : toHwAlarms(alarm)) {
+        uint32_t fireTime = hwAlarm.nextFiring(now);
+        if (m_queue.push(hwAlarm, fireTime) == AlarmQueue::noHandle) {
+            disable(alarm);
+            return;
+        }
+        log_d("Scheduled HwAlarm (%s) at %u", CSTR(hwAlarm.toString()), fireTime);
+    }
+}
+
+void AlarmScheduler::disable(Alarm &alarm)
+{
+    // maxAlarms keeps the queue from filling up, so it's never reached
+    log_e("No room for HwAlarms of (%s), disabling it", CSTR(alarm.toString()));
+    unschedule(alarm);
+    alarm.enabled = false;
+}
+
+void AlarmScheduler::unschedule(Alarm &alarm)
+{
+    m_queue.removeParent(AlarmTable::indexOf(alarm.id()));
+}
+
+void AlarmScheduler::retime(Alarm &alarm, uint32_t now)
+{
+    AlarmTable::index_t index = AlarmTable::indexOf(alarm.id());
+
+    m_queue.forEachOf(index, [&](AlarmQueue::handle_t handle) {
+        // HwAlarm caches the time of its parent, so it's recreated
+        HwAlarm updated(alarm, index, m_queue[handle].dayOfWeek());
+        m_queue.replace(handle, updated, updated.nextFiring(now));
+    });
+}
+
+void AlarmScheduler::rescheduleAll(uint32_t now)
+{
+    m_queue.rescheduleAll(now);
+}
+
+void AlarmScheduler::process(const AlarmQueue::Entry &entry, uint32_t now)
+{
+    HwAlarm &alarm = m_queue[entry.handle];
+    Alarm &parent = m_alarms[alarm.parentIndex()];
+
+    if (parent.isOneshot()) {
+        parent.enabled = false;
+        unschedule(parent);
+    } else {
+        // count the next firing from the time the alarm was due, so it never
+        // fires twice even if the RTC interrupt came a bit earlier than `now`
+        uint32_t from = std::max(entry.fireTime, now);
+        m_queue.reschedule(entry.handle, alarm.nextFiring(from));
+    }
+}
+
+std::vector<AlarmScheduler::Firing> AlarmScheduler::fire(uint32_t now)
+{
+    std::vector<Firing> firings;
+
+    // processing reschedules a HwAlarm after `now` or removes it, so every
+    // due one is processed once; the ones due at the same minute come next
+    while (!m_queue.empty() && m_queue.top().fireTime <= now) {
+        AlarmQueue::Entry entry = m_queue.top();
+        HwAlarm &hwAlarm = m_queue[entry.handle];
+        Alarm &parent = m_alarms[hwAlarm.parentIndex()];
+
+        if (firings.empty()) {
+            log_w(
+                "HwAlarm (%s)(%s) fired", CSTR(hwAlarm.toString()),
+                CSTR(parent.toString())
+            );
+        } else {
+            log_w(
+                "HwAlarm (%s)(%s) fired along with another one, so skipping it",
+                CSTR(hwAlarm.toString()), CSTR(parent.toString())
+            );
+            parent.m_missed = true;
+        }
+        firings.push_back({parent.id(), entry.fireTime});
+        process(entry, now);
+    }
+    return firings;
+}
+
+AlarmScheduler::SlotPlan AlarmScheduler::planSlots(const uint32_t armed[2]) const
+{
+    uint32_t targets[2] = {};  // the next two distinct firings, 0 if none
+    bool     kept[2] = {};     // slots already holding one of the targets
+    bool     placed[2] = {};   // targets already held by some slot
+    SlotPlan plan = {{armed[0], armed[1]}, {false, false}};
+
+    if (!m_queue.empty()) {
+        targets[0] = m_queue.top().fireTime;
+        targets[1] = nextDistinctFiring(targets[0]);
+    } else {
+        log_w("None of alarms can fire until enabled one");
+    }
+
+    for (int t = 0; t < 2; ++t) {
+        if (targets[t] == 0)
+            continue;
+        for (int slot = 0; slot < 2; ++slot) {
+            if (!kept[slot] && armed[slot] == targets[t]) {
+                kept[slot] = placed[t] = true;
+                break;
+            }
+        }
+    }
+
+    // only the slots whose firing has changed are reprogrammed
+    for (int t = 0; t < 2; ++t) {
+        if (targets[t] == 0 || placed[t])
+            continue;
+        int slot = kept[0] ? 1 : 0;
+        plan.times[slot] = targets[t];
+        plan.program[slot] = kept[slot] = true;
+    }
+
+    // a slot that has fired keeps its interrupt enabled and would match
+    // again a week later, so it's disabled even if it's known as disarmed
+    for (int slot = 0; slot < 2; ++slot) {
+        if (!kept[slot]) {
+            plan.times[slot] = 0;
+            plan.program[slot] = true;
+        }
+    }
+    return plan;
+}
+
+uint32_t AlarmScheduler::nextDistinctFiring(uint32_t fireTime) const
+{
+    const uint16_t week = HwAlarm::minutesPerWeek;
+    uint16_t minute = HwAlarm::minuteOfPeriodAt(fireTime, week);
+    int next = m_queue.index().nextOccupied((minute + 1) % week);
+
+    // when every HwAlarm fires at the same minute of the week, the next
+    // firing is a week later and a slot armed with it would match right now
+    uint32_t distance = (next - minute + week - 1) % week + 1;
+    if (next < 0 || distance == week)
+        return 0;
+    return fireTime + distance * 60;
+}
+
+Alarm *AlarmScheduler::next()
+{
+    if (m_queue.empty())
+        return nullptr;
+    return &m_alarms[m_queue[m_queue.top().handle].parentIndex()];
+}
+
+std::vector<HwAlarm> AlarmScheduler::toHwAlarms(const Alarm &alarm)
+{
+    std::vector<HwAlarm> parsedAlarms;
+    AlarmTable::index_t index = AlarmTable::indexOf(alarm.id());
+    log_d("Parsing alarm (%s)", CSTR(alarm.toString()));
+
+    if (!alarm.usesDaysOfWeek())
+        parsedAlarms.emplace_back(alarm, index);
+    else
+        for (int i = 0; i <= 6; ++i)
+            if (alarm.daysOfWeek.isSet(i))
+                parsedAlarms.emplace_back(alarm, index, i);
+
+    return parsedAlarms;
+}
@@ -1,12 +1,23 @@
 #include "AlarmService.hpp"
 
+#include <cinttypes>
+
+#include "LatencyTrace.hpp"
+
+// played by alarms without a ringtone of their own
+static const char *const defaultRingtonePath = "/test.mp3";
+
+// a ringtone of the library always fits in a track
+static_assert(RingtoneLibrary::maxPathLength < sizeof(AudioLooper::Track::path));
+
 
 void IRAM_ATTR onAlarm(void *selfPtr)
 {
     BaseType_t xHigherPriorityTaskWoken = pdFALSE;
     AlarmService *self = (AlarmService *)selfPtr;
-    AlarmService::Command cmd {AlarmService::Command::FireAlarm};
+    AlarmService::Command cmd {AlarmService::Command::FireAlarm, esp_timer_get_time()};
 
+    MainLatencyTrace.record(LatencyTrace::Interrupt, cmd.time);
     xQueueSendFromISR(self->m_isrCmdQueue, &cmd, &xHigherPriorityTaskWoken);
     portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
 }
@@ -15,15 +26,15 @@ void IRAM_ATTR onAlarmStop(void *selfPtr)
 {
     BaseType_t xHigherPriorityTaskWoken = pdFALSE;
     AlarmService *self = (AlarmService *)selfPtr;
-    AlarmService::Command cmd {AlarmService::Command::StopAlarm};
+    AlarmService::Command cmd {AlarmService::Command::StopAlarm, esp_timer_get_time()};
 
     xQueueSendFromISR(self->m_isrCmdQueue, &cmd, &xHigherPriorityTaskWoken);
     portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
 }
 
 void AlarmService::begin(
-    RTC_DS3231 *rtc, Audio *audio, std::shared_ptr<std::mutex> rtcMutex,
-    byte intrPin, byte alarmStopPin
+    RTC_DS3231 *rtc, TimeService *time, Audio *audio,
+    std::shared_ptr<std::mutex> rtcMutex, byte intrPin, byte alarmStopPin
 )
 {
     m_rtcLock = rtcMutex;  // must be initialized
@@ -31,9 +42,14 @@ void AlarmService::begin(
     m_interruptPin = intrPin;
     m_alarmStopPin = alarmStopPin;
     m_rtc = rtc;
-    m_alarmPlayer = new AudioLooper(m_audio, std::string("/test.mp3"));
+    m_time = time;         // must be started, the time is read from it
+    m_alarmPlayer = new AudioLooper(m_audio);
     m_alarmPlayer->begin(std::bind(&AlarmService::alarmMissed, this));
-    m_isrCmdQueue = xQueueCreate(3, sizeof(Command));
+    m_isrCmdQueue = xQueueCreate(isrQueueLength, sizeof(Command));
+    m_mutationQueue = xQueueCreate(mutationQueueLength, sizeof(Mutation *));
+    m_queueSet = xQueueCreateSet(isrQueueLength + mutationQueueLength);
+    xQueueAddToSet(m_isrCmdQueue, m_queueSet);
+    xQueueAddToSet(m_mutationQueue, m_queueSet);
 
     xTaskCreate(
         methodToTaskFun<AlarmService, &AlarmService::eventLoop>(), "eventLoop",
@@ -42,19 +58,47 @@ void AlarmService::begin(
 
     {
         std::lock_guard lock(*m_rtcLock);
-        m_rtc->clearAlarm(2);
-        m_rtc->disableAlarm(1);
+        // nothing is scheduled yet, both slots are armed by updateAlarms()
+        for (byte slot = 1; slot <= 2; ++slot) {
+            m_rtc->disableAlarm(slot);
+            m_rtc->clearAlarm(slot);
+        }
     }
 
+    // the event loop has nothing to do until the interrupts are attached
+    // and the API is up, so the alarms are restored right here
+    restoreAlarms();
+    primePlayer();
+
     pinMode(intrPin, INPUT_PULLUP);
     attachInterruptArg(digitalPinToInterrupt(intrPin), onAlarm, this, FALLING);
     pinMode(alarmStopPin, INPUT);
     attachInterruptArg(
         digitalPinToInterrupt(alarmStopPin), onAlarmStop, this, RISING
     );
+    publishSnapshot();
     log_i("Started AlarmService");
 }
 
+void AlarmService::restoreAlarms()
+{
+    std::vector<Alarm> slots;
+    int64_t startTime = esp_timer_get_time();
+
+    if (!m_store.begin("/alarms"))
+        return;
+    m_store.load(slots);
+    m_scheduler.restore(std::move(slots), m_time->unixtime());
+    updateAlarms();
+    m_store.commit(m_scheduler.alarms());  // rewrites the store if it was broken
+
+    log_i(
+        "Restored %zu alarms, %zu HwAlarms armed in %" PRId64 " us",
+        m_scheduler.alarms().size(), m_scheduler.queue().size(),
+        esp_timer_get_time() - startTime
+    );
+}
+
 AlarmService::~AlarmService()
 {
     detachInterrupt(m_alarmStopPin);
@@ -63,150 +107,228 @@ AlarmService::~AlarmService()
 
 void AlarmService::dumpAlarms()
 {
-    std::lock_guard lock(m_lock);
-    _dumpAlarms();
+    submit([this] {
+        _dumpAlarms();
+        return true;
+    });
 }
 
 void AlarmService::_dumpAlarms()
 {
-    log_w("Dump of m_alarms: ");
-    for (auto &alarm : m_alarms) {
-        log_w("\t(%s)", CSTR(alarm.second->toString()));
-    }
+    AlarmTable &alarms = m_scheduler.alarms();
+    const AlarmQueue &queue = m_scheduler.queue();
+
+    log_w("Dump of alarms: ");
+    alarms.forEach([](const Alarm &alarm) {
+        log_w("\t[%s](%s)", alarm.enabled ? "X" : " ", CSTR(alarm.toString()));
+    });
 
-    log_w("Dump of m_hwAlarms: ");
-    for (auto &hwAlarm : m_hwAlarms) {
+    log_w("Dump of the queue (in heap order): ");
+    for (auto &entry : queue) {
         log_w(
-            "\t[%s](%s)", hwAlarm.parentAlarm().enabled ? "X" : " ",
-            hwAlarm.toString().c_str()
+            "\t(%s) fires at %u", CSTR(queue[entry.handle].toString()),
+            entry.fireTime
         );
     }
+
+    log_w(
+        "Alarm table: %zu alarms, %zu slots of %zu bytes; free heap: %u, "
+        "largest free block: %u",
+        alarms.size(), alarms.capacity(), sizeof(Alarm), ESP.getFreeHeap(),
+        ESP.getMaxAllocHeap()
+    );
 }
 
-Alarm::id_t AlarmService::addAlarm(Alarm &alarm)
+std::future<Alarm::id_t> AlarmService::addAlarm(const Alarm &alarm)
 {
-    DateTime now;
-    Alarm *inserted;
-    std::lock_guard lock(m_lock);
+    return submit([this, alarm] {
+        Alarm *inserted = insertAlarm(alarm, m_time->now());
+        return inserted != nullptr ? inserted->id() : 0;
+    });
+}
 
-    // clang-format off
-    log_d("Adding alarm (%s)", CSTR(alarm.toString()));
-    inserted = m_alarms.insert({alarm.id(), std::make_unique<Alarm>(alarm)})
-        .first        // iterator
-        .operator*()  // inserted key-value pair
-        .second       // unique_ptr value
-        .get();       // raw pointer
+std::future<std::vector<Alarm::id_t>>
+    AlarmService::addAlarms(const std::vector<Alarm> &alarms)
+{
+    return submit([this, alarms] {
+        DateTime now = m_time->now();
+        std::vector<Alarm::id_t> ids;
+        int64_t startTime = esp_timer_get_time();
+
+        // all of the alarms are added or none of them
+        if (m_scheduler.alarms().size() + alarms.size() > AlarmScheduler::maxAlarms) {
+            log_e("Can't add %zu alarms, there are too many", alarms.size());
+            return ids;
+        }
+        ids.reserve(alarms.size());
+        for (auto &alarm : alarms) {
+            Alarm *inserted = insertAlarm(alarm, now);
+            ids.push_back(inserted != nullptr ? inserted->id() : 0);
+        }
 
-    std::vector<HwAlarm> newHwAlarms = alarmToHwAlarms(inserted);
+        log_i(
+            "Added %zu alarms in %" PRId64 " us", alarms.size(),
+            esp_timer_get_time() - startTime
+        );
+        return ids;
+    });
+}
 
-    {
-        std::lock_guard rtcLock(*m_rtcLock);
-        now = m_rtc->now();
-    }
+Alarm *AlarmService::insertAlarm(const Alarm &alarm, const DateTime &now)
+{
+    Alarm *inserted = m_scheduler.insert(alarm, now.unixtime());
 
-    for (auto &newAlarm : newHwAlarms)
-        addDs3231Alarm(newAlarm, &now);
-    updateAlarms();
-    return inserted->id();
-    // clang-format on
+    if (inserted != nullptr) {
+        m_store.put(*inserted);
+        m_dirty = true;
+    }
+    return inserted;
 }
 
-void AlarmService::processAlarm(std::vector<HwAlarm>::iterator it)
+void AlarmService::eventLoop()
 {
-    HwAlarm &alarm = *it;
-    if (alarm.parentAlarm().isOneshot())
-        alarm.parentAlarm().enabled = false;
-    else {
-        HwAlarm copy = alarm;
-        m_hwAlarms.erase(it);
-        addDs3231Alarm(copy);
-    };
+    while (true) {
+        // the queue that woke the loop doesn't matter, both are drained
+        xQueueSelectFromSet(m_queueSet, portMAX_DELAY);
+        processBatch();
+    }
 }
 
-std::vector<HwAlarm>::iterator AlarmService::firstEnabledHwAlarm()
+void AlarmService::processBatch()
 {
-    return std::find_if(
-        m_hwAlarms.begin(), m_hwAlarms.end(),
-        [](const HwAlarm &alarm) { return alarm.parentAlarm().enabled; }
-    );
+    Mutation *mutation;
+    std::vector<Mutation *> batch;
+    int64_t startTime = esp_timer_get_time();
+
+    countStat(&Stats::wakeups);
+    processCommands();
+    while (xQueueReceive(m_mutationQueue, &mutation, 0)) {
+        mutation->run();
+        batch.push_back(mutation);
+        countStat(&Stats::mutations);
+        processCommands();  // a firing doesn't wait for the rest of the batch
+    }
+
+    // the queue was full when these were posted, so they're taken once it
+    // is drained; a later post that finds it full again wakes the loop anyway
+    std::vector<Mutation *> deferred;
+    {
+        std::lock_guard deferredLock(m_deferredLock);
+        deferred.swap(m_deferred);
+    }
+    for (Mutation *posted : deferred) {
+        posted->run();
+        batch.push_back(posted);
+        countStat(&Stats::mutations);
+        processCommands();
+    }
+
+    // the whole batch costs one RTC update, snapshot and store commit
+    if (m_dirty) {
+        updateAlarms();
+        publishSnapshot();
+        m_store.commit(m_scheduler.alarms());
+        countStat(&Stats::flushes);
+        m_dirty = false;
+        primePlayer();
+    }
+
+    // callers see their changes published once their futures are ready
+    for (Mutation *done : batch) {
+        done->complete();
+        delete done;
+    }
+
+    uint32_t eventTime = esp_timer_get_time() - startTime;
+    std::lock_guard statsLock(m_statsLock);
+    m_stats.totalEventTime += eventTime;
+    m_stats.maxEventTime = std::max(m_stats.maxEventTime, eventTime);
 }
 
-void AlarmService::eventLoop()
+void AlarmService::processCommands()
 {
     Command cmd;
 
-    while (true) {
-        if (xQueueReceive(m_isrCmdQueue, &cmd, portMAX_DELAY)) {
-            std::lock_guard lock(m_lock);
-
-            switch (cmd.type) {
-            case Command::FireAlarm:
-                onAlarmFired();
-                break;
+    while (xQueueReceive(m_isrCmdQueue, &cmd, 0)) {
+        switch (cmd.type) {
+        case Command::FireAlarm:
+            onAlarmFired(cmd.time);
+            break;
 
-            case Command::StopAlarm:
-                onAlarmStopped();
-                break;
-            }
+        case Command::StopAlarm:
+            onAlarmStopped();
+            break;
         }
+        countStat(&Stats::events);
     }
 }
 
-void AlarmService::onAlarmFired()
+void AlarmService::onAlarmFired(int64_t interruptTime)
 {
-    DateTime now, alarmTime;
-    bool firedNow;
+    DateTime now;
+    uint32_t firedTime = 0;  // the latest armed time of the fired slots
 
+    MainLatencyTrace.record(LatencyTrace::Dequeued);
     {
         std::lock_guard rtcLock(*m_rtcLock);
-        m_rtc->clearAlarm(2);
-        now = m_rtc->now();
+        for (byte slot = 1; slot <= 2; ++slot) {
+            if (m_rtc->alarmFired(slot)) {
+                m_rtc->clearAlarm(slot);
+                firedTime = std::max(firedTime, m_armedTimes[slot - 1]);
+                m_armedTimes[slot - 1] = 0;
+            }
+        }
     }
 
-    auto justFired = firstEnabledHwAlarm();
-    Alarm::id_t parentId = justFired->parentAlarm().id();
-
-    log_w(
-        "HwAlarm (%s)(%s) fired", CSTR(justFired->toString()),
-        CSTR(justFired->parentAlarm().toString())
-    );
-    processAlarm(justFired);
+    // TimeService may run a bit behind the RTC, which has just reached
+    // the armed time, and the firing must not be taken for a stale flag
+    now = DateTime(std::max(m_time->unixtime(), firedTime));
 
-    // Also process alarms that fired at the same time
-    // TODO SIMPLIFY
-    for (auto it = justFired + 1, end = m_hwAlarms.end(); it != end; ++it) {
-        firedNow = it->parentAlarm().hour == now.hour()
-                   && it->parentAlarm().minute == now.minute()
-                   && (!it->parentAlarm().usesDaysOfWeek()
-                       || it->dayOfWeek() == CONVERT_DOWS(now.dayOfTheWeek()));
+    std::vector<AlarmScheduler::Firing> firings = m_scheduler.fire(now.unixtime());
+    if (firings.empty()) {
+        // a slot left armed or a stale flag, nothing to play
+        log_w("RTC alarm fired, but no alarm is due, rearming the slots");
+        updateAlarms();
+        return;
+    }
 
-        if (!firedNow)
-            break;
-        if (!it->parentAlarm().enabled)
-            continue;
+    Alarm &parent = *m_scheduler.find(firings.front().id);
+    if (parent.isOneshot())
+        m_store.put(parent);  // it's disabled now
 
-        log_w(
-            "HwAlarm (%s)(%s) fired at the same time as (%s), so skipping it",
-            it->toString(), it->parentAlarm().toString().c_str(),
-            justFired->toString().c_str()
-        );
-        it->parentAlarm().m_missed = true;
-        processAlarm(it);
+    // the rest were due along with it, they're skipped
+    for (size_t i = 1; i < firings.size(); ++i) {
+        m_store.put(*m_scheduler.find(firings[i].id));
+        countStat(&Stats::skipped);
     }
 
     updateAlarms();
+    MainLatencyTrace.record(LatencyTrace::Rearmed);
+    {
+        uint32_t rearmTime = esp_timer_get_time() - interruptTime;
+        std::lock_guard statsLock(m_statsLock);
+        m_stats.lastRearmTime = rearmTime;
+        m_stats.maxRearmTime = std::max(m_stats.maxRearmTime, rearmTime);
+    }
+    postOverdueFiring(now);
+    m_dirty = true;  // the snapshot and the store are updated after the player starts
     _dumpAlarms();
 
     if (!isAlarmRunning()) {
-        m_runningAlarmId = parentId;
-        m_alarmPlayer->start(100);  // TODO there goes time from config
+        m_runningAlarmId = parent.id();
+        MainLatencyTrace.record(LatencyTrace::PlayerStarted);
+        m_alarmPlayer->start(trackOf(parent), 100);  // TODO there goes time from config
+        countStat(&Stats::fired);
         log_w("Started alarm playing");
     } else {
-        log_w(
-            "Other alarm is running, so (%s) is skipped",
-            CSTR(justFired->parentAlarm().toString())
-        );
+        // the ringtone keeps playing, the skipped alarm is heard over it
+        m_alarmPlayer->chime();
+        countStat(&Stats::skipped);
+        log_w("Other alarm is running, so (%s) is skipped", CSTR(parent.toString()));
     }
+    // the previous firing has reached the first frame long ago, it's folded
+    // now so the trace ring never overflows
+    MainLatencyTrace.collect();
 }
 
 void AlarmService::onAlarmStopped()
@@ -216,231 +338,248 @@ void AlarmService::onAlarmStopped()
 
     m_runningAlarmId = 0;
     m_alarmPlayer->stop();
+    primePlayer();
     log_w("Stopped alarm playing");
 }
 
-void AlarmService::alarmMissed()
-{   
-    try {
-        m_alarms.at(m_runningAlarmId)->m_missed = true;
-    }
-    catch (std::out_of_range &e) {
-        log_w("Missed alarm which was deleted");
-    }
-    m_runningAlarmId = 0;
-    log_w("Missed alarm");
-}
-
-void AlarmService::updateAlarms()
+void AlarmService::primePlayer()
 {
-    DateTime now;
+    // a firing started right now would be primed after the player starts
+    Alarm *next = m_scheduler.next();
 
-    // reinsert disabled alarms before processing the fired one to avoid
-    // having them in the wrong place once they are enabled
-    {
-        std::lock_guard rtcLock(*m_rtcLock);
-        now = m_rtc->now();
-    }
-    
-    auto it = m_hwAlarms.begin();
-    for (auto end = m_hwAlarms.end(); it != end; ++it) {
-        if (it->parentAlarm().enabled)
-            break;
+    if (isAlarmRunning() || next == nullptr)
+        return;
+    m_alarmPlayer->prime(trackOf(*next));
+}
 
-        HwAlarm copy = *it;
-        m_hwAlarms.erase(it);
-        addDs3231Alarm(copy, &now);
+AudioLooper::Track AlarmService::trackOf(const Alarm &alarm) const
+{
+    RingtoneLibrary::Entry ringtone;
+    AudioLooper::Track     track;
+
+    // a removed ringtone falls back to the default one, the alarm still rings
+    if (!MainRingtoneLibrary.get(alarm.ringtone, ringtone)
+        || !AudioLooper::makeTrack(
+            MainRingtoneLibrary.path(ringtone), track, ringtone.firstFrame,
+            ringtone.revision
+        )) {
+        AudioLooper::makeTrack(defaultRingtonePath, track);
     }
-
-    // now `it` points to the first enabled alarm
-    if (it != m_hwAlarms.end())
-        setDs3231Alarm(*it);
-    else {
-        log_w("None of alarms can fire until enabled one");
-        // There's no alarm that can fire, so we need to disable the 1st alarm slot
-        std::lock_guard rtcLock(*m_rtcLock);
-        m_rtc->clearAlarm(2);
-    };
+    return track;
 }
 
-std::vector<HwAlarm> AlarmService::alarmToHwAlarms(Alarm *alarm)
+void AlarmService::alarmMissed()
 {
-    std::vector<HwAlarm> parsedAlarms;
-    log_d("Parsing alarm (%s)", CSTR(alarm->toString()));
+    // called by the player's timer, so it's executed by the event loop too,
+    // the timer task can't wait for the queue
+    post([this] {
+        Alarm *alarm = m_scheduler.find(m_runningAlarmId);
+        if (alarm != nullptr) {
+            alarm->m_missed = true;
+            m_store.put(*alarm);
+            m_dirty = true;
+        } else {
+            log_w("Missed alarm which was deleted");
+        }
+        m_runningAlarmId = 0;
+        countStat(&Stats::missed);
+        log_w("Missed alarm");
+    });
+}
 
-    if (!alarm->usesDaysOfWeek())
-        parsedAlarms.emplace_back(alarm);
-    else
-        for (int i = 0; i <= 6; ++i)
-            if (alarm->daysOfWeek.isSet(i))
-                parsedAlarms.emplace_back(alarm, i);
+void AlarmService::updateAlarms()
+{
+    AlarmScheduler::SlotPlan plan = m_scheduler.planSlots(m_armedTimes);
 
-    return parsedAlarms;
+    for (int slot = 0; slot < 2; ++slot) {
+        if (!plan.program[slot])
+            continue;
+        if (plan.times[slot] != 0)
+            setDs3231Alarm(slot + 1, plan.times[slot]);
+        else
+            disableDs3231Alarm(slot + 1);
+    }
 }
 
-void AlarmService::addDs3231Alarm(HwAlarm &newAlarm, DateTime *now)
+void AlarmService::postOverdueFiring(const DateTime &now)
 {
-    DateTime rtcNow;
-    if (now == NULL) {
-        std::lock_guard rtcLock(*m_rtcLock);
+    const AlarmQueue &queue = m_scheduler.queue();
+    bool overdue = !queue.empty() && queue.top().fireTime <= now.unixtime();
 
-        rtcNow = m_rtc->now();
-        now = &rtcNow;
+    // The INT pin stays low while any flag is set, so a slot firing before
+    // the other one is cleared produces no new interrupt
+    if (!overdue) {
+        std::lock_guard rtcLock(*m_rtcLock);
+        overdue = m_rtc->alarmFired(1) || m_rtc->alarmFired(2);
     }
 
-    DateTime newAlarmTime = newAlarm.nextFiring(*now);
-    DateTime alarmTime;
-
-    for (auto iter = m_hwAlarms.begin(); iter != m_hwAlarms.end(); ++iter) {
-        alarmTime = iter->nextFiring(*now);
-        if (iter->parentAlarm().enabled && newAlarmTime <= alarmTime) {
-            log_w(
-                "Adding HwAlarm (%s) at position %d", CSTR(newAlarm.toString()),
-                std::distance(m_hwAlarms.begin(), iter)
-            );
-            m_hwAlarms.insert(iter, newAlarm);
-            return;
-        }
+    if (overdue) {
+        Command cmd {Command::FireAlarm, esp_timer_get_time()};
+        log_w("Another firing is already due, processing it next");
+        xQueueSend(m_isrCmdQueue, &cmd, 0);
     }
-
-    log_w(
-        "Adding HwAlarm (%s) %s", CSTR(newAlarm.toString()),
-        m_hwAlarms.empty() ? "to the empty vector" : "to the end"
-    );
-    m_hwAlarms.emplace_back(newAlarm);
 }
 
-bool AlarmService::setAlarmState(Alarm::id_t id, bool enabled)
+
+std::future<bool> AlarmService::setAlarmState(Alarm::id_t id, bool enabled)
 {
-    std::lock_guard lock(m_lock);
+    return submit([this, id, enabled] {
+        Alarm *alarm = m_scheduler.find(id);
+        if (alarm == nullptr) {
+            log_e("There's no such ID - %" PRIu64, id);
+            return false;
+        }
 
-    try {
-        m_alarms.at(id)->enabled = enabled;
-    }
-    catch (const std::out_of_range &e) {
-        log_e("There's no such ID - %d", id);
-        return false;
-    }
+        if (alarm->enabled != enabled) {
+            alarm->enabled = enabled;
 
-    log_i(
-        "Alarm (%s) is %s", CSTR(m_alarms[id]->toString()),
-        enabled ? "enabled" : "disabled"
-    );
-    return true;
+            if (enabled)
+                m_scheduler.schedule(*alarm, m_time->unixtime());
+            else
+                m_scheduler.unschedule(*alarm);
+            m_store.put(*alarm);
+            m_dirty = true;
+        }
+
+        log_i(
+            "Alarm (%s) is %s", CSTR(alarm->toString()),
+            enabled ? "enabled" : "disabled"
+        );
+        return true;
+    });
 }
 
-bool AlarmService::setAlarmTime(Alarm::id_t id, byte hour, byte minute)
+std::future<bool>
+    AlarmService::updateAlarm(Alarm::id_t id, const AlarmChanges &changes)
 {
-    DateTime now;
-    Alarm *alarm;
-    std::lock_guard lock(m_lock);
-
-    try {
-        alarm = m_alarms.at(id).get();
-        alarm->hour = hour;
-        alarm->minute = minute;
-    }
-    catch (const std::out_of_range &e) {
-        log_e("There's no such ID - %d", id);
-        return false;
-    }
-
-    auto it = m_hwAlarms.begin();
-    auto end = m_hwAlarms.end();
-    std::vector<HwAlarm> newHwAlarms;
-    while (it != end) {
-        if (it->parentAlarm().id() == id) {
-            newHwAlarms.push_back(*it);
-            m_hwAlarms.erase(it);
-        } else {
-            ++it;
+    // all of the changes are applied and published together
+    return submit([this, id, changes] {
+        Alarm *alarm = m_scheduler.find(id);
+        if (alarm == nullptr) {
+            log_e("There's no such ID - %" PRIu64, id);
+            return false;
         }
-    }
 
-    {
-        std::lock_guard rtcLock(*m_rtcLock);
-        now = m_rtc->now();
-    }
+        if (changes.time) {
+            alarm->hour = changes.time->hour;
+            alarm->minute = changes.time->minute;
+        }
+        if (changes.daysOfWeek)
+            alarm->daysOfWeek = *changes.daysOfWeek;
+        if (changes.ringtone)
+            alarm->ringtone = *changes.ringtone;  // the player is primed again after the flush
+        m_store.put(*alarm);
+        m_dirty = true;
+
+        // the set of days has changed, so HwAlarms are recreated from scratch;
+        // a disabled alarm has nothing to reschedule
+        if (changes.daysOfWeek) {
+            m_scheduler.unschedule(*alarm);
+            m_scheduler.schedule(*alarm, m_time->unixtime());
+        } else if (changes.time) {
+            m_scheduler.retime(*alarm, m_time->unixtime());
+        }
 
-    for (auto &newAlarm : newHwAlarms)
-        addDs3231Alarm(newAlarm, &now);
-    updateAlarms();
+        log_i("Updated alarm (%s)", CSTR(alarm->toString()));
+        return true;
+    });
+}
 
-    return true;
+void AlarmService::rescheduleAlarms()
+{
+    // called by the NTP timer, so it doesn't wait for the queue
+    post([this] {
+        DateTime now = m_time->now();
+
+        // from the previous minute, so the firings due now are kept and
+        // fire right away instead of a period later
+        m_scheduler.rescheduleAll(now.unixtime() - 60);
+        m_dirty = true;
+        log_i("Rescheduled %zu HwAlarms", m_scheduler.queue().size());
+        postOverdueFiring(now);
+    });
 }
 
-bool AlarmService::setAlarmDaysOfWeek(Alarm::id_t id, Alarm::DaysOfWeek daysOfWeek)
+std::future<bool> AlarmService::removeAlarm(Alarm::id_t id)
 {
-    DateTime now;
-    Alarm *alarm;
+    return submit([this, id] {
+        Alarm *alarm = m_scheduler.find(id);
+        if (alarm == nullptr) {
+            return false;  // there is no alarm with such id
+        }
 
-    std::lock_guard lock(m_lock);
-    try {
-        alarm = m_alarms.at(id).get();
-        alarm->daysOfWeek = daysOfWeek;
-    }
-    catch (const std::out_of_range &e) {
-        log_e("There's no such ID - %d", id);
-        return false;
-    }
+        log_i("Removing Alarm (%s)", CSTR(alarm->toString()));
+        m_scheduler.erase(id);
+        m_store.erase(id);
+        m_dirty = true;
+        return true;
+    });
+}
 
-    m_hwAlarms.erase(std::remove_if(
-        m_hwAlarms.begin(), m_hwAlarms.end(),
-        [id](const HwAlarm &alarm) { return alarm.parentAlarm().id() == id; }
-    ));
+void AlarmService::setDs3231Alarm(byte slot, uint32_t fireTime)
+{
+    // Both slots match the day of week too, the firing is always
+    // less than a week away, so it can't match earlier
+    DateTime dt(fireTime);
 
-    std::vector<HwAlarm> newHwAlarms = alarmToHwAlarms(alarm);
+    log_d(
+        "Setting on the slot %u of DS3231 firing at %s", slot,
+        CSTR(dt.timestamp())
+    );
 
-    {
-        std::lock_guard rtcLock(*m_rtcLock);
-        now = m_rtc->now();
-    }
+    std::lock_guard rtcLock(*m_rtcLock);
+    if (slot == 1)
+        m_rtc->setAlarm1(dt, DS3231_A1_Day);  // seconds of dt are 0
+    else
+        m_rtc->setAlarm2(dt, DS3231_A2_Day);
+    m_armedTimes[slot - 1] = fireTime;
+}
 
-    for (auto &newAlarm : newHwAlarms)
-        addDs3231Alarm(newAlarm, &now);
-    updateAlarms();
+void AlarmService::disableDs3231Alarm(byte slot)
+{
+    log_d("Disabling the slot %u of DS3231", slot);
 
-    return true;
+    std::lock_guard rtcLock(*m_rtcLock);
+    m_rtc->disableAlarm(slot);
+    m_armedTimes[slot - 1] = 0;
 }
 
-bool AlarmService::removeAlarm(Alarm::id_t id)
+void AlarmService::publishSnapshot()
 {
-    std::lock_guard lock(m_lock);
-    
-    auto it = m_alarms.find(id);
-    if (it == m_alarms.end()) {
-        return false;  // there is no alarm with such id
-    }
-
-    log_i("Removing Alarm (%s)", CSTR(it->second->toString()));
-    m_alarms.erase(it);
+    auto snapshot = std::make_shared<Snapshot>();
 
-    m_hwAlarms.erase(
-        remove_if(
-            m_hwAlarms.begin(), m_hwAlarms.end(),
-            [id](const HwAlarm &alarm) { return alarm.parentAlarm().id() == id; }
-        ),
-        m_hwAlarms.end()
-    );
+    snapshot->version = m_snapshotVersion++;
+    snapshot->alarms.reserve(m_scheduler.alarms().size());
+    m_scheduler.alarms().forEach([&](const Alarm &alarm) { snapshot->alarms.push_back(alarm); });
 
-    updateAlarms();
-    return true;
+    // readers holding the previous snapshot keep it alive until they're done
+    std::atomic_store(&m_snapshot, std::shared_ptr<const Snapshot>(snapshot));
 }
 
-void AlarmService::setDs3231Alarm(const HwAlarm &alarm)
+void AlarmService::countStat(uint32_t Stats::*counter)
 {
-    DateTime dt(2000, 1, 3, alarm.parentAlarm().hour, alarm.parentAlarm().minute);
+    std::lock_guard statsLock(m_statsLock);
+    ++(m_stats.*counter);
+}
 
-    // 2000/01/03 is Monday, so we can directly add the day of week value (0-6)
-    if (alarm.parentAlarm().usesDaysOfWeek())
-        dt = dt + TimeSpan(alarm.dayOfWeek(), 0, 0, 0);
+AlarmService::Stats AlarmService::stats()
+{
+    std::lock_guard statsLock(m_statsLock);
+    return m_stats;
+}
 
-    log_d("Setting on the 2nd slot of DS3231 HwAlarm (%s)", CSTR(alarm.toString()));
+std::future<AlarmStore::Stats> AlarmService::storeStats()
+{
+    return submit([this] { return m_store.stats(); });
+}
 
-    std::lock_guard rtcLock(*m_rtcLock);
-    m_rtc->setAlarm2(
-        dt, alarm.parentAlarm().usesDaysOfWeek() ? DS3231_A2_Day : DS3231_A2_Hour
-    );
+void AlarmService::reprimePlayer()
+{
+    // the revision of the ringtone has changed, so the same name is a new track
+    submit([this] {
+        primePlayer();
+        return true;
+    });
 }
 
 void AlarmService::setVolume(byte volume)
@@ -448,20 +587,21 @@ void AlarmService::setVolume(byte volume)
     m_audio->setVolume(volume);
 }
 
-bool AlarmService::clearMissedFlag(Alarm::id_t id)
+std::future<bool> AlarmService::clearMissedFlag(Alarm::id_t id)
 {
-    std::lock_guard lock(m_lock);
-
-    try {
-        m_alarms.at(id)->clearMissedFlag();
-    }
-    catch (const std::out_of_range &e) {
-        log_e("There's no such ID - %d", id);
-        return false;
-    }
+    return submit([this, id] {
+        Alarm *alarm = m_scheduler.find(id);
+        if (alarm == nullptr) {
+            log_e("There's no such ID - %" PRIu64, id);
+            return false;
+        }
+        alarm->clearMissedFlag();
+        m_store.put(*alarm);
+        m_dirty = true;
 
-    log_i("Clearing missed flag for Alarm (%s)", CSTR(m_alarms[id]->toString()));
-    return true;
+        log_i("Clearing missed flag for Alarm (%s)", CSTR(alarm->toString()));
+        return true;
+    });
 }
 
 AlarmService MainAlarmService;
\ No newline at end of file
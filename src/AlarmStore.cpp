@@ -0,0 +1,300 @@
+#include "AlarmStore.hpp"
+
+#include "esp32/rom/crc.h"
+
+
+static const uint32_t snapshotMagic = 0x31534c41;  // "ALS1"
+static const uint32_t logMagic = 0x314c4c41;       // "ALL1"
+static const size_t   sectorSize = 512;
+static const size_t   readChunk = 32;  // records read from SD at once
+// the log is compacted once it has more records than this or twice the table
+static const size_t   minCompactRecords = 64;
+
+
+bool AlarmStore::begin(const std::string &dir)
+{
+    m_logPath = dir + "/log.bin";
+    m_snapshotPath = dir + "/snapshot.bin";
+    m_tmpPath = dir + "/snapshot.tmp";
+
+    if (!SD.exists(dir.c_str()) && !SD.mkdir(dir.c_str())) {
+        log_e("Could not create the alarm store directory %s", dir.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool AlarmStore::load(std::vector<Alarm> &slots)
+{
+    int64_t startTime = esp_timer_get_time();
+    bool complete = true;
+    uint32_t generation = 0;
+
+    slots.clear();
+    m_logRecords = 0;
+
+    // the old snapshot is removed only after the new one is written,
+    // so a temporary snapshot is used only if it's complete
+    bool temporary = !SD.exists(m_snapshotPath.c_str());
+    const std::string &snapshotPath = temporary ? m_tmpPath : m_snapshotPath;
+    File snapshot = SD.open(snapshotPath.c_str(), FILE_READ);
+    if (snapshot) {
+        SnapshotHeader header;
+        bool headerOk = snapshot.read((uint8_t *)&header, sizeof(header)) == sizeof(header)
+                        && header.magic == snapshotMagic;
+        if (headerOk)
+            generation = header.generation;
+        if (!headerOk || readRecords(snapshot, header.records, slots) != header.records) {
+            log_e("Alarm snapshot %s is incomplete", snapshotPath.c_str());
+            complete = false;
+            if (temporary) {
+                // the first compaction was cut short, the log has it all
+                slots.clear();
+                generation = 0;
+            }
+        }
+        snapshot.close();
+    }
+
+    if (!loadLog(generation, slots))
+        complete = false;
+
+    // the next commit rewrites the store, so nothing is appended after garbage
+    // or to a log of another generation
+    m_generation = generation;
+    m_corrupt = !complete;
+    m_stats.loadTime = esp_timer_get_time() - startTime;
+    log_i(
+        "Loaded %zu alarm slots (%zu log records) in %u us", slots.size(),
+        m_logRecords, m_stats.loadTime
+    );
+    return complete;
+}
+
+bool AlarmStore::loadLog(uint32_t generation, std::vector<Alarm> &slots)
+{
+    File logFile = SD.open(m_logPath.c_str(), FILE_READ);
+    if (!logFile)
+        return true;
+
+    LogHeader header;
+    bool ok = logFile.read((uint8_t *)&header, sizeof(header)) == sizeof(header)
+              && header.magic == logMagic;
+    if (!ok) {
+        // the log is created with its header, so it has no records yet
+        log_w("Alarm log has no header, skipped");
+    } else if (header.generation != generation) {
+        // a compaction was cut short, its snapshot has the records already
+        log_w(
+            "Alarm log of generation %u doesn't follow snapshot %u, skipped",
+            header.generation, generation
+        );
+        ok = false;
+    } else {
+        m_logRecords = readRecords(logFile, SIZE_MAX, slots);
+        if (sizeof(header) + m_logRecords * sizeof(Record) != logFile.size()) {
+            log_w("Alarm log has a broken tail after %zu records", m_logRecords);
+            ok = false;
+        }
+    }
+    logFile.close();
+    return ok;
+}
+
+void AlarmStore::put(const Alarm &alarm)
+{
+    m_pending.push_back(makeRecord(PutRecord, alarm));
+}
+
+void AlarmStore::erase(Alarm::id_t id)
+{
+    Alarm removed(0, 0, Alarm::DaysOfWeek::noDays);
+
+    removed.m_id = id;
+    m_pending.push_back(makeRecord(EraseRecord, removed));
+}
+
+bool AlarmStore::commit(AlarmTable &table)
+{
+    size_t maxRecords = std::max(minCompactRecords, 2 * table.size());
+
+    if (m_corrupt || m_logRecords + m_pending.size() > maxRecords)
+        return compact(table);  // the table already has the pending changes
+    if (m_pending.empty())
+        return true;
+
+    size_t size = m_pending.size() * sizeof(Record);
+    File logFile = SD.open(m_logPath.c_str(), FILE_APPEND);
+    if (!logFile) {
+        log_e("Could not open the alarm log %s", m_logPath.c_str());
+        m_pending.clear();
+        m_corrupt = true;  // the changes are lost, so the next commit rewrites all
+        return false;
+    }
+
+    size_t offset = logFile.size();
+    bool ok = true;
+    if (offset == 0) {
+        LogHeader header {logMagic, m_generation};
+        ok = logFile.write((const uint8_t *)&header, sizeof(header)) == sizeof(header);
+        offset = sizeof(header);
+        countWrite(0, sizeof(header));
+    }
+    ok = ok && logFile.write((const uint8_t *)m_pending.data(), size) == size;
+    logFile.close();
+
+    countWrite(offset, size);
+    m_stats.records += m_pending.size();
+    m_stats.recordBytes += size;
+    m_logRecords += m_pending.size();
+    m_pending.clear();
+
+    if (!ok) {
+        log_e("Could not write to the alarm log %s", m_logPath.c_str());
+        m_corrupt = true;
+    }
+    return ok;
+}
+
+bool AlarmStore::compact(AlarmTable &table)
+{
+    std::vector<Record> records;
+
+    records.reserve(table.capacity());
+    table.forEachSlot([&](const Alarm &slot) {
+        if (AlarmTable::isOccupied(slot.m_id)) {
+            records.push_back(makeRecord(PutRecord, slot));
+        } else {
+            // free slots keep their generation, so removed ids aren't reused
+            Alarm removed(0, 0, Alarm::DaysOfWeek::noDays);
+            removed.m_id = slot.m_id - (1 << 16);
+            records.push_back(makeRecord(EraseRecord, removed));
+        }
+    });
+
+    uint32_t generation = m_generation + 1;
+    SnapshotHeader header {snapshotMagic, (uint32_t)records.size(), generation};
+    size_t size = records.size() * sizeof(Record);
+    File tmp = SD.open(m_tmpPath.c_str(), FILE_WRITE);
+    bool ok = tmp
+              && tmp.write((const uint8_t *)&header, sizeof(header)) == sizeof(header)
+              && tmp.write((const uint8_t *)records.data(), size) == size;
+    if (tmp)
+        tmp.close();
+
+    if (!ok) {
+        log_e("Could not write the alarm snapshot %s", m_tmpPath.c_str());
+        m_pending.clear();
+        m_corrupt = true;
+        return false;
+    }
+
+    // load() takes the temporary snapshot once the old one is removed, the
+    // old log is skipped from then on, as it's of the previous generation
+    SD.remove(m_snapshotPath.c_str());
+    if (!SD.rename(m_tmpPath.c_str(), m_snapshotPath.c_str())) {
+        log_e("Could not rename the alarm snapshot to %s", m_snapshotPath.c_str());
+        m_corrupt = true;
+        return false;
+    }
+    m_generation = generation;
+
+    LogHeader logHeader {logMagic, generation};
+    File logFile = SD.open(m_logPath.c_str(), FILE_WRITE);  // truncates it
+    bool logOk = logFile
+                 && logFile.write((const uint8_t *)&logHeader, sizeof(logHeader))
+                    == sizeof(logHeader);
+    if (logFile)
+        logFile.close();
+
+    countWrite(0, sizeof(header) + size);
+    countWrite(0, sizeof(logHeader));
+    m_stats.records += m_pending.size();
+    m_stats.recordBytes += m_pending.size() * sizeof(Record);
+    m_stats.compactions++;
+    m_logRecords = 0;
+    m_pending.clear();
+    log_i("Compacted the alarm log into a snapshot of %zu slots", records.size());
+
+    // the changes are in the snapshot, only the next commit has to compact
+    m_corrupt = !logOk;
+    if (!logOk)
+        log_e("Could not start the alarm log %s", m_logPath.c_str());
+    return true;
+}
+
+AlarmStore::Record AlarmStore::makeRecord(RecordType type, const Alarm &alarm)
+{
+    Record record = {};
+
+    record.type = type;
+    record.hour = alarm.hour;
+    record.minute = alarm.minute;
+    record.daysMask = alarm.daysOfWeek.daysMask;
+    record.flags = (alarm.enabled ? Enabled : 0) | (alarm.m_missed ? Missed : 0);
+    record.ringtone = MainRingtoneLibrary.keyOf(alarm.ringtone);
+    record.id = alarm.m_id;
+    record.crc = recordCrc(record);
+    return record;
+}
+
+uint32_t AlarmStore::recordCrc(const Record &record)
+{
+    const uint8_t *data = (const uint8_t *)&record + sizeof(record.crc);
+    return crc32_le(0, data, sizeof(Record) - sizeof(record.crc));
+}
+
+void AlarmStore::apply(const Record &record, std::vector<Alarm> &slots)
+{
+    AlarmTable::index_t index = AlarmTable::indexOf(record.id);
+
+    // slots not mentioned by any record are free and were never used
+    while (slots.size() <= index) {
+        Alarm free(0, 0, Alarm::DaysOfWeek::noDays);
+        free.m_id = slots.size();
+        slots.push_back(free);
+    }
+
+    if (record.type == PutRecord) {
+        Alarm alarm(record.hour, record.minute, record.daysMask, record.flags & Enabled);
+        alarm.m_missed = record.flags & Missed;
+        // the ringtone could be lost with the files, the alarm rings anyway
+        // with the default one
+        alarm.ringtone = MainRingtoneLibrary.findKey(record.ringtone);
+        alarm.m_id = record.id;
+        slots[index] = alarm;
+    } else {
+        slots[index].m_id = record.id + (1 << 16);  // the generation becomes even
+    }
+}
+
+size_t AlarmStore::readRecords(File &file, size_t maxRecords, std::vector<Alarm> &slots)
+{
+    Record buf[readChunk];
+    size_t count = 0;
+
+    while (count < maxRecords) {
+        size_t want = std::min(readChunk, maxRecords - count);
+        size_t got = file.read((uint8_t *)buf, want * sizeof(Record)) / sizeof(Record);
+
+        for (size_t i = 0; i < got; ++i) {
+            bool known = buf[i].type == PutRecord || buf[i].type == EraseRecord;
+            if (!known || recordCrc(buf[i]) != buf[i].crc) {
+                m_stats.corruptRecords++;
+                return count;
+            }
+            apply(buf[i], slots);
+            ++count;
+        }
+        if (got < want)
+            break;
+    }
+    return count;
+}
+
+void AlarmStore::countWrite(size_t offset, size_t size)
+{
+    // SD card rewrites whole sectors, even for a single record
+    size_t sectors = (offset + size - 1) / sectorSize - offset / sectorSize + 1;
+    m_stats.sectorBytes += sectors * sectorSize;
+}
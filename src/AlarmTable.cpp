@@ -0,0 +1,64 @@
+#include "AlarmTable.hpp"
+
+
+Alarm *AlarmTable::insert(const Alarm &alarm)
+{
+    index_t index;
+
+    if (m_freeSlots.empty()) {
+        if (m_slots.size() > 0xffff) {
+            log_e("Alarm table is full");
+            return nullptr;
+        }
+        index = m_slots.size();
+        m_slots.push_back(alarm);
+        m_slots[index].m_id = index;  // generation 0, the slot was free
+    } else {
+        index = m_freeSlots.back();
+        m_freeSlots.pop_back();
+        Alarm::id_t freeId = m_slots[index].m_id;
+        m_slots[index] = alarm;
+        m_slots[index].m_id = freeId;
+    }
+
+    // increment the generation making it odd (occupied)
+    m_slots[index].m_id += 1 << 16;
+    ++m_size;
+    return &m_slots[index];
+}
+
+bool AlarmTable::erase(Alarm::id_t id)
+{
+    Alarm *alarm = find(id);
+    if (alarm == nullptr)
+        return false;
+
+    // increment the generation making it even (free)
+    alarm->m_id += 1 << 16;
+    m_freeSlots.push_back(indexOf(id));
+    --m_size;
+    return true;
+}
+
+Alarm *AlarmTable::find(Alarm::id_t id)
+{
+    index_t index = indexOf(id);
+
+    if (!isOccupied(id) || index >= m_slots.size() || m_slots[index].m_id != id)
+        return nullptr;
+    return &m_slots[index];
+}
+
+void AlarmTable::assign(std::vector<Alarm> &&slots)
+{
+    m_slots = std::move(slots);
+    m_freeSlots.clear();
+    m_size = 0;
+
+    for (size_t index = 0; index < m_slots.size(); ++index) {
+        if (isOccupied(m_slots[index].m_id))
+            ++m_size;
+        else
+            m_freeSlots.push_back(index);
+    }
+}
@@ -2,11 +2,37 @@
 
 #include "SD.h"
 
+#include "LatencyTrace.hpp"
 #include "Tools.hpp"
 
 
-AudioLooper::AudioLooper(Audio *audio, std::string filePath) :
-m_audio(audio), m_filePath(filePath)
+// the pump wakes up this long before the output runs out, it covers a frame
+// the decoder holds while the DMA buffers are full
+static const int64_t  refillMargin = 40000;  // us
+static const int      maxPumpCalls = 8;      // loop() calls per wakeup
+// the ringtone rises from silence, and doesn't click when it's stopped
+static const uint32_t fadeInTime = 1500;     // ms
+static const uint32_t fadeOutTime = 300;     // ms
+// used until the decoder knows the rate of the file
+static const uint32_t defaultSampleRate = 44100;
+// two falling tones over the ringtone, for an alarm that fired meanwhile
+static const uint32_t chimeFrequencies[2] = {880, 660};  // Hz
+static const uint32_t chimeToneTime = 120;   // ms
+static const uint32_t chimeGapTime = 60;     // ms
+static const uint32_t chimeRampTime = 5;     // ms
+static const Mixer::gain_t chimeGain = Mixer::unityGain / 2;
+
+// the decoder calls a global hook, the frames go to the only player
+static AudioLooper *framePlayer = nullptr;
+
+void audio_process_extern(int16_t *buff, uint16_t len, bool *continueI2S)
+{
+    if (framePlayer != nullptr)
+        framePlayer->onFrame(buff, len);
+    *continueI2S = true;
+}
+
+AudioLooper::AudioLooper(Audio *audio) : m_audio(audio)
 {}
 
 AudioLooper::~AudioLooper()
@@ -19,9 +45,25 @@ AudioLooper::~AudioLooper()
     m_audio->stopSong();
 }
 
+bool AudioLooper::makeTrack(
+    const std::string &path, Track &track, uint32_t firstFrame, uint32_t revision
+)
+{
+    if (path.size() >= sizeof(track.path)) {
+        log_e("Ringtone path %s is too long", CSTR(path));
+        return false;
+    }
+    track = {};
+    strcpy(track.path, CSTR(path));
+    track.firstFrame = firstFrame;
+    track.revision = revision;
+    return true;
+}
+
 void AudioLooper::begin(std::function<void()> timeoutExpiredCallback)
 {
     // clang-format off
+    framePlayer = this;
     m_timeoutExpiredCallback = timeoutExpiredCallback;
     m_cmdQueue = xQueueCreate(10, sizeof(AudioCmd));
 
@@ -40,25 +82,51 @@ void AudioLooper::begin(std::function<void()> timeoutExpiredCallback)
     // clang-format on
 }
 
-void AudioLooper::start(unsigned long seconds)
+void AudioLooper::start(const Track &track, unsigned long seconds)
 {
-    AudioCmd cmd = {.type = StartCmd, .arg = seconds};
+    AudioCmd cmd = {
+        .type = StartCmd, .arg = seconds, .track = track,
+        .time = esp_timer_get_time()};
     xQueueSend(m_cmdQueue, &cmd, portMAX_DELAY);
 }
-void AudioLooper::start()
+void AudioLooper::start(const Track &track)
 {
-    start(0);
+    start(track, 0);
 }
 
 void AudioLooper::stop()
 {
-    AudioCmd cmd = {.type = StopCmd, .arg = 0};
+    AudioCmd cmd = {.type = StopCmd, .arg = 0, .time = esp_timer_get_time()};
+    xQueueSend(m_cmdQueue, &cmd, portMAX_DELAY);
+}
+
+void AudioLooper::chime()
+{
+    AudioCmd cmd = {.type = ChimeCmd, .arg = 0};
     xQueueSend(m_cmdQueue, &cmd, portMAX_DELAY);
 }
 
-void AudioLooper::setAudioPath(std::string &filePath)
+void AudioLooper::prime(const Track &track)
 {
-    m_filePath = filePath;
+    // the file stays primed until it's played, so one command per track
+    // is enough
+    bool requested = m_primeRequested.exchange(true);
+    if (requested && isSameTrack(m_requestedPrime, track))
+        return;
+
+    m_requestedPrime = track;
+    AudioCmd cmd = {.type = PrimeCmd, .arg = 0, .track = track};
+    xQueueSend(m_cmdQueue, &cmd, portMAX_DELAY);
+}
+
+AudioLooper::Stats AudioLooper::stats()
+{
+    std::lock_guard statsLock(m_statsLock);
+    Stats stats = m_stats;
+
+    // the pump may be sleeping for hours, the current sleep counts too
+    stats.totalTime[m_sleepPlaying] += esp_timer_get_time() - m_lastWakeEnd;
+    return stats;
 }
 
 void AudioLooper::onTimer(TimerHandle_t handle)
@@ -71,28 +139,216 @@ void AudioLooper::onTimer(TimerHandle_t handle)
     instance->m_timeoutExpiredCallback();
 }
 
-void AudioLooper::looperTask()
+void AudioLooper::onFrame(int16_t *buffer, uint16_t samples)
 {
-    AudioCmd lastCmd;
+    int64_t  now = esp_timer_get_time();
+    uint32_t sampleRate = m_audio->getSampleRate();
 
-    // skipping commands until StartCmd is received
-    // when this loop exits, there is the StartCmd on top of `m_cmdQueue`
-    while (true) {
-        xQueuePeek(m_cmdQueue, &lastCmd, portMAX_DELAY);
-        if (lastCmd.type == StartCmd) {
-            break;
-        } else {
-            xQueueReceive(m_cmdQueue, &lastCmd, portMAX_DELAY);
+    m_mixer.process(buffer, samples);
+    ++m_frames;
+    if (m_startCmdTime != 0) {
+        uint32_t latency = now - m_startCmdTime;
+        m_startCmdTime = 0;
+        // only the frame a start waited for; a chime plays over the frames of
+        // a running ringtone, and they aren't the first ones of its firing
+        MainLatencyTrace.record(LatencyTrace::FirstFrame, now);
+
+        std::lock_guard statsLock(m_statsLock);
+        m_stats.starts++;
+        m_stats.lastStartLatency = latency;
+        m_stats.maxStartLatency = std::max(m_stats.maxStartLatency, latency);
+    }
+    // the decoder seeks back to the first frame at the end of the file, the
+    // gap is measured on the frame it's noticed at, not on the next one
+    uint32_t filePos = m_audio->getFilePos();
+    if (filePos < m_lastFilePos) {
+        m_looped = true;
+        std::lock_guard statsLock(m_statsLock);
+        m_stats.loops++;
+    }
+    m_lastFilePos = filePos;
+    if (sampleRate == 0)
+        return;
+
+    // the output has been silent since the modeled buffer ran out
+    int64_t silence = m_bufferedSince != 0 ? now - bufferedUntil() : 0;
+    if (silence > 0 || m_looped) {
+        uint32_t gap = std::max<int64_t>(silence, 0) * sampleRate / 1000000;
+
+        std::lock_guard statsLock(m_statsLock);
+        if (silence > 0)
+            m_stats.underruns++;
+        if (m_looped) {
+            m_stats.lastGapSamples = gap;
+            m_stats.maxGapSamples = std::max(m_stats.maxGapSamples, gap);
+        }
+    }
+    m_looped = false;
+    if (m_bufferedSince == 0 || silence > 0) {
+        m_bufferedSince = now;
+        m_bufferedSamples = 0;
+    }
+    m_bufferedSamples += samples;
+}
+
+void AudioLooper::connect(const Track &track)
+{
+    m_track = track;
+    // the decoder starts right at the first frame instead of searching it
+    m_audio->connecttoSD(m_track.path, m_track.firstFrame);
+    // at the end of the file the decoder seeks back to the first audio
+    // frame, the file and the decoder state are kept
+    m_audio->setFileLoop(true);
+    m_lastFilePos = 0;
+}
+
+void AudioLooper::pump()
+{
+    for (int call = 0; call < maxPumpCalls; ++call) {
+        // the decoder loops the file itself, it stops only if it couldn't
+        if (!m_audio->isRunning()) {
+            connect(m_track);
+            m_looped = true;
+            std::lock_guard statsLock(m_statsLock);
+            m_stats.loops++;
+            m_stats.reconnects++;
         }
+
+        uint32_t frames = m_frames;
+        m_audio->loop();
+
+        // no frame means the DMA buffers are full or the file is being read
+        if (m_frames == frames)
+            break;
+    }
+}
+
+TickType_t AudioLooper::refillDelay() const
+{
+    int64_t delay = bufferedUntil() - esp_timer_get_time() - refillMargin;
+
+    // a tick at least, so lower priority tasks and the watchdog get to run
+    return std::max<TickType_t>(pdMS_TO_TICKS(std::max<int64_t>(delay, 0) / 1000), 1);
+}
+
+int64_t AudioLooper::bufferedUntil() const
+{
+    return m_bufferedSince + (int64_t)(m_bufferedSamples * 1000000 / sampleRate());
+}
+
+uint32_t AudioLooper::sampleRate() const
+{
+    uint32_t sampleRate = m_audio->getSampleRate();
+
+    return sampleRate != 0 ? sampleRate : defaultSampleRate;
+}
+
+uint32_t AudioLooper::samplesIn(uint32_t ms) const
+{
+    return (uint64_t)sampleRate() * ms / 1000;
+}
+
+void AudioLooper::primeTrack(const Track &track)
+{
+    // SD lookup, file open and decoder setup are done here, long before the
+    // alarm fires; the next alarm could get another ringtone, then the old
+    // one is closed
+    if (m_primed)
+        m_audio->stopSong();
+    m_primed = false;
+    connect(track);
+    if (m_audio->isRunning() && m_audio->pauseResume()) {
+        m_primed = true;
+        log_i("Primed %s", m_track.path);
+    } else {
+        m_audio->stopSong();
+        m_primeRequested = false;
+        log_e("Could not prime %s", m_track.path);
+    }
+}
+
+void AudioLooper::finishStop()
+{
+    m_audio->stopSong();
+    m_mixer.stopTones();
+    m_playing = false;
+    m_stopping = false;
+    m_startCmdTime = 0;  // stopped before the first frame
+    log_i("Stopped playing");
+    {
+        uint32_t latency = esp_timer_get_time() - m_stopCmdTime;
+        std::lock_guard statsLock(m_statsLock);
+        m_stats.stops++;
+        m_stats.lastStopLatency = latency;
+        m_stats.maxStopLatency = std::max(m_stats.maxStopLatency, latency);
+    }
+
+    // the next alarm's track was requested while this one faded out
+    if (m_primePending) {
+        m_primePending = false;
+        primeTrack(m_pendingPrime);
     }
+}
+
+void AudioLooper::countWakeup(bool wasPlaying, int64_t wakeTime)
+{
+    int64_t now = esp_timer_get_time();
+    std::lock_guard statsLock(m_statsLock);
 
+    m_stats.wakeups[wasPlaying]++;
+    m_stats.busyTime[wasPlaying] += now - wakeTime;
+    m_stats.totalTime[wasPlaying] += now - m_lastWakeEnd;
+    m_lastWakeEnd = now;
+    m_sleepPlaying = m_playing;
+}
+
+void AudioLooper::looperTask()
+{
+    AudioCmd lastCmd;
+
+    m_lastWakeEnd = esp_timer_get_time();
     while (true) {
-        // 1-tick delay prevents watchdog timer from triggering
-        if (xQueueReceive(m_cmdQueue, &lastCmd, 1)) {
+        // the task sleeps until a command arrives when nothing is playing,
+        // and until the output needs more samples while playing
+        bool    received = xQueueReceive(
+            m_cmdQueue, &lastCmd, m_playing ? refillDelay() : portMAX_DELAY
+        );
+        int64_t wakeTime = esp_timer_get_time();
+        bool    wasPlaying = m_playing;
+
+        if (received) {
             switch (lastCmd.type) {
+            case PrimeCmd:
+                if (m_stopping) {
+                    m_pendingPrime = lastCmd.track;
+                    m_primePending = true;
+                }
+                if (m_playing || (m_primed && isSameTrack(lastCmd.track, m_track)))
+                    break;
+                primeTrack(lastCmd.track);
+                break;
+
             case StartCmd:
-                m_audio->connecttoSD(CSTR(m_filePath));
-                log_i("aboba: %d", SD.exists("/test.mp3"));
+                MainLatencyTrace.record(LatencyTrace::PlayerWoken);
+                if (m_primed && isSameTrack(lastCmd.track, m_track)) {
+                    m_audio->pauseResume();
+                    MainLatencyTrace.record(LatencyTrace::Resumed);
+                } else {
+                    if (m_primed)
+                        m_audio->stopSong();
+                    connect(lastCmd.track);
+                    MainLatencyTrace.record(LatencyTrace::FileOpened);
+                }
+                m_bufferedSince = 0;  // the start isn't an underrun
+                m_startCmdTime = lastCmd.time;
+                m_primed = false;
+                m_primeRequested = false;
+                m_primePending = false;
+                m_playing = true;
+                m_stopping = false;
+                m_mixer.stopTones();
+                m_mixer.setGain(Mixer::streamVoice, 0);
+                m_mixer.fade(Mixer::streamVoice, Mixer::unityGain, samplesIn(fadeInTime));
 
                 if (lastCmd.arg != 0) {
                     // also starts the timer
@@ -106,26 +362,52 @@ void AudioLooper::looperTask()
                 break;
 
             case StopCmd:
-                m_audio->stopSong();  // TODO fade out audio
-                log_i("Processed StopCmd, suspending the task");
+                m_primeRequested = false;
+                if (m_playing && !m_stopping) {
+                    // the decoder runs until the fade is over, a stalled
+                    // one is stopped by the deadline
+                    m_mixer.fade(Mixer::streamVoice, 0, samplesIn(fadeOutTime));
+                    m_stopDeadline = wakeTime + 2000 * fadeOutTime;
+                    m_stopCmdTime = lastCmd.time;
+                    m_stopping = true;
+                } else if (!m_playing) {
+                    m_audio->stopSong();
+                    m_primed = false;
+                }
+                log_i("Processed StopCmd");
 
                 if (xTimerIsTimerActive(m_autoStopTimer)) {
                     xTimerStop(m_autoStopTimer, portMAX_DELAY);
                 }
-                // now the task can be suspended until the next command arrives
-                // because the audio player is stopped, so using portMAX_DELAY
-                xQueuePeek(m_cmdQueue, &lastCmd, portMAX_DELAY);
-                // skip the end of the iteration to prevent audio from looping again
-                continue;
+                break;
+
+            case ChimeCmd:
+                // the tones are mixed into the decoded frames, so there's
+                // nothing to play them over when the ringtone is stopped
+                if (!m_playing || m_stopping)
+                    break;
+                for (int i = 0; i < 2; ++i) {
+                    uint32_t start = i * samplesIn(chimeToneTime + chimeGapTime);
+                    m_mixer.playTone(
+                        chimeFrequencies[i], sampleRate(), start,
+                        samplesIn(chimeToneTime), samplesIn(chimeRampTime),
+                        chimeGain
+                    );
+                }
+                log_i("Processed ChimeCmd");
                 break;
             }
         }
 
-        if (!m_audio->isRunning())
-            m_audio->connecttoSD(CSTR(m_filePath));
-
-        m_audio->loop();
+        // a primed file stays paused until StartCmd
+        if (m_playing)
+            pump();
+        if (m_stopping
+            && (!m_mixer.isFading(Mixer::streamVoice)
+                || esp_timer_get_time() >= m_stopDeadline))
+            finishStop();
+        countWakeup(wasPlaying, wakeTime);
     }
 
     vTaskDelete(NULL);
-}
\ No newline at end of file
+}
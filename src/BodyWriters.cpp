@@ -0,0 +1,120 @@
+#include "BodyWriters.hpp"
+
+#include <cinttypes>
+
+
+bool IdsWriter::write(mg_connection *conn)
+{
+    char   chunk[chunkSize];
+    size_t length = 0;
+
+    if (m_next > m_ids.size())
+        return false;
+
+    if (m_next == 0)
+        length += sprintf(chunk, "{\"ids\":[");
+    // room for a comma, the id, "]}" and the nul of sprintf()
+    while (m_next < m_ids.size() && length + maxIdLength + 4 <= chunkSize) {
+        if (m_next > 0)
+            chunk[length++] = ',';
+        length += sprintf(chunk + length, "%" PRIu64, m_ids[m_next++]);
+    }
+    if (m_next == m_ids.size()) {
+        chunk[length++] = ']';
+        chunk[length++] = '}';
+        ++m_next;  // the object is closed
+    }
+    mg_http_write_chunk(conn, chunk, length);
+    return true;
+}
+
+
+bool ArrayWriter::write(mg_connection *conn)
+{
+    char   chunk[chunkSize];
+    size_t length = 0;
+    size_t count = size();
+
+    if (m_next > count)
+        return false;
+
+    chunk[length++] = m_next == 0 ? '[' : ',';
+    while (m_next < count) {
+        size_t written = writeItem(m_next, chunk + length, chunkSize - length);
+        // an item that doesn't fit goes to the next chunk, unless the chunk
+        // has nothing but the bracket or the comma before it
+        if (written == 0 && length > 1)
+            break;
+        if (written == 0) {
+            log_e("Item %zu doesn't fit in a chunk of %zu bytes", m_next, chunkSize);
+            m_failed = true;
+            m_next = count + 1;
+            return false;
+        }
+        length += written;
+        if (++m_next < count)
+            chunk[length++] = ',';
+    }
+    if (m_next == count) {
+        chunk[length++] = ']';
+        ++m_next;  // the array is closed
+    } else {
+        --length;  // the next chunk starts with the comma
+    }
+    mg_http_write_chunk(conn, chunk, length);
+    return true;
+}
+
+size_t ArrayWriter::serializeItem(const JsonDocument &item, char *buf, size_t size)
+{
+    size_t length = measureJson(item);
+    if (length + 1 >= size)
+        return 0;
+    return serializeJson(item, buf, size);
+}
+
+
+size_t AlarmsWriter::writeItem(size_t index, char *buf, size_t size) const
+{
+    const Alarm &alarm = m_snapshot->alarms[index];
+    StaticJsonDocument<256> alarmJson;
+    alarmJson["id"] = alarm.id();
+
+    char time[6];  // "hh:mm" + "\0"
+    // always produces 6-chrachter string even if alarm is invalid
+    sprintf(time, "%02hhu:%02hhu", alarm.hour % 100, alarm.minute % 100);
+    alarmJson["time"] = time;
+
+    JsonArray daysOfWeek = alarmJson.createNestedArray("daysOfWeek");
+    for (byte i = 0; i < 7; ++i) {
+        daysOfWeek.add(alarm.daysOfWeek.isSet(i));
+    }
+    alarmJson["enabled"] = alarm.enabled;
+    alarmJson["missed"] = alarm.isMissed();
+
+    // ids are never reused, the name is there even if the file is not
+    if (alarm.ringtone != RingtoneLibrary::defaultRingtone
+        && alarm.ringtone <= m_ringtones->entries.size()) {
+        alarmJson["ringtone"] = m_ringtones->entries[alarm.ringtone - 1].name.c_str();
+    } else {
+        alarmJson["ringtone"] = nullptr;
+    }
+
+    return serializeItem(alarmJson, buf, size);
+}
+
+
+size_t RingtonesWriter::writeItem(size_t index, char *buf, size_t size) const
+{
+    const RingtoneLibrary::Entry &entry = m_catalog->entries[index];
+    StaticJsonDocument<JSON_OBJECT_SIZE(6)> ringtoneJson;
+
+    ringtoneJson["name"] = entry.name.c_str();
+    ringtoneJson["size"] = entry.size;
+    ringtoneJson["codec"] = RingtoneLibrary::codecName(entry.codec);
+    ringtoneJson["sampleRate"] = entry.sampleRate;
+    ringtoneJson["duration"] = entry.duration;
+    ringtoneJson["available"] = entry.available;
+
+    return serializeItem(ringtoneJson, buf, size);
+}
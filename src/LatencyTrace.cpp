@@ -0,0 +1,175 @@
+#include "LatencyTrace.hpp"
+
+
+void IRAM_ATTR LatencyTrace::record(Stage stage)
+{
+    record(stage, esp_timer_get_time());
+}
+
+void IRAM_ATTR LatencyTrace::record(Stage stage, int64_t time)
+{
+    uint32_t firing = stage == Interrupt
+                          ? m_firing.fetch_add(1, std::memory_order_relaxed) + 1
+                          : m_firing.load(std::memory_order_relaxed);
+
+    // nothing is traced before the first interrupt; a repeated stage is
+    // checked without a write first, it's called on every audio frame
+    if (firing == 0 || m_recorded[stage].load(std::memory_order_relaxed) == firing)
+        return;
+    if (m_recorded[stage].exchange(firing, std::memory_order_relaxed) == firing)
+        return;
+
+    uint32_t index = m_head.fetch_add(1, std::memory_order_relaxed);
+    Event &event = m_ring[index % ringSize];
+
+    // zero tells collect() the slot is being rewritten
+    event.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    event.firing = firing;
+    event.stage = stage;
+    event.time = time;
+    event.seq.store(index + 1, std::memory_order_release);
+}
+
+void LatencyTrace::collect()
+{
+    std::lock_guard lock(m_collectLock);
+    uint32_t head = m_head.load(std::memory_order_acquire);
+
+    if (head - m_tail > ringSize) {
+        m_lost += head - m_tail - ringSize;
+        m_tail = head - ringSize;
+    }
+
+    for (; m_tail != head; ++m_tail) {
+        const Event &slot = m_ring[m_tail % ringSize];
+        uint32_t seq = slot.seq.load(std::memory_order_acquire);
+
+        if (seq != m_tail + 1) {
+            if (seq == 0 || seq < m_tail + 1)
+                break;  // claimed but not written yet, the next collect() gets it
+            ++m_lost;   // a writer has lapped the ring meanwhile
+            continue;
+        }
+
+        Event event;
+        event.firing = slot.firing;
+        event.stage = slot.stage;
+        event.time = slot.time;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != seq) {
+            ++m_lost;
+            continue;
+        }
+        fold(event);
+    }
+}
+
+LatencyTrace::Summary LatencyTrace::summary(Stage stage)
+{
+    collect();
+
+    std::lock_guard lock(m_collectLock);
+    return summarize(m_histograms[stage]);
+}
+
+LatencyTrace::Summary LatencyTrace::total(bool primed)
+{
+    collect();
+
+    std::lock_guard lock(m_collectLock);
+    return summarize(m_totals[primed]);
+}
+
+uint32_t LatencyTrace::lostEvents()
+{
+    std::lock_guard lock(m_collectLock);
+    return m_lost;
+}
+
+const char *LatencyTrace::stageName(Stage stage)
+{
+    static const char *names[stageCount] = {
+        "interrupt", "dequeue", "rearm", "dispatch", "wakeup", "open", "resume",
+        "firstFrame"};
+    return names[stage];
+}
+
+size_t LatencyTrace::bucketOf(uint32_t latency)
+{
+    if (latency < 4)
+        return latency;
+
+    // the exponent picks the power of two, the next two bits split it in 4
+    int exponent = 31 - __builtin_clz(latency);
+    size_t bucket = (exponent - 1) * 4 + ((latency >> (exponent - 2)) & 3);
+    return std::min(bucket, bucketCount - 1);
+}
+
+uint32_t LatencyTrace::bucketBound(size_t bucket)
+{
+    if (bucket < 4)
+        return bucket;
+
+    int exponent = bucket / 4 + 1;
+    uint32_t lower = (4 + bucket % 4) << (exponent - 2);
+    return lower + (1 << (exponent - 2)) - 1;
+}
+
+uint32_t LatencyTrace::percentile(const Histogram &hist, uint32_t permille)
+{
+    uint32_t rank = ((uint64_t)hist.count * permille + 999) / 1000;
+    uint32_t seen = 0;
+
+    if (hist.count == 0)
+        return 0;
+    for (size_t bucket = 0; bucket < bucketCount; ++bucket) {
+        seen += hist.buckets[bucket];
+        if (seen >= rank)
+            return std::min(bucketBound(bucket), hist.max);
+    }
+    return hist.max;
+}
+
+LatencyTrace::Summary LatencyTrace::summarize(const Histogram &hist)
+{
+    return {hist.count, percentile(hist, 500), percentile(hist, 990), hist.max};
+}
+
+void LatencyTrace::fold(const Event &event)
+{
+    if (event.firing != m_foldedFiring) {
+        if (event.firing < m_foldedFiring)
+            return;  // a late stage of a firing that's already summarized
+        m_foldedFiring = event.firing;
+        m_seenStages = 0;
+    }
+
+    m_stageTimes[event.stage] = event.time;
+    m_seenStages |= 1 << event.stage;
+
+    // a stage is measured from the latest one the firing got to, a firing
+    // either opens the file or resumes the primed player
+    int previous = event.stage - 1;
+    while (previous >= 0 && !(m_seenStages & (1 << previous)))
+        --previous;
+    if (previous >= 0)
+        add(m_histograms[event.stage], event.time - m_stageTimes[previous]);
+
+    if (event.stage == FirstFrame && (m_seenStages & (1 << Interrupt))) {
+        bool primed = m_seenStages & (1 << Resumed);
+        add(m_totals[primed], event.time - m_stageTimes[Interrupt]);
+    }
+}
+
+void LatencyTrace::add(Histogram &hist, uint32_t latency)
+{
+    // the clock can't go backwards, but a negative difference would be huge
+    if ((int32_t)latency < 0)
+        latency = 0;
+    hist.count++;
+    hist.max = std::max(hist.max, latency);
+    hist.buckets[bucketOf(latency)]++;
+}
+
+LatencyTrace MainLatencyTrace;
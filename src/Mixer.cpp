@@ -0,0 +1,133 @@
+#include "Mixer.hpp"
+
+#include <array>
+#include <math.h>
+
+
+static const int32_t unityLevel = Mixer::unityGain << 15;
+
+// a period of the sine in Q15, indexed by the top 8 bits of the phase
+static const std::array<int16_t, 256> sineTable = [] {
+    std::array<int16_t, 256> table;
+    for (size_t i = 0; i < table.size(); ++i)
+        table[i] = lroundf(sinf(2 * (float)M_PI * i / table.size()) * 32767);
+    return table;
+}();
+
+
+Mixer::Mixer()
+{
+    m_voices[streamVoice].level = unityLevel;
+}
+
+void Mixer::setGain(size_t voice, gain_t gain)
+{
+    fade(voice, gain, 0);
+}
+
+void Mixer::fade(size_t voice, gain_t gain, uint32_t samples)
+{
+    startRamp(m_voices[voice], levelOf(gain), samples);
+}
+
+bool Mixer::playTone(
+    uint32_t frequency, uint32_t sampleRate, uint32_t delay, uint32_t length,
+    uint32_t ramp, gain_t gain
+)
+{
+    for (size_t i = streamVoice + 1; i < voiceCount; ++i) {
+        Voice &voice = m_voices[i];
+        if (voice.active)
+            continue;
+
+        voice = {};
+        voice.active = true;
+        voice.phaseStep = ((uint64_t)frequency << 32) / sampleRate;
+        voice.delay = delay;
+        voice.left = length;
+        voice.ramp = std::min(ramp, length / 2);
+        // the fade in starts with the tone, after the delay
+        startRamp(voice, levelOf(gain), voice.ramp);
+        ++m_activeTones;
+        return true;
+    }
+    return false;
+}
+
+void Mixer::stopTones()
+{
+    for (size_t i = streamVoice + 1; i < voiceCount; ++i)
+        m_voices[i].active = false;
+    m_activeTones = 0;
+}
+
+int32_t Mixer::levelOf(gain_t gain)
+{
+    // a level above unityLevel would overflow, and so would the ramp to it
+    return std::max<gain_t>(0, std::min(gain, unityGain)) << levelShift;
+}
+
+void Mixer::startRamp(Voice &voice, int32_t level, uint32_t samples)
+{
+    voice.target = level;
+    voice.rampLeft = samples;
+    if (samples == 0)
+        voice.level = level;
+    else
+        voice.step = (level - voice.level) / (int32_t)samples;
+}
+
+int32_t Mixer::advance(Voice &voice)
+{
+    if (voice.rampLeft != 0) {
+        voice.level += voice.step;
+        if (--voice.rampLeft == 0)
+            voice.level = voice.target;  // exact, whatever the rounding was
+    }
+    return voice.level >> levelShift;
+}
+
+int32_t Mixer::nextTone(Voice &voice)
+{
+    if (voice.delay != 0) {
+        --voice.delay;
+        return 0;
+    }
+
+    // the fade out ends with the last sample
+    if (voice.left == voice.ramp)
+        startRamp(voice, 0, voice.ramp);
+
+    int32_t sample = sineTable[voice.phase >> 24] * advance(voice) >> 15;
+    voice.phase += voice.phaseStep;
+    if (--voice.left == 0) {
+        voice.active = false;
+        --m_activeTones;
+    }
+    return sample;
+}
+
+void Mixer::process(int16_t *samples, uint16_t frames)
+{
+    Voice &stream = m_voices[streamVoice];
+
+    // the stream at unity gain and no tones, which is most of the time
+    if (m_activeTones == 0 && stream.rampLeft == 0 && stream.level == unityLevel)
+        return;
+
+    for (uint16_t i = 0; i < frames; ++i) {
+        int32_t gain = advance(stream);
+        int32_t tones = 0;
+
+        for (size_t v = streamVoice + 1; m_activeTones != 0 && v < voiceCount; ++v) {
+            if (m_voices[v].active)
+                tones += nextTone(m_voices[v]);
+        }
+
+        for (int channel = 0; channel < 2; ++channel) {
+            int16_t &sample = samples[2 * i + channel];
+            int32_t  mixed = (sample * gain >> 15) + tones;
+            sample = std::max<int32_t>(std::min<int32_t>(mixed, INT16_MAX), INT16_MIN);
+        }
+    }
+}
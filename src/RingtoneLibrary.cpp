@@ -0,0 +1,395 @@
+#include "RingtoneLibrary.hpp"
+
+#include "esp32/rom/crc.h"
+
+#include "RingtoneUpload.hpp"
+
+
+static const uint32_t indexMagic = 0x31495452;  // "RTI1"
+
+// every name an upload accepts fits in a path
+static_assert(
+    sizeof(RingtoneUpload::directory) + RingtoneUpload::maxNameLength
+    <= RingtoneLibrary::maxPathLength
+);
+static const size_t   frameSearchLength = 4096; // padding after ID3 tags, bytes
+
+// MPEG audio layer III tables, by the version bits of the frame header
+static const uint16_t mpeg1Bitrates[15] = {
+    0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320};
+static const uint16_t mpeg2Bitrates[15] = {
+    0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160};
+static const uint32_t mpeg1SampleRates[3] = {44100, 48000, 32000};
+
+
+static uint32_t readSyncsafe(const uint8_t *bytes)
+{
+    return bytes[0] << 21 | bytes[1] << 14 | bytes[2] << 7 | bytes[3];
+}
+
+static uint32_t readBigEndian(const uint8_t *bytes)
+{
+    return bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+}
+
+static std::string baseName(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash != nullptr ? slash + 1 : path;
+}
+
+
+bool RingtoneLibrary::begin(const std::string &dir)
+{
+    std::lock_guard lock(m_writeLock);
+    int64_t startTime = esp_timer_get_time();
+    Catalog catalog;
+    size_t  parsed = 0;
+
+    m_dir = dir;
+    m_indexPath = dir + "/index.bin";
+    m_tmpPath = dir + "/index.tmp";
+
+    if (!SD.exists(dir.c_str()) && !SD.mkdir(dir.c_str())) {
+        log_e("Could not create the ringtone directory %s", dir.c_str());
+        return false;
+    }
+
+    // a broken index is rebuilt from the files, ids of the ringtones which
+    // were lost with it change
+    bool changed = !loadIndex(catalog);
+
+    // the files could be changed while the SD card was out, so the directory
+    // is checked once; only new and changed files are parsed
+    std::vector<bool> found(catalog.entries.size());
+    File root = SD.open(dir.c_str());
+    for (File file = root.openNextFile(); file; file = root.openNextFile()) {
+        std::string name = baseName(file.name());
+        if (file.isDirectory() || !RingtoneUpload::isValidName(name))
+            continue;
+        if (catalog.ids.count(name) == 0 && !canAdd(catalog, name)) {
+            log_e("Ringtone %s clashes with another one, skipping it", name.c_str());
+            continue;
+        }
+
+        auto known = catalog.ids.find(name);
+        if (known != catalog.ids.end()) {
+            Entry &entry = catalog.entries[known->second - 1];
+            found[known->second - 1] = true;
+            if (entry.size == file.size() && entry.modified == file.getLastWrite())
+                continue;
+        }
+
+        Entry entry = {name, (uint32_t)file.size(), (uint32_t)file.getLastWrite()};
+        entry.available = parse(file, entry);
+        put(catalog, entry);
+        changed = true;
+        ++parsed;
+    }
+    root.close();
+
+    for (size_t i = 0; i < found.size(); ++i) {
+        if (!found[i] && catalog.entries[i].available) {
+            catalog.entries[i].available = false;
+            changed = true;
+        }
+    }
+
+    if (changed)
+        writeIndex(catalog);
+    log_i(
+        "Loaded %zu ringtones, parsed %zu files in %u us", catalog.entries.size(),
+        parsed, (uint32_t)(esp_timer_get_time() - startTime)
+    );
+    publish(std::move(catalog));
+    return true;
+}
+
+bool RingtoneLibrary::update(const std::string &name)
+{
+    std::lock_guard lock(m_writeLock);
+    Catalog catalog = *this->catalog();
+    Entry   entry = {name};
+
+    if (catalog.ids.count(name) == 0 && !canAdd(catalog, name)) {
+        log_e("Ringtone %s clashes with another one", name.c_str());
+        return false;
+    }
+
+    File file = SD.open((m_dir + "/" + name).c_str(), FILE_READ);
+    if (file) {
+        entry.size = file.size();
+        entry.modified = file.getLastWrite();
+        entry.available = parse(file, entry);
+        file.close();
+    }
+    // a player holding the old file sees a new track
+    entry.revision = ++m_revisions;
+
+    // the catalog is published even if the index isn't written,
+    // the file is parsed again at the next boot then
+    put(catalog, entry);
+    writeIndex(catalog);
+    publish(std::move(catalog));
+    return entry.available;
+}
+
+RingtoneLibrary::id_t RingtoneLibrary::find(const std::string &name) const
+{
+    CatalogPtr catalog = this->catalog();
+    auto it = catalog->ids.find(name);
+
+    return it != catalog->ids.end() ? it->second : defaultRingtone;
+}
+
+RingtoneLibrary::key_t RingtoneLibrary::keyOf(id_t id) const
+{
+    CatalogPtr catalog = this->catalog();
+
+    if (id == defaultRingtone || id > catalog->entries.size())
+        return defaultKey;
+    return keyOf(catalog->entries[id - 1].name);
+}
+
+RingtoneLibrary::id_t RingtoneLibrary::findKey(key_t key) const
+{
+    CatalogPtr catalog = this->catalog();
+    auto it = catalog->keys.find(key);
+
+    return it != catalog->keys.end() ? it->second : defaultRingtone;
+}
+
+bool RingtoneLibrary::canAdd(const std::string &name) const
+{
+    return canAdd(*catalog(), name);
+}
+
+bool RingtoneLibrary::canAdd(const Catalog &catalog, const std::string &name) const
+{
+    auto it = catalog.keys.find(keyOf(name));
+
+    if (m_dir.size() + 1 + name.size() > maxPathLength)
+        return false;
+    return it == catalog.keys.end() || catalog.entries[it->second - 1].name == name;
+}
+
+/* 32-bit FNV-1a, defaultKey is never a key of a file */
+RingtoneLibrary::key_t RingtoneLibrary::keyOf(const std::string &name)
+{
+    key_t hash = 2166136261u;
+
+    for (char c : name) {
+        hash ^= (uint8_t)c;
+        hash *= 16777619u;
+    }
+    return hash != defaultKey ? hash : 1;
+}
+
+bool RingtoneLibrary::get(id_t id, Entry &entry) const
+{
+    CatalogPtr catalog = this->catalog();
+
+    if (id == defaultRingtone || id > catalog->entries.size()
+        || !catalog->entries[id - 1].available)
+        return false;
+    entry = catalog->entries[id - 1];
+    return true;
+}
+
+const char *RingtoneLibrary::codecName(Codec codec)
+{
+    switch (codec) {
+    case Mp3Codec: return "mp3";
+    case WavCodec: return "wav";
+    default:       return "unknown";
+    }
+}
+
+bool RingtoneLibrary::loadIndex(Catalog &catalog)
+{
+    File index = SD.open(m_indexPath.c_str(), FILE_READ);
+    IndexHeader header;
+
+    if (!index)
+        return false;
+    if (index.read((uint8_t *)&header, sizeof(header)) != sizeof(header)
+        || header.magic != indexMagic) {
+        log_e("Ringtone index %s is broken", m_indexPath.c_str());
+        index.close();
+        return false;
+    }
+
+    for (uint32_t i = 0; i < header.records; ++i) {
+        IndexRecord record;
+        const uint8_t *data = (const uint8_t *)&record + sizeof(record.crc);
+        if (index.read((uint8_t *)&record, sizeof(record)) != sizeof(record)
+            || crc32_le(0, data, sizeof(record) - sizeof(record.crc)) != record.crc) {
+            log_e("Ringtone index %s is broken at record %u", m_indexPath.c_str(), i);
+            index.close();
+            catalog = Catalog();
+            return false;
+        }
+
+        record.name[sizeof(record.name) - 1] = '\0';
+        put(catalog,
+            {record.name, record.size, record.modified, (Codec)record.codec,
+             record.sampleRate, record.duration, record.firstFrame,
+             (bool)record.available});
+    }
+    index.close();
+    return true;
+}
+
+bool RingtoneLibrary::writeIndex(const Catalog &catalog)
+{
+    IndexHeader header {indexMagic, (uint32_t)catalog.entries.size()};
+    File tmp = SD.open(m_tmpPath.c_str(), FILE_WRITE);
+    bool ok = tmp && tmp.write((const uint8_t *)&header, sizeof(header)) == sizeof(header);
+
+    for (const Entry &entry : catalog.entries) {
+        IndexRecord record = {};
+        strncpy(record.name, entry.name.c_str(), sizeof(record.name) - 1);
+        record.codec = entry.codec;
+        record.available = entry.available;
+        record.size = entry.size;
+        record.modified = entry.modified;
+        record.sampleRate = entry.sampleRate;
+        record.duration = entry.duration;
+        record.firstFrame = entry.firstFrame;
+        const uint8_t *data = (const uint8_t *)&record + sizeof(record.crc);
+        record.crc = crc32_le(0, data, sizeof(record) - sizeof(record.crc));
+
+        ok = ok && tmp.write((const uint8_t *)&record, sizeof(record)) == sizeof(record);
+    }
+    if (tmp)
+        tmp.close();
+
+    // the old index stays until the new one is complete
+    if (!ok || (SD.remove(m_indexPath.c_str()), !SD.rename(m_tmpPath.c_str(), m_indexPath.c_str()))) {
+        log_e("Could not write the ringtone index %s", m_indexPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool RingtoneLibrary::parse(File &file, Entry &entry)
+{
+    const std::string &name = entry.name;
+
+    entry.codec = UnknownCodec;
+    if (name.substr(name.size() - 4) == ".mp3" && parseMp3(file, entry)) {
+        entry.codec = Mp3Codec;
+    } else if (name.substr(name.size() - 4) == ".wav" && parseWav(file, entry)) {
+        entry.codec = WavCodec;
+    } else {
+        log_w("Ringtone %s is not a playable MP3 or WAV file", name.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool RingtoneLibrary::parseMp3(File &file, Entry &entry)
+{
+    uint8_t  buf[512];
+    uint32_t offset = 0;
+
+    // ID3v2 tags are skipped by their sizes, the decoder doesn't need them
+    while (file.seek(offset) && file.read(buf, 10) == 10 && memcmp(buf, "ID3", 3) == 0)
+        offset += 10 + readSyncsafe(buf + 6) + (buf[5] & 0x10 ? 10 : 0);
+
+    // the first frame header follows the tags, maybe after some padding
+    for (uint32_t start = offset; start < offset + frameSearchLength; start += sizeof(buf) - 3) {
+        file.seek(start);
+        size_t length = file.read(buf, sizeof(buf));
+
+        for (size_t i = 0; i + 4 <= length; ++i) {
+            const uint8_t *h = buf + i;
+            uint8_t version = (h[1] >> 3) & 3;  // 3 is MPEG 1, 2 is MPEG 2, 0 is MPEG 2.5
+            uint8_t layer = (h[1] >> 1) & 3;    // 1 is layer III
+            uint8_t bitrateIndex = h[2] >> 4;
+            uint8_t rateIndex = (h[2] >> 2) & 3;
+
+            if (h[0] != 0xFF || (h[1] & 0xE0) != 0xE0 || version == 1 || layer != 1
+                || bitrateIndex == 0 || bitrateIndex == 15 || rateIndex == 3)
+                continue;
+
+            bool     mpeg1 = version == 3;
+            bool     mono = (h[3] >> 6) == 3;
+            uint32_t bitrate = (mpeg1 ? mpeg1Bitrates : mpeg2Bitrates)[bitrateIndex];
+            uint32_t samplesPerFrame = mpeg1 ? 1152 : 576;
+
+            entry.firstFrame = start + i;
+            entry.sampleRate = mpeg1SampleRates[rateIndex] >> (mpeg1 ? 0 : version == 2 ? 1 : 2);
+
+            // a VBR file has the count of its frames in the Xing (or Info)
+            // header in the first frame, otherwise the bitrate is constant
+            uint8_t  xing[12];
+            uint32_t sideInfo = mpeg1 ? (mono ? 17 : 32) : (mono ? 9 : 17);
+            file.seek(entry.firstFrame + 4 + sideInfo);
+            if (file.read(xing, sizeof(xing)) == sizeof(xing)
+                && (memcmp(xing, "Xing", 4) == 0 || memcmp(xing, "Info", 4) == 0)
+                && (readBigEndian(xing + 4) & 1)) {
+                uint64_t samples = (uint64_t)readBigEndian(xing + 8) * samplesPerFrame;
+                entry.duration = samples * 1000 / entry.sampleRate;
+            } else {
+                // bytes * 8 / kbit/s gives ms
+                entry.duration = (uint64_t)(entry.size - entry.firstFrame) * 8 / bitrate;
+            }
+            return true;
+        }
+        if (length < sizeof(buf))
+            break;
+    }
+    return false;
+}
+
+bool RingtoneLibrary::parseWav(File &file, Entry &entry)
+{
+    uint8_t  header[16];
+    uint32_t byteRate = 0;
+    uint32_t pos = 12;
+
+    if (!file.seek(0) || file.read(header, 12) != 12 || memcmp(header, "RIFF", 4) != 0
+        || memcmp(header + 8, "WAVE", 4) != 0)
+        return false;
+
+    // the chunks are walked until the data, "fmt " comes before it
+    while (pos + 8 <= entry.size && file.seek(pos) && file.read(header, 8) == 8) {
+        uint32_t chunkSize;
+        memcpy(&chunkSize, header + 4, 4);  // little-endian, as ESP32
+
+        if (memcmp(header, "fmt ", 4) == 0 && file.read(header, 16) == 16) {
+            memcpy(&entry.sampleRate, header + 4, 4);
+            memcpy(&byteRate, header + 8, 4);
+        } else if (memcmp(header, "data", 4) == 0) {
+            if (byteRate == 0 || entry.sampleRate == 0)
+                return false;
+            entry.firstFrame = pos + 8;
+            chunkSize = std::min(chunkSize, entry.size - entry.firstFrame);
+            entry.duration = (uint64_t)chunkSize * 1000 / byteRate;
+            return true;
+        }
+        pos += 8 + chunkSize + (chunkSize & 1);  // chunks are padded to words
+    }
+    return false;
+}
+
+void RingtoneLibrary::put(Catalog &catalog, const Entry &entry)
+{
+    auto known = catalog.ids.find(entry.name);
+
+    if (known != catalog.ids.end()) {
+        catalog.entries[known->second - 1] = entry;
+    } else {
+        catalog.entries.push_back(entry);
+        catalog.ids.emplace(entry.name, catalog.entries.size());
+        catalog.keys.emplace(keyOf(entry.name), catalog.entries.size());
+    }
+}
+
+void RingtoneLibrary::publish(Catalog &&catalog)
+{
+    std::atomic_store(&m_catalog, CatalogPtr(std::make_shared<Catalog>(std::move(catalog))));
+}
+
+RingtoneLibrary MainRingtoneLibrary;
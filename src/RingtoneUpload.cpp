@@ -0,0 +1,183 @@
+#include "RingtoneUpload.hpp"
+
+#include <vector>
+
+
+static const char   partSuffix[] = ".part";
+static const char   backupSuffix[] = ".bak";
+
+// only the web server task uploads, after recover()
+static uint64_t     freeSpace = 0;
+
+// SD returns full paths of the files in a directory on some cores
+static std::string baseName(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash != nullptr ? slash + 1 : path;
+}
+
+static bool endsWith(std::string_view text, std::string_view suffix)
+{
+    return text.size() > suffix.size()
+           && text.substr(text.size() - suffix.size()) == suffix;
+}
+
+
+RingtoneUpload::~RingtoneUpload()
+{
+    if (m_file)
+        m_file.close();
+    if (!m_finished && !m_partPath.empty())
+        SD.remove(m_partPath.c_str());
+    if (!m_finished && m_reserved)
+        freeSpace += m_size;
+}
+
+bool RingtoneUpload::isValidName(std::string_view name)
+{
+    if (name.empty() || name.size() > maxNameLength || name.front() == '.')
+        return false;
+    for (char c : name) {
+        if (!isalnum(c) && c != '_' && c != '-' && c != '.')
+            return false;
+    }
+    return endsWith(name, ".mp3") || endsWith(name, ".wav");
+}
+
+void RingtoneUpload::recover()
+{
+    std::vector<std::string> paths;
+    File root = SD.open(directory);
+
+    // the partial files removed below are counted as free already
+    freeSpace = SD.totalBytes() - SD.usedBytes();
+    if (!root)
+        return;
+    for (File file = root.openNextFile(); file; file = root.openNextFile()) {
+        if (!file.isDirectory())
+            paths.push_back(std::string(directory) + "/" + baseName(file.name()));
+    }
+    root.close();
+
+    for (const std::string &path : paths) {
+        if (endsWith(path, partSuffix)) {
+            SD.remove(path.c_str());
+        } else if (endsWith(path, backupSuffix)) {
+            // the new file is either in place or still a .part, removed above
+            std::string original = path.substr(0, path.size() - strlen(backupSuffix));
+            if (SD.exists(original.c_str())) {
+                SD.remove(path.c_str());
+            } else if (SD.rename(path.c_str(), original.c_str())) {
+                log_w("Restored %s after an interrupted upload", original.c_str());
+            }
+        }
+    }
+}
+
+uint64_t RingtoneUpload::freeBytes()
+{
+    return freeSpace;
+}
+
+bool RingtoneUpload::begin(const std::string &name, size_t size)
+{
+    m_name = name;
+    m_path = std::string(directory) + "/" + name;
+    m_partPath = m_path + partSuffix;
+    m_backupPath = m_path + backupSuffix;
+    m_size = size;
+    m_startTime = esp_timer_get_time();
+    m_startHeap = ESP.getFreeHeap();
+
+    if (!SD.exists(directory) && !SD.mkdir(directory)) {
+        log_e("Could not create the ringtone directory %s", directory);
+        return false;
+    }
+
+    m_file = SD.open(m_partPath.c_str(), FILE_WRITE);
+    if (!m_file) {
+        log_e("Could not create %s", m_partPath.c_str());
+        return false;
+    }
+    // taken until the upload is finished or dropped, so the uploads that
+    // run along with it don't count on the same space
+    freeSpace -= std::min<uint64_t>(size, freeSpace);
+    m_reserved = true;
+    log_i("Receiving ringtone %s, %zu bytes", name.c_str(), size);
+    return true;
+}
+
+bool RingtoneUpload::write(const uint8_t *data, size_t length)
+{
+    length = std::min(length, remaining());
+
+    // the first bytes are kept until there's enough of them to check
+    if (m_received < headerSize) {
+        size_t headerPart = std::min(length, headerSize - m_received);
+        memcpy(m_header + m_received, data, headerPart);
+        if (m_received + headerPart == std::min(headerSize, m_size) && !checkFormat()) {
+            m_formatRejected = true;
+            log_w("Ringtone %s has unsupported format", m_name.c_str());
+            return false;
+        }
+    }
+
+    if (m_file.write(data, length) != length) {
+        log_e("Could not write to %s", m_partPath.c_str());
+        return false;
+    }
+    m_received += length;
+    // the heap could be freed by others meanwhile, that's no use of ours
+    int64_t used = (int64_t)m_startHeap - ESP.getFreeHeap();
+    m_stats.peakHeap = std::max<int64_t>(m_stats.peakHeap, std::max<int64_t>(used, 0));
+    return true;
+}
+
+bool RingtoneUpload::finish()
+{
+    m_file.close();
+
+    // the old ringtone is replaced only by a complete file, and it's kept
+    // until the new one is in place
+    bool replacing = SD.exists(m_path.c_str());
+    size_t replacedSize = 0;
+    if (replacing) {
+        File replaced = SD.open(m_path.c_str(), FILE_READ);
+        replacedSize = replaced ? replaced.size() : 0;
+    }
+    if (replacing && !SD.rename(m_path.c_str(), m_backupPath.c_str())) {
+        log_e("Could not move %s away", m_path.c_str());
+        return false;
+    }
+    if (!SD.rename(m_partPath.c_str(), m_path.c_str())) {
+        log_e("Could not rename %s to %s", m_partPath.c_str(), m_path.c_str());
+        if (replacing)
+            SD.rename(m_backupPath.c_str(), m_path.c_str());
+        return false;
+    }
+    m_finished = true;
+    if (replacing && SD.remove(m_backupPath.c_str()))
+        freeSpace += replacedSize;
+
+    m_stats.bytes = m_received;
+    m_stats.time = esp_timer_get_time() - m_startTime;
+    log_i(
+        "Saved ringtone %s, %u bytes in %u ms, peak heap use %u bytes",
+        m_name.c_str(), m_stats.bytes, m_stats.time / 1000, m_stats.peakHeap
+    );
+    return true;
+}
+
+bool RingtoneUpload::checkFormat() const
+{
+    size_t size = std::min(headerSize, m_size);
+
+    if (m_name.substr(m_name.size() - 4) == ".wav") {
+        return size >= 12 && memcmp(m_header, "RIFF", 4) == 0
+               && memcmp(m_header + 8, "WAVE", 4) == 0;
+    }
+    // an MP3 starts with ID3 tags or right with the sync word of a frame
+    return size >= 3
+           && (memcmp(m_header, "ID3", 3) == 0
+               || (m_header[0] == 0xFF && (m_header[1] & 0xE0) == 0xE0));
+}
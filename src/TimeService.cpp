@@ -0,0 +1,221 @@
+#include "TimeService.hpp"
+
+
+// the edge of an RTC second is polled for starting this long before it's due,
+// plus the drift the rate can accumulate since the last edge
+static const int64_t  edgeLead = 20000;          // us
+static const int32_t  measuredRateError = 5;     // us per second
+static const uint32_t edgePollInterval = 5;      // ms
+static const int      maxEdgeReads = 250;        // a bit more than a second
+// the measured rate is trusted only within the tolerance of the crystal
+static const int32_t  maxRateError = 500;        // us per second
+static const uint32_t minRateInterval = 60;      // s between the edges
+
+
+void TimeService::begin(
+    RTC_DS3231 *rtc, std::shared_ptr<std::mutex> rtcMutex,
+    uint32_t resyncInterval, std::function<void()> onTimeInvalid
+)
+{
+    m_rtc = rtc;
+    m_rtcLock = rtcMutex;  // must be initialized
+    m_resyncInterval = resyncInterval;
+    m_onTimeInvalid = onTimeInvalid;
+
+    // the time may be invalid until it's adjusted from NTP, it's not
+    // reported here since the network is not up yet
+    if (!resync())
+        log_w("RTC time is invalid, it must be adjusted");
+
+    xTaskCreate(
+        methodToTaskFun<TimeService, &TimeService::resyncLoop>(), "TimeResync",
+        3072, this, TASK_NORMAL_PRIORITY, &m_resyncTask
+    );
+    log_i("Started TimeService");
+}
+
+DateTime TimeService::now() const
+{
+    return DateTime(unixtime());
+}
+
+uint32_t TimeService::unixtime() const
+{
+    uint32_t micros;
+    return unixtime(&micros);
+}
+
+uint32_t TimeService::unixtime(uint32_t *micros) const
+{
+    uint32_t seq, baseTime, microsPerSecond;
+    int64_t  baseMicros;
+
+    // retry if the base was being rewritten while it was read
+    do {
+        seq = m_seq.load(std::memory_order_acquire);
+        baseTime = m_baseTime;
+        baseMicros = m_baseMicros;
+        microsPerSecond = m_microsPerSecond;
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((seq & 1) || seq != m_seq.load(std::memory_order_relaxed));
+
+    int64_t elapsed = esp_timer_get_time() - baseMicros;
+    *micros = (elapsed % microsPerSecond) * 1000000 / microsPerSecond;
+    return baseTime + elapsed / microsPerSecond;
+}
+
+int32_t TimeService::adjust(const DateTime &time)
+{
+    std::lock_guard lock(m_writeLock);
+    int64_t micros;
+    uint32_t before;
+
+    {
+        std::lock_guard rtcLock(*m_rtcLock);
+        before = unixtime();
+        m_rtc->adjust(time);
+        micros = esp_timer_get_time();
+    }
+
+    // writing the seconds register restarts the RTC's countdown chain,
+    // so the new time starts right at the edge of a second
+    rebase(time.unixtime(), micros, m_microsPerSecond);
+    m_aligned = true;
+    log_d("Adjusted RTC time");
+    return int32_t(time.unixtime() - before);
+}
+
+TimeService::Stats TimeService::stats()
+{
+    std::lock_guard statsLock(m_statsLock);
+    return m_stats;
+}
+
+bool TimeService::isValid(const DateTime &time)
+{
+    return (time.hour() <= 23) && (time.minute() <= 59) && (time.second() <= 59)
+           && (time.dayOfTheWeek() <= 6) && (time.day() >= 1 && time.day() <= 31)
+           && (time.month() >= 1 && time.month() <= 12)
+           && (time.year() <= 2099);
+}
+
+bool TimeService::resync()
+{
+    std::lock_guard lock(m_writeLock);
+    bool lostPower;
+
+    {
+        std::lock_guard rtcLock(*m_rtcLock);
+        lostPower = m_rtc->lostPower();
+    }
+    countRtcRead();
+
+    // wake up shortly before the second is expected to change,
+    // so the edge is found in a few reads
+    if (m_aligned) {
+        int64_t elapsed = esp_timer_get_time() - m_baseMicros;
+        int64_t untilEdge = m_microsPerSecond - elapsed % m_microsPerSecond;
+        int64_t lead = edgeLead + elapsed / m_microsPerSecond
+                       * (m_rateMeasured ? measuredRateError : maxRateError);
+        if (untilEdge > lead)
+            vTaskDelay(pdMS_TO_TICKS((untilEdge - lead) / 1000));
+    }
+
+    int64_t  lastRead = esp_timer_get_time();
+    DateTime first = readRtc(), current = first;
+    int64_t  edge = lastRead;
+
+    for (int reads = 0; current == first && reads < maxEdgeReads; ++reads) {
+        vTaskDelay(pdMS_TO_TICKS(edgePollInterval));
+        int64_t read = esp_timer_get_time();
+        current = readRtc();
+        // the second has changed somewhere between the two reads
+        edge = (lastRead + read) / 2;
+        lastRead = read;
+    }
+
+    if (lostPower || current == first || !isValid(current)) {
+        log_w(
+            "Lost power: %d, or time is invalid: %d", lostPower,
+            current == first || !isValid(current)
+        );
+        // keep showing what the RTC has until the time is adjusted
+        if (!m_aligned)
+            rebase(current.unixtime(), lastRead, m_microsPerSecond);
+        return false;
+    }
+
+    uint32_t microsPerSecond = m_microsPerSecond;
+    int32_t  correction = 0;
+
+    if (m_aligned) {
+        uint32_t seconds = current.unixtime() - m_baseTime;
+        correction = edge - (m_baseMicros + (int64_t)seconds * m_microsPerSecond);
+
+        if (seconds >= minRateInterval) {
+            int32_t measured = (edge - m_baseMicros) / seconds;
+            if (abs(measured - 1000000) <= maxRateError) {
+                microsPerSecond = measured;
+                m_rateMeasured = true;
+            }
+        }
+    }
+
+    rebase(current.unixtime(), edge, microsPerSecond);
+    m_aligned = true;
+
+    {
+        std::lock_guard statsLock(m_statsLock);
+        m_stats.resyncs++;
+        m_stats.lastCorrection = correction;
+        m_stats.microsPerSecond = microsPerSecond;
+    }
+    log_d(
+        "Resynced with RTC, correction: %d us, rate: %u us/s", correction,
+        microsPerSecond
+    );
+    return true;
+}
+
+void TimeService::resyncLoop()
+{
+    while (true) {
+        vTaskDelay(pdMS_TO_TICKS(m_resyncInterval));
+        if (!resync() && m_onTimeInvalid)
+            m_onTimeInvalid();
+    }
+}
+
+void TimeService::rebase(uint32_t time, int64_t micros, uint32_t microsPerSecond)
+{
+    uint32_t seq = m_seq.load(std::memory_order_relaxed);
+
+    // an odd sequence number tells readers the base is being rewritten
+    m_seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    m_baseTime = time;
+    m_baseMicros = micros;
+    m_microsPerSecond = microsPerSecond;
+    m_seq.store(seq + 2, std::memory_order_release);
+}
+
+DateTime TimeService::readRtc()
+{
+    DateTime time;
+
+    {
+        std::lock_guard rtcLock(*m_rtcLock);
+        time = m_rtc->now();
+    }
+
+    countRtcRead();
+    return time;
+}
+
+void TimeService::countRtcRead()
+{
+    std::lock_guard statsLock(m_statsLock);
+    m_stats.rtcReads++;
+}
+
+TimeService MainTimeService;
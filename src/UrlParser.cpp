@@ -1,15 +1,20 @@
 #include "UrlParser.hpp"
 
+#include <algorithm>
 
-UrlParser::UrlParser(const std::multiset<Endpoint> &endpoints) :
-m_endpoints(endpoints)
-{}
+
+UrlParser::UrlParser(const std::multiset<Endpoint> &endpoints)
+{
+    // the multiset is ordered by priority, equal ones in insertion order
+    for (const Endpoint &endpoint : endpoints)
+        addEndpoint(endpoint);
+}
 
 void UrlParser::addEndpoint(
     const mg_str &method, const mg_str &pattern, int priority, callback_t callback
 )
 {
-    m_endpoints.insert(
+    addEndpoint(
         {priority, std::string(method.ptr, method.len),
          std::string(pattern.ptr, pattern.len), callback}
     );
@@ -17,92 +22,281 @@ void UrlParser::addEndpoint(
 
 void UrlParser::addEndpoint(const Endpoint &endpoint)
 {
-    m_endpoints.insert(endpoint);
+    std::string_view path = trimSlashes(endpoint.pattern);
+    Route route = {m_endpoints.size(), {}, compileFilter(endpoint.filter)};
+    node_t node = 0;
+
+    while (!path.empty()) {
+        std::string_view segment = nextSegment(path);
+
+        if (segment.size() >= 2 && segment.front() == '{' && segment.back() == '}') {
+            route.params.emplace_back(segment.substr(1, segment.size() - 2));
+            if (m_nodes[node].wildcard == noNode) {
+                m_nodes.emplace_back();
+                m_nodes[node].wildcard = m_nodes.size() - 1;
+            }
+            node = m_nodes[node].wildcard;
+        } else {
+            node = addChild(node, segment);
+        }
+    }
+
+    if (route.params.size() > maxParams) {
+        log_e("Pattern %s has more than %u wildcards", endpoint.pattern.c_str(), maxParams);
+        return;
+    }
+    m_endpoints.push_back(endpoint);
+    m_nodes[node].routes.push_back(std::move(route));
 }
 
 void UrlParser::clearEndpoints()
 {
     m_endpoints.clear();
+    m_nodes.assign(1, Node());
 }
 
 UrlParser::Result UrlParser::match(const mg_http_message &request, Response &response)
 {
-    params_t params;
-
-    for (auto endpoint : m_endpoints) {
-        if (mg_vcmp(&request.method, endpoint.method.c_str()) == 0
-            && matchUrl(
-                std::string_view(request.uri.ptr, request.uri.len),
-                endpoint.pattern, params
-            )) {
-            
-            StaticJsonDocument<1024> requestDoc;
-            deserializeJson(requestDoc, request.body.ptr, request.body.len);
-            JsonVariant requestJson = requestDoc.as<JsonVariant>();
-
-            Result result = endpoint(
-                Request{request, params, requestJson},
-                response
-            );
-            
-            if (!result.success) {
-                response.data["error"] = result.error;
-            }
+    std::string_view values[maxParams];
+    Match best;
 
-            return result;
+    matchNode(
+        0, trimSlashes(std::string_view(request.uri.ptr, request.uri.len)),
+        request.method, values, 0, best
+    );
+    if (best.route == nullptr) {
+        response.data = resetResponse(defaultResponseCapacity);
+        return Result(404, "Not Found");
+    }
+
+    Params params;
+    for (size_t i = 0; i < best.route->params.size(); ++i) {
+        params.add(best.route->params[i], best.values[i]);
+    }
+
+    const Endpoint &endpoint = m_endpoints[best.route->endpoint];
+    JsonVariant requestJson;
+    Result result(200);
+
+    response.data = resetResponse(endpoint.responseCapacity);
+
+    if (endpoint.body == JsonBody) {
+        result = parseBody(request.body, *best.route);
+        if (result.success) {
+            requestJson = m_bodyDoc->as<JsonVariant>();
         }
-        params.clear();
+    }
+    if (result.success) {
+        result = endpoint(Request{request, params, requestJson}, response);
+    }
+
+    // don't hold the heap after a large body
+    if (m_bodyDoc && m_bodyDoc->capacity() > keptBodyCapacity) {
+        m_bodyDoc.reset();
+    }
+
+    // a part of the response is worse than none
+    if (m_responseDoc->overflowed()) {
+        log_e(
+            "Response of %s %s doesn't fit in %u bytes", endpoint.method.c_str(),
+            endpoint.pattern.c_str(), endpoint.responseCapacity
+        );
+        result = Result(500, "Response doesn't fit in its document");
+        response.data = resetResponse(defaultResponseCapacity);
+    }
+
+    if (!result.success) {
+        response.data["error"] = result.error;
     }
 
-    return Result(404, "Not Found");
+    return result;
 }
 
-// parses url and returns true if it matches pattern
-// pattern can contain wildcards: {name} to specify any number of characters
-// until the next '/' or end of string
-bool UrlParser::matchUrl(
-    std::string_view url, std::string_view pattern, params_t &params
-)
+// mongoose has the whole body by now, so its length is the Content-Length
+UrlParser::Result UrlParser::parseBody(const mg_str &body, const Route &route)
 {
-    // remove leading and trailing slash from both url and pattern
-    url.remove_prefix(url.front() == '/' ? 1 : 0);
-    url.remove_suffix(url.back() == '/' ? 1 : 0);
-    pattern.remove_prefix(pattern.front() == '/' ? 1 : 0);
-    pattern.remove_suffix(pattern.back() == '/' ? 1 : 0);
-
-    std::string_view::size_type i = 0;
-    std::string_view::size_type j = 0;
-
-    while (i < url.length() && j < pattern.length()) {
-        if (pattern[j] == '{') {
-            // wildcard
-            int wildcardEnd = pattern.find('}', j);
-            if (wildcardEnd == std::string::npos) {
-                return false;
-            }
+    if (body.len > maxBodySize) {
+        return Result(413, "Request body is too large");
+    }
 
-            int urlEnd = url.find('/', i);
+    size_t capacity =
+        std::min(std::max(minBodyCapacity, 5 * body.len / 2), maxBodyCapacity);
+    while (true) {
+        if (!m_bodyDoc || m_bodyDoc->capacity() < capacity) {
+            m_bodyDoc.reset();  // free the old one before allocating
+            m_bodyDoc = std::make_unique<DynamicJsonDocument>(capacity);
+        }
+
+        DeserializationError error = route.filter
+            ? deserializeJson(
+                *m_bodyDoc, body.ptr, body.len,
+                DeserializationOption::Filter(*route.filter)
+            )
+            : deserializeJson(*m_bodyDoc, body.ptr, body.len);
 
-            std::string_view name = pattern.substr(j + 1, wildcardEnd - j - 1);
-            std::string_view value = url.substr(i, urlEnd - i);
-            params.emplace(name, value);
-            // if urlEnd is npos, substr seeks to end of string
+        if (error == DeserializationError::NoMemory && capacity < maxBodyCapacity) {
+            capacity = std::min(2 * capacity, maxBodyCapacity);
+            continue;
+        }
+        if (error == DeserializationError::NoMemory) {
+            return Result(413, "Request body is too large");
+        }
+        if (error && error != DeserializationError::EmptyInput) {
+            return Result(400, std::string("Invalid JSON body: ") + error.c_str());
+        }
+        return Result(200);
+    }
+}
+
+UrlParser::filter_t UrlParser::compileFilter(const char *filter)
+{
+    if (filter == nullptr) {
+        return nullptr;
+    }
+
+    // every value takes at least 2 characters and a slot of 16 bytes,
+    // the strings are copied
+    auto doc = std::make_shared<DynamicJsonDocument>(9 * strlen(filter));
+    DeserializationError error = deserializeJson(*doc, filter);
+    if (error) {
+        log_e("Invalid body filter %s: %s", filter, error.c_str());
+        return nullptr;
+    }
+    doc->shrinkToFit();
+    return doc;
+}
+
+JsonObject UrlParser::resetResponse(size_t capacity)
+{
+    if (!m_responseDoc || m_responseDoc->capacity() < capacity
+        || m_responseDoc->capacity() > std::max(capacity, keptResponseCapacity)) {
+        m_responseDoc.reset();  // free the old one before allocating
+        m_responseDoc = std::make_unique<DynamicJsonDocument>(capacity);
+    }
+    return m_responseDoc->to<JsonObject>();
+}
 
-            if (urlEnd == std::string::npos) {
-                // if url ends with a wildcard match, check if pattern ends with the wildcard
-                return wildcardEnd == pattern.length() - 1;
+UrlParser::node_t UrlParser::addChild(node_t parent, std::string_view segment)
+{
+    auto bySegment = [](const auto &child, std::string_view segment) {
+        return child.first < segment;
+    };
+    auto &children = m_nodes[parent].children;
+    auto it = std::lower_bound(children.begin(), children.end(), segment, bySegment);
+
+    if (it != children.end() && it->first == segment) {
+        return it->second;
+    }
+
+    node_t child = m_nodes.size();
+    m_nodes[parent].children.emplace(it, segment, child);
+    m_nodes.emplace_back();  // invalidates `children`
+    return child;
+}
+
+// tries the literal edge first, then the wildcard, every match is compared
+// with the best one so far, so priorities work across branches
+void UrlParser::matchNode(
+    node_t node, std::string_view path, const mg_str &method,
+    std::string_view *values, size_t depth, Match &best
+) const
+{
+    const Node &current = m_nodes[node];
+
+    if (path.empty()) {
+        for (const Route &route : current.routes) {
+            const std::string &routeMethod = m_endpoints[route.endpoint].method;
+            if (mg_vcmp(&method, routeMethod.c_str()) == 0 && isBetter(route, best)) {
+                best.route = &route;
+                std::copy(values, values + depth, best.values);
             }
+        }
+        return;
+    }
 
-            i = urlEnd;
-            j = wildcardEnd + 1;  // skip the '}'
-        } else if (pattern[j] == url[i]) {
-            i++;
-            j++;
-        } else {
-            return false;
+    std::string_view rest = path;
+    std::string_view segment = nextSegment(rest);
+    auto bySegment = [](const auto &child, std::string_view segment) {
+        return child.first < segment;
+    };
+    auto it = std::lower_bound(
+        current.children.begin(), current.children.end(), segment, bySegment
+    );
+
+    if (it != current.children.end() && it->first == segment) {
+        matchNode(it->second, rest, method, values, depth, best);
+    }
+    if (current.wildcard != noNode && !segment.empty() && depth < maxParams) {
+        values[depth] = segment;
+        matchNode(current.wildcard, rest, method, values, depth + 1, best);
+    }
+}
+
+bool UrlParser::isBetter(const Route &route, const Match &best) const
+{
+    if (best.route == nullptr) {
+        return true;
+    }
+
+    int priority = m_endpoints[route.endpoint].priority;
+    int bestPriority = m_endpoints[best.route->endpoint].priority;
+    return priority < bestPriority
+           || (priority == bestPriority && route.endpoint < best.route->endpoint);
+}
+
+std::string_view UrlParser::trimSlashes(std::string_view path)
+{
+    if (!path.empty() && path.front() == '/') {
+        path.remove_prefix(1);
+    }
+    if (!path.empty() && path.back() == '/') {
+        path.remove_suffix(1);
+    }
+    return path;
+}
+
+std::string_view UrlParser::nextSegment(std::string_view &path)
+{
+    size_t end = path.find('/');
+    std::string_view segment = path.substr(0, end);
+
+    path.remove_prefix(end == std::string_view::npos ? path.size() : end + 1);
+    return segment;
+}
+
+void UrlParser::Params::add(std::string_view name, std::string_view value)
+{
+    // patterns with more wildcards are rejected by addEndpoint()
+    m_names[m_size] = name;
+    m_values[m_size] = value;
+    ++m_size;
+}
+
+bool UrlParser::Params::get(std::string_view name, std::string_view &value) const
+{
+    for (size_t i = 0; i < m_size; ++i) {
+        if (m_names[i] == name) {
+            value = m_values[i];
+            return true;
         }
     }
+    return false;
+}
 
-    // if i and j reached ends of url and pattern, it's a match
-    return i >= url.length() && j >= pattern.length();
-}
\ No newline at end of file
+bool UrlParser::Params::u64(std::string_view name, uint64_t &value) const
+{
+    std::string_view digits;
+
+    if (!get(name, digits) || digits.empty()) {
+        return false;
+    }
+
+    value = 0;
+    for (char c : digits) {
+        if (c < '0' || c > '9' || value > (UINT64_MAX - (c - '0')) / 10) {
+            return false;
+        }
+        value = value * 10 + (c - '0');
+    }
+    return true;
+}
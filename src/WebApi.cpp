@@ -1,21 +1,209 @@
 #include "WebApi.hpp"
+#include "BodyWriters.hpp"
+
+#include <map>
+#include <memory>
+#include <optional>
 
 using Result = UrlParser::Result;
 
+// fields of the request bodies, the rest isn't parsed
+#define ALARM_FIELDS \
+    "{\"time\":true,\"daysOfWeek\":true,\"enabled\":true,\"ringtone\":true}"
+static const char alarmFilter[] = ALARM_FIELDS;
+static const char alarmsFilter[] = "[" ALARM_FIELDS "]";
+static const char volumeFilter[] = "{\"volume\":true}";
+#undef ALARM_FIELDS
+
+// response documents larger than the default one, the arrays that grow
+// with the alarms or the ringtones are streamed instead
+static const size_t statsCapacity = JSON_OBJECT_SIZE(21);
+// the stages after the interrupt and the two totals
+static const size_t latencyStatsCapacity =
+    JSON_OBJECT_SIZE(3) + JSON_ARRAY_SIZE(LatencyTrace::stageCount + 1)
+    + (LatencyTrace::stageCount + 1) * JSON_OBJECT_SIZE(5);
+static const size_t audioStatsCapacity =
+    JSON_OBJECT_SIZE(10) + 5 * JSON_OBJECT_SIZE(2);
+
 UrlParser ApiUrlParser({
     {1, "GET",    "/alarms",                      api::getAlarms},
-    {1, "POST",   "/alarms",                      api::addAlarm},
+    {1, "POST",   "/alarms",                      api::addAlarm,
+        UrlParser::JsonBody, alarmFilter},
+    {1, "POST",   "/alarms/batch",                api::addAlarms,
+        UrlParser::JsonBody, alarmsFilter},
     {1, "DELETE", "/alarms/{id}",                 api::removeAlarm},
-    {1, "PATCH",  "/alarms/{id}",                 api::updateAlarm},
+    {1, "PATCH",  "/alarms/{id}",                 api::updateAlarm,
+        UrlParser::JsonBody, alarmFilter},
     {1, "GET",    "/alarms/{id}/enable",          api::setAlarmState},
     {1, "GET",    "/alarms/{id}/disable",         api::setAlarmState},
     {1, "GET",    "/alarms/{id}/clearMissedFlag", api::clearMissedFlag},
-    {1, "PUT",    "/volume",                      api::setVolume},
-    {1, "GET",    "/printAlarms",                 api::printAlarms}
+    {1, "PUT",    "/volume",                      api::setVolume,
+        UrlParser::JsonBody, volumeFilter},
+    {1, "GET",    "/printAlarms",                 api::printAlarms},
+    {1, "GET",    "/stats",                       api::getStats,
+        UrlParser::NoBody, nullptr, statsCapacity},
+    {1, "GET",    "/stats/latency",               api::getLatencyStats,
+        UrlParser::NoBody, nullptr, latencyStatsCapacity},
+    {1, "GET",    "/stats/audio",                 api::getAudioStats,
+        UrlParser::NoBody, nullptr, audioStatsCapacity},
+    {1, "GET",    "/ringtones",                   api::getRingtones}
 });
 
-static_assert(sizeof(unsigned long long) >= sizeof(Alarm::id_t));
-// WebApi.cpp uses std::stoull, so alarm id must fit in unsigned long long
+// ids in urls are parsed as uint64_t
+static_assert(sizeof(uint64_t) >= sizeof(Alarm::id_t));
+
+using AlarmTime = AlarmService::AlarmTime;
+
+/*
+ * Parsers of the body fields for the schemas (see RequestSchema.hpp),
+ * each one returns the error of its field
+ */
+
+struct TimeParser {
+    // 1 or 2 digits, up to `max`
+    static bool parseNumber(const char *&text, byte max, byte &value)
+    {
+        int digits = 0;
+
+        value = 0;
+        for (; digits < 2 && isdigit(*text); ++digits) {
+            value = value * 10 + (*text++ - '0');
+        }
+        return digits != 0 && value <= max;
+    }
+
+    static Result parse(JsonVariant json, AlarmTime &time)
+    {
+        const char *text = json.as<const char *>();
+
+        if (text == nullptr || !parseNumber(text, 23, time.hour) || *text++ != ':'
+            || !parseNumber(text, 59, time.minute) || *text != '\0') {
+            return httpResult::invalidTimeField;
+        }
+        return httpResult::OK;
+    }
+};
+
+struct DaysOfWeekParser {
+    static Result parse(JsonVariant json, uint8_t &daysMask)
+    {
+        if (!json.is<JsonArray>()) {
+            return httpResult::invalidDaysOfWeekField;
+        }
+
+        Alarm::DaysOfWeek days(Alarm::DaysOfWeek::noDays);
+        byte day = 0;
+        for (JsonVariant value : json.as<JsonArray>()) {
+            if (day == 7) {
+                return httpResult::invalidDaysOfWeekField;
+            }
+            days.set(day++, value.as<bool>());
+        }
+        if (day != 7) {
+            return httpResult::invalidDaysOfWeekField;
+        }
+
+        daysMask = days.daysMask;
+        return httpResult::OK;
+    }
+};
+
+struct EnabledParser {
+    static Result parse(JsonVariant json, bool &enabled)
+    {
+        if (!json.is<bool>()) {
+            return httpResult::invalidEnabledField;
+        }
+        enabled = json.as<bool>();
+        return httpResult::OK;
+    }
+};
+
+/* Looks up the ringtone by its name, null is the default ringtone */
+struct RingtoneParser {
+    static Result parse(JsonVariant json, uint16_t &ringtone)
+    {
+        if (json.isNull()) {
+            ringtone = RingtoneLibrary::defaultRingtone;
+            return httpResult::OK;
+        }
+        if (!json.is<const char *>()) {
+            return httpResult::invalidRingtoneField;
+        }
+
+        ringtone = MainRingtoneLibrary.find(json.as<const char *>());
+        if (ringtone == RingtoneLibrary::defaultRingtone) {
+            return httpResult::ringtoneNotFound;
+        }
+        return httpResult::OK;
+    }
+};
+
+struct VolumeParser {
+    static Result parse(JsonVariant json, int &volume)
+    {
+        if (!json.is<int>()) {
+            return httpResult::invalidVolumeField;
+        }
+        volume = json.as<int>();
+        if (volume < 0 || volume > 100) {
+            return httpResult::invalidVolumeField;
+        }
+        return httpResult::OK;
+    }
+};
+
+/* Body of POST /alarms and an element of POST /alarms/batch */
+struct NewAlarm {
+    AlarmTime time;
+    uint8_t   daysOfWeek;
+    bool      enabled;
+    uint16_t  ringtone = RingtoneLibrary::defaultRingtone;
+};
+
+static constexpr auto newAlarmSchema = schema::make<NewAlarm>(
+    schema::required<TimeParser>("time", &NewAlarm::time),
+    schema::required<DaysOfWeekParser>("daysOfWeek", &NewAlarm::daysOfWeek),
+    schema::required<EnabledParser>("enabled", &NewAlarm::enabled),
+    schema::optional<RingtoneParser>("ringtone", &NewAlarm::ringtone)
+);
+
+/* Body of PATCH /alarms/{id}, only the fields that are there change */
+using AlarmChanges = AlarmService::AlarmChanges;
+
+static constexpr auto alarmChangesSchema = schema::make<AlarmChanges>(
+    schema::optional<TimeParser>("time", &AlarmChanges::time),
+    schema::optional<DaysOfWeekParser>("daysOfWeek", &AlarmChanges::daysOfWeek),
+    schema::optional<RingtoneParser>("ringtone", &AlarmChanges::ringtone)
+);
+
+/* Body of PUT /volume */
+struct VolumeChange {
+    int volume;
+};
+
+static constexpr auto volumeChangeSchema = schema::make<VolumeChange>(
+    schema::required<VolumeParser>("volume", &VolumeChange::volume)
+);
+
+/**
+ * Parses alarm fields (as in POST /alarms) and appends the alarm to `alarms`
+ */
+static Result parseAlarm(JsonVariant jsonData, std::vector<Alarm> &alarms)
+{
+    NewAlarm fields;
+
+    Result result = newAlarmSchema.parse(jsonData, fields);
+    if (!result.success) {
+        return result;
+    }
+
+    Alarm &alarm = alarms.emplace_back(
+        fields.time.hour, fields.time.minute, fields.daysOfWeek, fields.enabled
+    );
+    alarm.ringtone = fields.ringtone;
+    return httpResult::OK;
+}
 
 /**
  * sample request:
@@ -23,7 +211,8 @@ static_assert(sizeof(unsigned long long) >= sizeof(Alarm::id_t));
  * {
  *      "time": "12:00",
  *      "daysOfWeek": [true, true, false, false, true, flase, true],
- *      "enabled": true  // optional, defaults to false
+ *      "enabled": true,  // optional, defaults to false
+ *      "ringtone": "morning.mp3"  // optional, null is the default ringtone
  * }
  * 
  * sample response:
@@ -35,52 +224,76 @@ UrlParser::Result api::addAlarm(
     const UrlParser::Request &request, UrlParser::Response &response
 )
 {
-    JsonVariant jsonData = request.data;
-    bool enabled = false;
+    std::vector<Alarm> newAlarms;
 
-    if (jsonData.containsKey("enabled")) {
-        if (jsonData["enabled"].is<bool>()) {
-            enabled = jsonData["enabled"].as<bool>();
-        } else {
-            return httpResult::invalidEnabledField;
-        }
-    } else {
-        return httpResult::missingField("enabled");
+    Result result = parseAlarm(request.data, newAlarms);
+    if (!result.success) {
+        return result;
     }
 
-    if (!jsonData.containsKey("daysOfWeek")) {
-        return httpResult::missingField("daysOfWeek");
-    } else if (!jsonData["time"].is<const char *>()) {
-        return httpResult::invalidTimeField;
+    Alarm::id_t id = MainAlarmService.addAlarm(newAlarms.front()).get();
+    if (id == 0) {
+        return httpResult::tooManyAlarms;
     }
 
-    const char * const alarmTime = jsonData["time"].as<const char *>();
-    byte hour, minute;
-
-    if (sscanf(alarmTime, "%hhu:%hhu", &hour, &minute) != 2) {
-        return httpResult::invalidTimeField;
-    };
+    response.data["id"] = id;
+    return httpResult::CREATED;
+}
 
-    if (!jsonData.containsKey("daysOfWeek")) {
-        return httpResult::missingField("daysOfWeek");
-    } else if (!jsonData["daysOfWeek"].is<JsonArray>()) {
-        return httpResult::invalidDaysOfWeekField;
+/**
+ * sample request:
+ * POST /alarms/batch
+ * [
+ *     {
+ *         "time": "12:00",
+ *         "daysOfWeek": [true, true, false, false, true, flase, true],
+ *         "enabled": true
+ *     },
+ *     {
+ *         "time": "13:00",
+ *         "daysOfWeek": [false, false, false, false, false, false, false],
+ *         "enabled": false
+ *     }
+ * ]
+ *
+ * sample response:
+ * {
+ *     "ids": [1337, 31337]
+ * }
+ *
+ * Either all alarms are added or none of them if any is invalid
+ * or there would be too many of them
+ */
+UrlParser::Result api::addAlarms(
+    const UrlParser::Request &request, UrlParser::Response &response
+)
+{
+    if (!request.data.is<JsonArray>()) {
+        return httpResult::invalidAlarmsArray;
     }
 
-    JsonArray daysOfWeek = jsonData["daysOfWeek"].as<JsonArray>();
-    if (daysOfWeek.size() != 7) {
-        return httpResult::invalidDaysOfWeekField;
+    JsonArray alarmsJson = request.data.as<JsonArray>();
+    std::vector<Alarm> newAlarms;
+    newAlarms.reserve(alarmsJson.size());
+
+    for (JsonVariant alarmJson : alarmsJson) {
+        Result result = parseAlarm(alarmJson, newAlarms);
+        if (!result.success) {
+            return Result(
+                result.code,
+                "Alarm " + std::to_string(newAlarms.size()) + ": " + result.error
+            );
+        }
     }
 
-    Alarm::DaysOfWeek days(0);
-    for (byte i = 0; i < 7; ++i) {
-        days.set(i, daysOfWeek[i].as<bool>());
+    std::vector<Alarm::id_t> ids = MainAlarmService.addAlarms(newAlarms).get();
+    if (ids.size() != newAlarms.size()) {
+        return httpResult::tooManyAlarms;
     }
 
-    Alarm newAlarm(hour, minute, days, enabled);
-    Alarm::id_t id = MainAlarmService.addAlarm(newAlarm);
-
-    response.data["id"] = id;
+    // the ids of a large batch don't fit in the response document
+    response.headers += "Content-Type: application/json\r\n";
+    response.body = std::make_unique<IdsWriter>(std::move(ids));
     return httpResult::CREATED;
 }
 
@@ -95,14 +308,16 @@ UrlParser::Result api::addAlarm(
  *        "time": "12:00",
  *        "daysOfWeek": [true, true, false, false, true, flase, true],
  *        "enabled": false,
- *        "missed": true
+ *        "missed": true,
+ *        "ringtone": "morning.mp3"
  *     },
  *     {
  *        "id": 31337,
  *        "time": "13:00",
  *        "daysOfWeek": [true, true, false, false, true, flase, true],
  *        "enabled": true,
- *        "missed": false
+ *        "missed": false,
+ *        "ringtone": null  // the default ringtone
  *     }
  * ]
  */
@@ -110,26 +325,14 @@ Result api::getAlarms(
     const UrlParser::Request &request, UrlParser::Response &response
 )
 {
-    JsonArray alarms = response.data.to<JsonArray>();
-
-    for (auto &val : MainAlarmService.getAlarms()) {
-        Alarm &alarm = *val.second;
-        JsonObject alarmJson = alarms.createNestedObject();
-        alarmJson["id"] = alarm.id();
-
-        char time[6];  // "hh:mm" + "\0"
-        // always produces 6-chrachter string even if alarm is invalid
-        sprintf(time, "%02hhu:%02hhu", alarm.hour % 100, alarm.minute % 100);
-        alarmJson["time"] = time;
-        
-        JsonArray daysOfWeek = alarmJson.createNestedArray("daysOfWeek");
-        for (byte i = 0; i < 7; ++i) {
-            daysOfWeek.add(alarm.daysOfWeek.isSet(i));
-        }
-        alarmJson["enabled"] = alarm.enabled;
-        alarmJson["missed"] = alarm.isMissed();
-    }
-
+    // the snapshot is immutable, so it's sent without blocking alarms,
+    // however long it takes
+    AlarmService::SnapshotPtr snapshot = MainAlarmService.getAlarms();
+
+    response.headers += "Content-Type: application/json\r\n";
+    response.headers += "ETag: \"" + std::to_string(snapshot->version) + "\"\r\n";
+    response.body =
+        std::make_unique<AlarmsWriter>(snapshot, MainRingtoneLibrary.catalog());
     return httpResult::OK;
 }
 
@@ -143,14 +346,11 @@ Result api::removeAlarm(
 {
     Alarm::id_t id;
 
-    try {
-        id = std::stoull(request.urlParams.at("id"));
-    }
-    catch (std::exception &e) {
+    if (!request.urlParams.u64("id", id)) {
         return httpResult::invalidId;
     }
 
-    if (!MainAlarmService.removeAlarm(id)) {
+    if (!MainAlarmService.removeAlarm(id).get()) {
         return httpResult::alarmNotFound(id);
     }
 
@@ -169,6 +369,12 @@ Result api::removeAlarm(
  * {
  *     "daysOfWeek": [true, true, false, false, true, flase, true]
  * }
+ *
+ * sample request 3:
+ * PATCH /alarms/{id}
+ * {
+ *     "ringtone": "morning.mp3"  // null for the default ringtone
+ * }
  * 
  * TODO should I add enabling/disabling alarm throung this endpoint?
  */
@@ -176,52 +382,22 @@ Result api::updateAlarm(
     const UrlParser::Request &request, UrlParser::Response &response
 )
 {
-    JsonVariant jsonData = request.data;
+    AlarmChanges changes;
     Alarm::id_t id;
 
-    try {
-        id = std::stoull(request.urlParams.at("id"));
-    }
-    catch (std::exception &e) {
+    if (!request.urlParams.u64("id", id)) {
         return httpResult::invalidId;
     }
 
-    if (jsonData.containsKey("time")){
-        if (jsonData["time"].is<const char *>()){
-
-            const char * alarmTime = jsonData["time"].as<const char *>();
-            byte hour, minute;
-
-            if (sscanf(alarmTime, "%hhu:%hhu", &hour, &minute) != 2) {
-                return httpResult::invalidTimeField;
-            }
-
-            if (!MainAlarmService.setAlarmTime(id, hour, minute)) {
-                return httpResult::alarmNotFound(id);
-            }
-
-        } else {
-            return httpResult::invalidTimeField;
-        }
+    // nothing changes unless all of the fields are valid
+    Result result = alarmChangesSchema.parse(request.data, changes);
+    if (!result.success) {
+        return result;
     }
 
-    if (jsonData.containsKey("daysOfWeek")) {
-        if (!jsonData["daysOfWeek"].is<JsonArray>()) {
-            return httpResult::invalidDaysOfWeekField;
-        }
-        JsonArray daysOfWeek = jsonData["daysOfWeek"].as<JsonArray>();
-
-        if (daysOfWeek.size() != 7) {
-            return httpResult::invalidDaysOfWeekField;
-        }
-
-        Alarm::DaysOfWeek days = 0;
-        for (byte i = 0; i < 7; ++i) {
-            days.set(i, daysOfWeek[i].as<bool>());
-        }
-        if (!MainAlarmService.setAlarmDaysOfWeek(id, days)) {
-            return httpResult::alarmNotFound(id);
-        }
+    // all of the fields change at once, nobody sees a half-updated alarm
+    if (!MainAlarmService.updateAlarm(id, changes).get()) {
+        return httpResult::alarmNotFound(id);
     }
 
     return httpResult::NO_CONTENT;
@@ -240,10 +416,7 @@ Result api::setAlarmState(
 {
     Alarm::id_t id;
 
-    try {
-        id = std::stoull(request.urlParams.at("id"));
-    }
-    catch (std::exception &e) {
+    if (!request.urlParams.u64("id", id)) {
         return httpResult::invalidId;
     }
     
@@ -252,7 +425,7 @@ Result api::setAlarmState(
     // so check the last url part
     bool enable = uri.substr(uri.find_last_of('/') + 1) == "enable";
 
-    if (!MainAlarmService.setAlarmState(id, enable)) {
+    if (!MainAlarmService.setAlarmState(id, enable).get()) {
         return httpResult::alarmNotFound(id);
     }
 
@@ -270,25 +443,15 @@ Result api::setVolume(
     const UrlParser::Request &request, UrlParser::Response &response
 )
 {
-    JsonVariant jsonData = request.data;
+    VolumeChange fields;
 
-    if (!jsonData.containsKey("volume")) {
-        return httpResult::missingField("volume");
+    Result result = volumeChangeSchema.parse(request.data, fields);
+    if (!result.success) {
+        return result;
     }
 
-    if (jsonData["volume"].is<int>()) {
-
-        int volume = jsonData["volume"].as<int>();
-        if (volume < 0 || volume > 100) {
-            return httpResult::invalidVolumeField;
-        }
-
-        MainAlarmService.setVolume(map(volume, 0, 100, 0, 21));
-        return httpResult::NO_CONTENT;
-
-    } else {
-        return httpResult::invalidVolumeField;
-    }
+    MainAlarmService.setVolume(map(fields.volume, 0, 100, 0, 21));
+    return httpResult::NO_CONTENT;
 }
 
 /**
@@ -301,14 +464,11 @@ Result api::clearMissedFlag(
 {
     Alarm::id_t id;
 
-    try {
-        id = std::stoull(request.urlParams.at("id"));
-    }
-    catch (std::exception &e) {
+    if (!request.urlParams.u64("id", id)) {
         return httpResult::invalidId;
     }
 
-    if (!MainAlarmService.clearMissedFlag(id)) {
+    if (!MainAlarmService.clearMissedFlag(id).get()) {
         return httpResult::alarmNotFound(id);
     }
 
@@ -321,4 +481,396 @@ Result api::printAlarms(
 {
     MainAlarmService.dumpAlarms();
     return httpResult::NO_CONTENT;
-}
\ No newline at end of file
+}
+
+/**
+ * sample request:
+ * GET /stats
+ *
+ * sample response:
+ * {
+ *     "fired": 12,
+ *     "skipped": 1,
+ *     "missed": 3,
+ *     "events": 20,
+ *     "mutations": 35,
+ *     "flushes": 18,  // batches of mutations written to the RTC and SD
+ *     "wakeups": 41,
+ *     "avgEventTime": 1840,  // us
+ *     "maxEventTime": 5120,  // us
+ *     "lastRearmTime": 2310, // us
+ *     "maxRearmTime": 4020,  // us
+ *     "rtcReads": 96,        // time reads over I2C since boot
+ *     "rtcReadsPerMinute": 0.8,
+ *     "rtcResyncs": 12,
+ *     "clockCorrection": -140,  // us, at the last resync
+ *     "clockRate": 1000012,  // esp_timer us in an RTC second
+ *     "storeRecords": 40,
+ *     "storeCompactions": 1,
+ *     "storeCorruptRecords": 0,
+ *     "storeLoadTime": 8200,  // us
+ *     "storeWriteAmplification": 21.3  // SD bytes written per record byte
+ * }
+ *
+ * the player has its own stats, see GET /stats/audio
+ */
+Result api::getStats(
+    const UrlParser::Request &request, UrlParser::Response &response
+)
+{
+    AlarmService::Stats stats = MainAlarmService.stats();
+
+    response.data["fired"] = stats.fired;
+    response.data["skipped"] = stats.skipped;
+    response.data["missed"] = stats.missed;
+    response.data["events"] = stats.events;
+    response.data["mutations"] = stats.mutations;
+    response.data["flushes"] = stats.flushes;
+    response.data["wakeups"] = stats.wakeups;
+    response.data["avgEventTime"] =
+        stats.wakeups != 0 ? stats.totalEventTime / stats.wakeups : 0;
+    response.data["maxEventTime"] = stats.maxEventTime;
+    response.data["lastRearmTime"] = stats.lastRearmTime;
+    response.data["maxRearmTime"] = stats.maxRearmTime;
+
+    TimeService::Stats timeStats = MainTimeService.stats();
+
+    response.data["rtcReads"] = timeStats.rtcReads;
+    response.data["rtcReadsPerMinute"] = timeStats.rtcReads * 60000.0 / millis();
+    response.data["rtcResyncs"] = timeStats.resyncs;
+    response.data["clockCorrection"] = timeStats.lastCorrection;
+    response.data["clockRate"] = timeStats.microsPerSecond;
+
+    AlarmStore::Stats storeStats = MainAlarmService.storeStats().get();
+
+    response.data["storeRecords"] = storeStats.records;
+    response.data["storeCompactions"] = storeStats.compactions;
+    response.data["storeCorruptRecords"] = storeStats.corruptRecords;
+    response.data["storeLoadTime"] = storeStats.loadTime;
+    response.data["storeWriteAmplification"] =
+        storeStats.recordBytes != 0
+            ? (float)storeStats.sectorBytes / storeStats.recordBytes : 0;
+
+    return httpResult::OK;
+}
+
+/**
+ * sample request:
+ * GET /stats/audio
+ *
+ * sample response:
+ * {
+ *     "starts": 12,
+ *     "startLatency": {"last": 21800, "max": 48200},  // to the first frame, us
+ *     "stops": 12,
+ *     "stopLatency": {"last": 301200, "max": 312800},  // with the fade out, us
+ *     "underruns": 0,  // times the output ran out of samples
+ *     "loops": 14,
+ *     "reconnects": 0,  // loops that had to reopen the file
+ *     "loopGapSamples": {"last": 0, "max": 0},  // silence at the loops
+ *     "pumpWakeupsPerSecond": {"idle": 0.0, "playing": 21.4},
+ *     "pumpCpu": {"idle": 0.0, "playing": 31.2}  // % of the time in the state
+ * }
+ */
+Result api::getAudioStats(
+    const UrlParser::Request &request, UrlParser::Response &response
+)
+{
+    AudioLooper::Stats audioStats = MainAlarmService.audioStats();
+    auto addLastMax = [&](const char *name, uint32_t last, uint32_t max) {
+        JsonObject stat = response.data.createNestedObject(name);
+        stat["last"] = last;
+        stat["max"] = max;
+    };
+
+    response.data["starts"] = audioStats.starts;
+    addLastMax("startLatency", audioStats.lastStartLatency, audioStats.maxStartLatency);
+    response.data["stops"] = audioStats.stops;
+    addLastMax("stopLatency", audioStats.lastStopLatency, audioStats.maxStopLatency);
+    response.data["underruns"] = audioStats.underruns;
+    response.data["loops"] = audioStats.loops;
+    response.data["reconnects"] = audioStats.reconnects;
+    addLastMax("loopGapSamples", audioStats.lastGapSamples, audioStats.maxGapSamples);
+
+    JsonObject wakeups = response.data.createNestedObject("pumpWakeupsPerSecond");
+    JsonObject cpu = response.data.createNestedObject("pumpCpu");
+    for (int playing = 0; playing < 2; ++playing) {
+        const char *state = playing ? "playing" : "idle";
+        uint64_t time = audioStats.totalTime[playing];
+
+        wakeups[state] = time != 0 ? audioStats.wakeups[playing] * 1e6 / time : 0;
+        cpu[state] = time != 0 ? audioStats.busyTime[playing] * 100.0 / time : 0;
+    }
+
+    return httpResult::OK;
+}
+
+/**
+ * sample request:
+ * GET /stats/latency
+ *
+ * sample response:
+ * {
+ *     "firings": 12,      // RTC interrupts since boot
+ *     "lostEvents": 0,    // trace events overwritten before they were read
+ *     "stages": [         // each stage is measured from the previous one, us
+ *         {"stage": "dequeue", "count": 12, "p50": 95, "p99": 180, "max": 180},
+ *         {"stage": "rearm", "count": 12, "p50": 2303, "p99": 2950, "max": 2950},
+ *         {"stage": "dispatch", ...},
+ *         {"stage": "wakeup", ...},
+ *         {"stage": "open", ...},    // the player wasn't primed
+ *         {"stage": "resume", ...},  // the player was primed
+ *         {"stage": "firstFrame", ...},
+ *         // from the interrupt to the first frame
+ *         {"stage": "total", ...},
+ *         {"stage": "totalPrimed", ...}
+ *     ]
+ * }
+ */
+Result api::getLatencyStats(
+    const UrlParser::Request &request, UrlParser::Response &response
+)
+{
+    response.data["firings"] = MainLatencyTrace.firings();
+    response.data["lostEvents"] = MainLatencyTrace.lostEvents();
+
+    JsonArray stages = response.data.createNestedArray("stages");
+    auto addSummary = [&](const char *name, LatencyTrace::Summary summary) {
+        JsonObject stageJson = stages.createNestedObject();
+
+        stageJson["stage"] = name;
+        stageJson["count"] = summary.count;
+        stageJson["p50"] = summary.p50;
+        stageJson["p99"] = summary.p99;
+        stageJson["max"] = summary.max;
+    };
+
+    // the interrupt starts a firing, it has no latency of its own
+    for (int i = LatencyTrace::Dequeued; i < LatencyTrace::stageCount; ++i) {
+        auto stage = (LatencyTrace::Stage)i;
+        addSummary(LatencyTrace::stageName(stage), MainLatencyTrace.summary(stage));
+    }
+    addSummary("total", MainLatencyTrace.total(false));
+    addSummary("totalPrimed", MainLatencyTrace.total(true));
+
+    return httpResult::OK;
+}
+
+/**
+ * sample request:
+ * GET /ringtones
+ *
+ * sample response:
+ * [
+ *     {
+ *         "name": "morning.mp3",
+ *         "size": 3145728,
+ *         "codec": "mp3",
+ *         "sampleRate": 44100,
+ *         "duration": 196310,  // ms
+ *         "available": true    // false if the file is gone or can't be played
+ *     }
+ * ]
+ */
+Result api::getRingtones(
+    const UrlParser::Request &request, UrlParser::Response &response
+)
+{
+    // the catalog is immutable, the index can be written meanwhile
+    response.headers += "Content-Type: application/json\r\n";
+    response.body = std::make_unique<RingtonesWriter>(MainRingtoneLibrary.catalog());
+    return httpResult::OK;
+}
+
+static const size_t ringtoneWriteChunk = 4096;  // whole SD sectors
+
+// true if the message is PUT /ringtones/{name}, sets `name`
+static bool isRingtoneUpload(const mg_http_message &msg, std::string &name)
+{
+    const std::string_view prefix = "/ringtones/";
+    std::string_view uri(msg.uri.ptr, msg.uri.len);
+
+    if (mg_vcmp(&msg.method, "PUT") != 0 || uri.substr(0, prefix.size()) != prefix)
+        return false;
+    name = uri.substr(prefix.size());
+    return true;
+}
+
+static void replyRingtone(
+    mg_connection *conn, const UrlParser::Result &result,
+    const RingtoneUpload *upload
+)
+{
+    StaticJsonDocument<256> doc;
+    char buf[256];
+
+    if (!result.success) {
+        doc["error"] = result.error;
+    } else {
+        const RingtoneUpload::Stats &stats = upload->stats();
+        doc["name"] = upload->name();
+        doc["size"] = stats.bytes;
+        doc["throughput"] = stats.time != 0 ? stats.bytes * 1e6 / 1024 / stats.time : 0;
+        doc["peakHeap"] = stats.peakHeap;
+    }
+    serializeJson(doc, buf, sizeof(buf));
+    // the rest of a rejected body isn't read, the connection is closed
+    mg_http_reply(
+        conn, result.code,
+        "Content-Type: application/json\r\nConnection: close\r\n", "%s", buf
+    );
+    conn->is_draining = 1;
+}
+
+// checks the request and opens the upload, replies if it can't be accepted
+static std::unique_ptr<RingtoneUpload>
+    beginRingtone(mg_connection *conn, const mg_http_message &msg, std::string &name)
+{
+    auto upload = std::make_unique<RingtoneUpload>();
+
+    if (mg_http_get_header(const_cast<mg_http_message *>(&msg), "Content-Length") == nullptr) {
+        replyRingtone(conn, httpResult::lengthRequired, nullptr);
+        return nullptr;
+    }
+    if (!RingtoneUpload::isValidName(name)) {
+        replyRingtone(conn, httpResult::invalidRingtoneName, nullptr);
+        return nullptr;
+    }
+    if (!MainRingtoneLibrary.canAdd(name)) {
+        replyRingtone(conn, httpResult::ringtoneNameTaken, nullptr);
+        return nullptr;
+    }
+    if (msg.body.len == 0) {
+        replyRingtone(conn, httpResult::emptyRingtone, nullptr);
+        return nullptr;
+    }
+    if (RingtoneUpload::freeBytes() < msg.body.len) {
+        replyRingtone(conn, httpResult::insufficientStorage, nullptr);
+        return nullptr;
+    }
+    if (!upload->begin(name, msg.body.len)) {
+        replyRingtone(conn, httpResult::ringtoneWriteFailed, nullptr);
+        return nullptr;
+    }
+    return upload;
+}
+
+// writes the data, replies once the upload is rejected or complete
+static bool writeRingtone(
+    mg_connection *conn, RingtoneUpload &upload, const uint8_t *data, size_t length
+)
+{
+    if (!upload.write(data, length)) {
+        replyRingtone(
+            conn,
+            upload.formatRejected() ? httpResult::unsupportedRingtoneFormat
+                                    : httpResult::ringtoneWriteFailed,
+            nullptr
+        );
+        return false;
+    }
+    if (!upload.isComplete())
+        return true;
+
+    // the file is parsed once, alarms can pick it right after the reply;
+    // a player primed with the replaced file opens the new one
+    if (upload.finish() && MainRingtoneLibrary.update(upload.name())) {
+        MainAlarmService.reprimePlayer();
+        replyRingtone(conn, httpResult::CREATED, &upload);
+    } else if (upload.isFinished()) {
+        replyRingtone(conn, httpResult::unsupportedRingtoneFormat, nullptr);
+    } else {
+        replyRingtone(conn, httpResult::ringtoneWriteFailed, nullptr);
+    }
+    return false;
+}
+
+/**
+ * sample request:
+ * PUT /ringtones/morning.mp3
+ * Content-Length: 3145728
+ *
+ * <MP3 or WAV file>
+ *
+ * sample response:
+ * {
+ *     "name": "morning.mp3",
+ *     "size": 3145728,
+ *     "throughput": 412.5,  // KB/s
+ *     "peakHeap": 6144      // bytes of heap used by the upload at most
+ * }
+ *
+ * The body is written to the SD card as it's received, in chunks of
+ * whole sectors taken right from mongoose's receive buffer, so it's handled
+ * here instead of UrlParser, which needs the whole body in memory.
+ */
+bool api::streamRingtone(mg_connection *conn, int evt, void *evtData)
+{
+    // by connection id, an unfinished upload removes its file when erased
+    static std::map<unsigned long, std::unique_ptr<RingtoneUpload>> uploads;
+    std::string name;
+
+    switch (evt) {
+    case MG_EV_CLOSE:
+        uploads.erase(conn->id);
+        return false;
+
+    case MG_EV_HTTP_MSG: {
+        // a body that came in one read is parsed by mongoose before
+        // MG_EV_READ gets to it
+        mg_http_message *msg = (mg_http_message *)evtData;
+        if (!isRingtoneUpload(*msg, name))
+            return false;
+
+        auto upload = beginRingtone(conn, *msg, name);
+        if (upload)
+            writeRingtone(conn, *upload, (const uint8_t *)msg->body.ptr, msg->body.len);
+        return true;
+    }
+
+    case MG_EV_READ:
+        if (conn->pfn == NULL && uploads.count(conn->id) == 0) {
+            conn->recv.len = 0;  // the rest of a rejected or finished upload
+            return true;
+        }
+        break;
+
+    default:
+        return false;
+    }
+
+    auto it = uploads.find(conn->id);
+    if (it == uploads.end()) {
+        mg_http_message msg;
+        int headersLength = mg_http_parse((char *)conn->recv.buf, conn->recv.len, &msg);
+        if (headersLength <= 0 || !isRingtoneUpload(msg, name))
+            return false;
+
+        // the rest is a raw body, mongoose mustn't parse it as HTTP
+        conn->pfn = NULL;
+        auto upload = beginRingtone(conn, msg, name);
+        if (!upload) {
+            conn->recv.len = 0;  // the body of a rejected upload is dropped
+            return true;
+        }
+
+        memmove(conn->recv.buf, conn->recv.buf + headersLength, conn->recv.len - headersLength);
+        conn->recv.len -= headersLength;
+        it = uploads.emplace(conn->id, std::move(upload)).first;
+    }
+
+    RingtoneUpload &upload = *it->second;
+    size_t available = std::min(conn->recv.len, upload.remaining());
+    // the receive buffer grows until a chunk is there, then it's written
+    size_t length = available == upload.remaining()
+                        ? available : available - available % ringtoneWriteChunk;
+    if (length == 0)
+        return true;
+
+    bool receiving = writeRingtone(conn, upload, conn->recv.buf, length);
+    memmove(conn->recv.buf, conn->recv.buf + length, conn->recv.len - length);
+    conn->recv.len -= length;
+    if (!receiving)
+        uploads.erase(it);
+    return true;
+}
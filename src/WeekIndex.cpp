@@ -0,0 +1,103 @@
+#include "WeekIndex.hpp"
+
+
+uint16_t WeekIndex::key(const HwAlarm &alarm)
+{
+    return alarm.period() == HwAlarm::minutesPerWeek
+               ? alarm.minuteOfPeriod()
+               : dayKey(alarm.minuteOfPeriod());
+}
+
+void WeekIndex::insert(handle_t handle, const HwAlarm &alarm)
+{
+    uint16_t k = key(alarm);
+
+    if (handle >= m_next.size()) {
+        m_next.resize(handle + 1, noHandle);
+        m_prev.resize(handle + 1, noHandle);
+    }
+
+    // push the handle to the front of the minute's list
+    auto head = findHead(k);
+    handle_t oldHead = noHandle;
+
+    if (head != m_heads.end() && head->key == k) {
+        oldHead = head->handle;
+        head->handle = handle;
+    } else {
+        m_heads.insert(head, {k, handle});
+    }
+    m_next[handle] = oldHead;
+    m_prev[handle] = noHandle;
+    if (oldHead != noHandle)
+        m_prev[oldHead] = handle;
+
+    if (k < HwAlarm::minutesPerWeek)
+        m_week.set(k);
+    else
+        m_day.set(k - HwAlarm::minutesPerWeek);
+}
+
+void WeekIndex::remove(handle_t handle, const HwAlarm &alarm)
+{
+    uint16_t k = key(alarm);
+    handle_t next = m_next[handle];
+    handle_t prev = m_prev[handle];
+
+    if (next != noHandle)
+        m_prev[next] = prev;
+
+    if (prev != noHandle) {
+        m_next[prev] = next;
+        return;  // the minute has other alarms, so its head is still valid
+    }
+
+    auto head = findHead(k);
+    if (next != noHandle) {
+        head->handle = next;
+        return;
+    }
+
+    // it was the only alarm of this minute
+    m_heads.erase(head);
+    if (k < HwAlarm::minutesPerWeek)
+        m_week.reset(k);
+    else
+        m_day.reset(k - HwAlarm::minutesPerWeek);
+}
+
+void WeekIndex::clear()
+{
+    m_week = {};
+    m_day = {};
+    m_heads.clear();
+    m_next.clear();
+    m_prev.clear();
+}
+
+int WeekIndex::nextOccupied(uint16_t minuteOfWeek) const
+{
+    uint16_t minuteOfDay = minuteOfWeek % HwAlarm::minutesPerDay;
+    int distance = -1;
+
+    int week = m_week.findNext(minuteOfWeek);
+    if (week < 0)
+        week = m_week.findNext(0);  // wrap around the end of the week
+    if (week >= 0)
+        distance = (week - minuteOfWeek + HwAlarm::minutesPerWeek)
+                   % HwAlarm::minutesPerWeek;
+
+    int day = m_day.findNext(minuteOfDay);
+    if (day < 0)
+        day = m_day.findNext(0);  // wrap around the end of the day
+    if (day >= 0) {
+        int dayDistance = (day - minuteOfDay + HwAlarm::minutesPerDay)
+                          % HwAlarm::minutesPerDay;
+        if (distance < 0 || dayDistance < distance)
+            distance = dayDistance;
+    }
+
+    if (distance < 0)
+        return -1;
+    return (minuteOfWeek + distance) % HwAlarm::minutesPerWeek;
+}
@@ -1,4 +1,6 @@
 // clang-format off
+#include <cinttypes>
+#include <map>
 #include <vector>
 #include <memory>
 
@@ -22,6 +24,9 @@
 #include "ArduinoJson.h"
 
 #include "AlarmService.hpp"
+#include "RingtoneLibrary.hpp"
+#include "RingtoneUpload.hpp"
+#include "TimeService.hpp"
 #include "WebApi.hpp"
 #include "UrlParser.hpp"
 #include "Tools.hpp"
@@ -42,10 +47,12 @@
 #define SCL2                   17
 //========================  Delays  ============================
 #define BLINK_DELAY            500
+#define RTC_RESYNC_INTERVAL    600000     // 10 minutes
 //=======================  Time units  =========================
 #define HOUR_IN_SECS           3600
 #define HOUR_IN_MILLIS         3600000
 #define NTP_UPDATE_INTERVAL    20000      // 24 * HOUR_IN_MILLIS
+#define NTP_RESCHEDULE_STEP    2          // s, NTP time is whole seconds
 //====================  WiFi configuration  ====================
 #define LOCAL_IP               IPAddress(192, 168, 1, 200)
 #define GATEWAY                IPAddress(192, 168, 1, 1)
@@ -68,10 +75,6 @@
 #define HTTP_SERVER_PORT       8080
 // clang-format on
 
-typedef struct {
-    SemaphoreHandle_t   sem;
-    int                 type;
-} esp_pthread_mutex_t;  // FIXME VERY UNSAFE
 extern const uint8_t ssh_key_start[] asm("_binary_src_keys_server_key_start");
 
 WiFiUDP ntpUDP;
@@ -83,13 +86,10 @@ RTC_DS3231 rtc;
 std::shared_ptr<std::mutex> rtcMutex;
 Audio audio;
 
-static const uint8_t buildHour = (__TIME__[0] - '0') * 10 + (__TIME__[1] - '0');
-static const uint8_t buildMinute = (__TIME__[3] - '0') * 10 + (__TIME__[4] - '0');
 uint16_t potentiometer;
 byte volume;
 
 
-bool isDateTimeValid(const DateTime *dt);
 bool setup7segDisplay();
 bool setupRtc();
 void changeClockMode();
@@ -124,10 +124,14 @@ void setup()
         delay(2500);
         ESP.restart();
     }
+    MainTimeService.begin(&rtc, rtcMutex, RTC_RESYNC_INTERVAL, updateTimeFromNtp);
 
     SPI.begin(SCK, MISO, MOSI);
     SD.begin(SS, SPI);
-    log_i("SD card type: %d, size: %llu", SD.cardType(), SD.cardSize());
+    log_i("SD card type: %d, size: %" PRIu64, SD.cardType(), SD.cardSize());
+    // alarms look their ringtones up in the catalog, it's loaded before them
+    RingtoneUpload::recover();
+    MainRingtoneLibrary.begin(RingtoneUpload::directory);
     audio.setPinout(I2S_BCLK, I2S_LRC, I2S_DOUT);
 
     WiFi.disconnect();
@@ -149,26 +153,11 @@ void setup()
 
     timeClient.begin();
 
-    Alarm alarm0(buildHour, buildMinute - 1, Alarm::DaysOfWeek::everyDay, true);
-    Alarm alarm1(buildHour, buildMinute + 1, Alarm::DaysOfWeek::noDays, true);
-    Alarm alarm2(buildHour, buildMinute + 2, Alarm::DaysOfWeek::everyDay, true);
-    Alarm alarm3(buildHour, buildMinute + 3, 0b00101101, true);
-    Alarm alarm4(buildHour, buildMinute + 4, 0b01110110, true);
-    Alarm alarm5(buildHour, buildMinute + 4, Alarm::DaysOfWeek::everyDay, true);
-
     MainAlarmService.begin(
-        &rtc, &audio, rtcMutex, RTC_INTERRUPT_PIN, ALARM_STOP_BTN_PIN
+        &rtc, &MainTimeService, &audio, rtcMutex, RTC_INTERRUPT_PIN,
+        ALARM_STOP_BTN_PIN
     );
     MainAlarmService.setVolume(10);
-    // MainAlarmService.addAlarm(alarm0);
-    // MainAlarmService.addAlarm(alarm1);
-    // MainAlarmService.addAlarm(alarm2);
-    // MainAlarmService.addAlarm(alarm3);
-    // MainAlarmService.addAlarm(alarm4);
-    // MainAlarmService.addAlarm(alarm5);
-    // MainAlarmService.setAlarmState(alarm3.id(), false);
-    // MainAlarmService.setAlarmTime(alarm5.id(), buildHour, buildMinute + 5);
-    // MainAlarmService.setAlarmDaysOfWeek(alarm0.id(), 0b01100110);
 
     MainAlarmService.dumpAlarms();
 
@@ -201,7 +190,7 @@ bool setup7segDisplay()
         return false;
     }
     log_i("Started 7-seg display with sda = %d, scl = %d", SDA2, SCL2);
-    seg.cacheOff();
+    seg.cacheOn();  // only changed digits are sent over I2C
     seg.brightness(15);
     seg.blink(0);
     seg.displayClear();
@@ -235,66 +224,102 @@ void updateTimeFromNtp()
     ntpTime = DateTime(timeClient.getEpochTime());
     ntpTime.toString(ntpTimeStr);
 
-    {
-        std::lock_guard<std::mutex> lock(*rtcMutex);
-        rtc.adjust(ntpTime);
-    }
-    log_d("Updated time to %s", ntpTimeStr);
+    int32_t step = MainTimeService.adjust(ntpTime);
+    // the fire times hold while the clock is only trimmed
+    if (abs(step) >= NTP_RESCHEDULE_STEP)
+        MainAlarmService.rescheduleAlarms();
+    log_d("Updated time to %s, stepped by %d s", ntpTimeStr, step);
 }
 
 void updateDisplayTask(void *pvParameters)
 {
-    unsigned long lastBlinked = millis();
-    bool dotsState = false;
-
-    DateTime now;
-    char *time;
-    bool lostPower;
+    // what the display shows: hour digits, colon, minute digits
+    uint8_t  shown[5] = {0xff, 0xff, 0xff, 0xff, 0xff};
+    uint32_t writes = 0;    // I2C writes to the display since the last report
+    int64_t  busyTime = 0;  // us
+    int64_t  reportTime = esp_timer_get_time();
+    uint8_t  lastMinute = 0xff;
 
     log_i("Entered task %s", pcTaskGetTaskName(NULL));
 
     while (true) {
-        {
-            std::lock_guard<std::mutex> lock(*rtcMutex);
-            now = rtc.now();
-            lostPower = rtc.lostPower();
+        int64_t  startTime = esp_timer_get_time();
+        uint32_t micros;
+        // TimeService checks the RTC and updates time from NTP if it's invalid
+        DateTime now(MainTimeService.unixtime(&micros));
+        // the colon is lit for BLINK_DELAY since the start of each second
+        bool     colon = micros < BLINK_DELAY * 1000;
+        uint8_t  frame[5] = {
+            (uint8_t)(now.hour() / 10), (uint8_t)(now.hour() % 10), colon,
+            (uint8_t)(now.minute() / 10), (uint8_t)(now.minute() % 10)};
+
+        // the cache of HT16K33 sends only the positions that have changed
+        seg.displayTime(now.hour(), now.minute(), colon, false);
+        for (int pos = 0; pos < 5; ++pos) {
+            writes += frame[pos] != shown[pos];
+            shown[pos] = frame[pos];
         }
-        
-        if (!isDateTimeValid(&now) || lostPower) {
-            updateTimeFromNtp();
-            log_w("Lost power: %d, or time is invalid: %d", lostPower, !isDateTimeValid(&now));
+        busyTime += esp_timer_get_time() - startTime;
+
+        if (now.minute() != lastMinute) {
+            float elapsed = esp_timer_get_time() - reportTime;
+            if (lastMinute != 0xff)
+                log_i(
+                    "Display: %.2f I2C writes/s, %.3f%% CPU",
+                    writes * 1e6 / elapsed, busyTime * 100 / elapsed
+                );
+            lastMinute = now.minute();
+            writes = 0;
+            busyTime = 0;
+            reportTime = esp_timer_get_time();
         }
-        char format[] = "DDD, DD MMM YYYY hh:mm:ss";
-        time = now.toString(format);
-
-        if ((millis() - lastBlinked) > BLINK_DELAY) {
-            dotsState ^= 1;
-            lastBlinked = millis();
-            
-            // FIXME VERY BAD HACK
-            bool locked = xSemaphoreTake(((esp_pthread_mutex_t *)(*(MainAlarmService.m_lock).native_handle()))->sem, 0) == pdFALSE;
-            if (!locked) {
-                xSemaphoreGive(((esp_pthread_mutex_t *)(*(MainAlarmService.m_lock).native_handle()))->sem);
-            }
+
+#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_DEBUG
+        if (colon) {
+            char format[] = "DDD, DD MMM YYYY hh:mm:ss";
 
             log_d(
-                "RTC time: %s, free heap: %d, mutex state: %s",
-                time, ESP.getFreeHeap(), locked ? "locked" : "free"
+                "RTC time: %s, free heap: %d", now.toString(format),
+                ESP.getFreeHeap()
             );
         }
+#endif
 
-        seg.displayTime(now.hour(), now.minute(), false, false);
-        seg.writePos(2, dotsState ? COLON : NO_DOTS);
-        vPortYield();
+        // sleep until the colon toggles, a new minute always starts with it
+        uint32_t untilToggle = (colon ? BLINK_DELAY * 1000 : 1000000) - micros;
+        vTaskDelay(pdMS_TO_TICKS(untilToggle / 1000 + 1));
     }
 
     vTaskDelete(NULL);
 }
 
+// a chunked body gets more chunks while less than this is waiting to be sent
+static const size_t sendHighWater = 2048;
+
+// writes chunks of the body until enough is buffered, false once it's over
+static bool writeBody(mg_connection *conn, UrlParser::BodyWriter &body)
+{
+    while (conn->send.len < sendHighWater) {
+        if (!body.write(conn)) {
+            if (body.failed())
+                conn->is_draining = 1;  // without the last chunk it's seen as cut
+            else
+                mg_http_write_chunk(conn, "", 0);  // the last, empty chunk
+            return false;
+        }
+    }
+    return true;
+}
+
 static void
     mgCallback(struct mg_connection *conn, int evt, void *evt_data, void *fn_data)
 {
-    static char buf[1024];
+    // chunked bodies being sent, by connection id
+    static std::map<unsigned long, std::unique_ptr<UrlParser::BodyWriter>> bodies;
+
+    if (api::streamRingtone(conn, evt, evt_data))
+        return;
+
     if (evt == MG_EV_HTTP_MSG) {
         log_i("Got http message");
 
@@ -302,18 +327,39 @@ static void
         UrlParser::Response resp;
         log_i("HTTP message: \n%.*s", msg->message.len, msg->message.ptr);
 
-        StaticJsonDocument<1024> doc;
-        resp.data = doc.to<JsonObject>();
-
+        int64_t startTime = esp_timer_get_time();
         UrlParser::Result result = ApiUrlParser.match(*msg, resp);
+        // the time to respond, with the wait for AlarmService
+        log_i(
+            "%.*s %.*s: %d in %" PRId64 " us", (int)msg->method.len, msg->method.ptr,
+            (int)msg->uri.len, msg->uri.ptr, result.code,
+            esp_timer_get_time() - startTime
+        );
+
+        if (resp.body) {
+            // the reason phrase is optional, the code is enough
+            mg_printf(
+                conn, "HTTP/1.1 %d \r\n%sTransfer-Encoding: chunked\r\n\r\n",
+                result.code, resp.headers.c_str()
+            );
+            if (writeBody(conn, *resp.body))
+                bodies[conn->id] = std::move(resp.body);
+        } else if (!resp.data.isNull()) {
+            std::string body;
 
-        if (!resp.data.isNull()) {
             resp.headers += "Content-Type: application/json\r\n";
-            serializeJson(resp.data, buf, sizeof(buf));
+            serializeJson(resp.data, body);
 
-            log_i("Response: '%s'", buf);
-            mg_http_reply(conn, result.code, resp.headers.c_str(), buf);
+            log_i("Response: '%s'", body.c_str());
+            mg_http_reply(conn, result.code, resp.headers.c_str(), "%s", body.c_str());
         }
+    } else if (evt == MG_EV_WRITE) {
+        // the connection has sent some, so there's room for more chunks
+        auto it = bodies.find(conn->id);
+        if (it != bodies.end() && !writeBody(conn, *it->second))
+            bodies.erase(it);
+    } else if (evt == MG_EV_CLOSE) {
+        bodies.erase(conn->id);
     }
 }
 
@@ -450,14 +496,6 @@ cleanup:
     vTaskDelete(NULL);
 }
 
-bool isDateTimeValid(const DateTime *dt)
-{
-    return (dt->hour() <= 23) && (dt->minute() <= 59) && (dt->second() <= 59)
-           && (dt->dayOfTheWeek() <= 6) && (dt->day() >= 1 && dt->day() <= 31)
-           && (dt->month() >= 1 && dt->month() <= 12)
-           && (dt->year() <= 2099);
-}
-
 void audio_info(const char *info)
 {
     Serial.print("info        ");